@@ -0,0 +1,155 @@
+#pragma once
+
+#include <natscpp/connection.hpp>
+#include <natscpp/error.hpp>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Chunked transfer for bodies above the NATS max_payload, spoken by the
+// gateway and the flow-pipe stages in both directions.
+//
+// Every chunk carries `flow-chunk: <index>/<count>`. Chunk 0 also carries
+// `flow-chunk-total: <bytes>` and, as its NATS reply-to, the sender's credit
+// inbox. The receiver grants credit by publishing an empty message with
+// `flow-chunk-credit: <n>` there, meaning the sender may have sent chunks
+// [0, n). A credit's reply-to, when set, is the subject the remaining chunks
+// go to; this is how a request's chunks follow chunk 0 to the queue-group
+// worker that picked it up. Senders wait for credit instead of flooding the
+// connection, so a multi-MB body never has more than one window in flight.
+//
+// All chunks but the last are as large as chunk 0, so a receiver can place
+// each one by index. The gateway's credit inbox is the request's own reply
+// subject: credits reach the call through its ReplyMux slot like the reply.
+namespace chunking {
+
+using Clock = std::chrono::steady_clock;
+
+inline constexpr std::string_view kChunkHeader = "flow-chunk";
+inline constexpr std::string_view kTotalHeader = "flow-chunk-total";
+inline constexpr std::string_view kCreditHeader = "flow-chunk-credit";
+// Request chunk 0 only: the reply subject, since reply-to is the credit
+// inbox (which for the gateway is the same subject).
+inline constexpr std::string_view kReplyHeader = "flow-reply";
+
+// Parses a `flow-chunk` value. False when absent or malformed.
+inline bool ParseChunk(std::string_view value, uint32_t *index, uint32_t *count) {
+  const size_t slash = value.find('/');
+  if (slash == std::string_view::npos) {
+    return false;
+  }
+  const char *end = value.data() + value.size();
+  auto [index_end, index_ec] = std::from_chars(value.data(), value.data() + slash, *index);
+  auto [count_end, count_ec] = std::from_chars(value.data() + slash + 1, end, *count);
+  return index_ec == std::errc{} && index_end == value.data() + slash &&
+         count_ec == std::errc{} && count_end == end && *index < *count;
+}
+
+// Parses a decimal header value.
+inline bool ParseSize(std::string_view value, uint64_t *size) {
+  auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), *size);
+  return !value.empty() && ec == std::errc{} && end == value.data() + value.size();
+}
+
+// Credit to grant after `received` chunks: another window once fewer than
+// half a window remain outstanding, or the current grant otherwise.
+inline uint32_t NextGrant(uint32_t received, uint32_t granted, uint32_t count,
+                          uint32_t window) {
+  if (granted >= count || granted - received > window / 2) {
+    return granted;
+  }
+  return std::min(count, received + window);
+}
+
+// Grants chunks [0, granted) to the sender whose credit inbox is `to`;
+// send_to, when set, is where it should send them. Publish failures throw
+// natscpp::nats_error.
+inline void SendCredit(natscpp::connection &nc, std::string_view to, uint32_t granted,
+                       std::string_view send_to = {}) {
+  auto credit = natscpp::message::create(to, send_to, "");
+  credit.set_header(kCreditHeader, std::to_string(granted));
+  nc.publish(std::move(credit));
+}
+
+// Sender side for one body, driven by the credits its receiver grants. It
+// never waits, so it runs on whichever thread a credit arrives on. The body
+// is borrowed and must outlive the transfer.
+class ChunkSender {
+public:
+  // Chunks go to subject until a credit names another.
+  ChunkSender(std::string_view body, size_t chunk_bytes, std::string_view subject)
+      : body_(body), chunk_bytes_(std::max<size_t>(chunk_bytes, 1)),
+        count_(static_cast<uint32_t>((body.size() + chunk_bytes_ - 1) / chunk_bytes_)),
+        target_(subject) {}
+
+  uint32_t count() const { return count_; }
+  bool done() const { return sent_ >= count_; }
+
+  // Chunk 0, to be published by the caller as a message whose reply-to is
+  // where credits should come back, after Label.
+  std::string_view first() const { return Chunk(0); }
+  void Label(natscpp::message &first) const {
+    first.set_header(kChunkHeader, "0/" + std::to_string(count_));
+    first.set_header(kTotalHeader, std::to_string(body_.size()));
+  }
+
+  // Publishes the chunks credit allows that have not been sent yet. Returns
+  // done(). Publish failures throw natscpp::nats_error.
+  bool OnCredit(natscpp::connection &nc, const natscpp::message &credit) {
+    uint64_t granted = 0;
+    if (!ParseSize(credit.header(kCreditHeader), &granted)) {
+      return done();
+    }
+    if (!credit.reply_to().empty()) {
+      target_ = credit.reply_to();
+    }
+    for (; sent_ < std::min<uint64_t>(granted, count_); ++sent_) {
+      auto msg = natscpp::message::create(target_, "", Chunk(sent_));
+      msg.set_header(kChunkHeader, std::to_string(sent_) + "/" + std::to_string(count_));
+      nc.publish(std::move(msg));
+    }
+    return done();
+  }
+
+private:
+  std::string_view Chunk(uint32_t index) const {
+    return body_.substr(static_cast<size_t>(index) * chunk_bytes_, chunk_bytes_);
+  }
+
+  std::string_view body_;
+  size_t chunk_bytes_;
+  uint32_t count_;
+  uint32_t sent_{1};
+  std::string target_;
+};
+
+// Feeds credits arriving on `credits` (the subscription to the sender's
+// credit inbox) to sender until every chunk is out. False if the receiver
+// stopped granting before deadline; publish failures throw
+// natscpp::nats_error. For senders that may block, such as a stage thread.
+inline bool SendRest(natscpp::connection &nc, natscpp::subscription &credits,
+                     ChunkSender &sender, Clock::time_point deadline) {
+  while (!sender.done()) {
+    const auto wait =
+        std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now());
+    if (wait.count() <= 0) {
+      return false;
+    }
+    try {
+      sender.OnCredit(nc, credits.next_message(wait));
+    } catch (const natscpp::nats_error &e) {
+      if (e.status() == NATS_TIMEOUT) {
+        return false;
+      }
+      throw;
+    }
+  }
+  return true;
+}
+
+} // namespace chunking
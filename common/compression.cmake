@@ -0,0 +1,26 @@
+# ------------------------------------------------------------
+# lz4 / zstd payload codecs (see compression.h), for the gateway and the
+# stage plugins alike. Each codec is enabled when pkg-config finds its
+# library; otherwise compressed messages are dropped as undecodable and
+# nothing is sent compressed.
+# ------------------------------------------------------------
+find_package(PkgConfig QUIET)
+if(PkgConfig_FOUND)
+  pkg_check_modules(FLOWPIPE_RPC_LZ4 QUIET IMPORTED_TARGET liblz4)
+  pkg_check_modules(FLOWPIPE_RPC_ZSTD QUIET IMPORTED_TARGET libzstd)
+endif()
+
+function(enable_payload_compression target)
+  if(FLOWPIPE_RPC_LZ4_FOUND)
+    target_compile_definitions(${target} PRIVATE FLOWPIPE_RPC_LZ4=1)
+    target_link_libraries(${target} PRIVATE PkgConfig::FLOWPIPE_RPC_LZ4)
+  else()
+    message(STATUS "${target}: liblz4 not found, lz4 compression disabled")
+  endif()
+  if(FLOWPIPE_RPC_ZSTD_FOUND)
+    target_compile_definitions(${target} PRIVATE FLOWPIPE_RPC_ZSTD=1)
+    target_link_libraries(${target} PRIVATE PkgConfig::FLOWPIPE_RPC_ZSTD)
+  else()
+    message(STATUS "${target}: libzstd not found, zstd compression disabled")
+  endif()
+endfunction()
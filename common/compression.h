@@ -0,0 +1,204 @@
+#pragma once
+
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#if FLOWPIPE_RPC_LZ4
+#include <lz4.h>
+#endif
+#if FLOWPIPE_RPC_ZSTD
+#include <zstd.h>
+#endif
+
+// Payload compression between the gateway and the flow-pipe stages.
+//
+// A compressed body carries `content-encoding: lz4|zstd` and
+// `flow-decoded-length: <bytes>`, so the receiver can size its buffer before
+// decoding. Requests advertise the codecs the gateway can decode in
+// `accept-encoding`; the sink compresses a reply only with one listed there.
+// Codecs are compiled in when compression.cmake finds liblz4 / libzstd.
+namespace compression {
+
+enum class Codec : uint8_t { kNone, kLz4, kZstd };
+
+inline constexpr std::string_view kEncodingHeader = "content-encoding";
+inline constexpr std::string_view kAcceptHeader = "accept-encoding";
+inline constexpr std::string_view kLengthHeader = "flow-decoded-length";
+// Payload meta attribute carrying a request's accept-encoding from the
+// source stage to the sink.
+inline constexpr const char *kAcceptAttr = "accept_encoding";
+
+// The codec called name, or kNone if unknown or not built in.
+inline Codec ParseCodec(std::string_view name) {
+#if FLOWPIPE_RPC_LZ4
+  if (name == "lz4") {
+    return Codec::kLz4;
+  }
+#endif
+#if FLOWPIPE_RPC_ZSTD
+  if (name == "zstd") {
+    return Codec::kZstd;
+  }
+#endif
+  (void)name;
+  return Codec::kNone;
+}
+
+inline std::string_view Name(Codec codec) {
+  switch (codec) {
+  case Codec::kLz4:
+    return "lz4";
+  case Codec::kZstd:
+    return "zstd";
+  case Codec::kNone:
+    break;
+  }
+  return {};
+}
+
+// Built-in codecs as an accept-encoding value, e.g. "zstd, lz4".
+inline std::string Supported() {
+  std::string list;
+#if FLOWPIPE_RPC_ZSTD
+  list += "zstd";
+#endif
+#if FLOWPIPE_RPC_LZ4
+  list += list.empty() ? "lz4" : ", lz4";
+#endif
+  return list;
+}
+
+// True if an accept-encoding list such as "zstd, lz4" names codec.
+inline bool Accepts(std::string_view accept, Codec codec) {
+  const std::string_view name = Name(codec);
+  while (!name.empty() && !accept.empty()) {
+    const size_t comma = accept.find(',');
+    std::string_view item = accept.substr(0, comma);
+    while (!item.empty() && item.front() == ' ') {
+      item.remove_prefix(1);
+    }
+    while (!item.empty() && item.back() == ' ') {
+      item.remove_suffix(1);
+    }
+    if (item == name) {
+      return true;
+    }
+    accept = comma == std::string_view::npos ? std::string_view() : accept.substr(comma + 1);
+  }
+  return false;
+}
+
+#if FLOWPIPE_RPC_ZSTD
+// Level 1 is the fastest setting and already shrinks text several times.
+inline constexpr int kZstdLevel = 1;
+
+// One compression and one decompression context per thread, reused across
+// calls instead of being allocated per message.
+inline ZSTD_CCtx *ThreadCCtx() {
+  thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx *)> ctx(
+      ZSTD_createCCtx(), ZSTD_freeCCtx);
+  return ctx.get();
+}
+
+inline ZSTD_DCtx *ThreadDCtx() {
+  thread_local std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx *)> ctx(
+      ZSTD_createDCtx(), ZSTD_freeDCtx);
+  return ctx.get();
+}
+#endif
+
+// Replaces out with data compressed by codec. False, with out unspecified,
+// when the codec is unavailable or the result would not be smaller.
+inline bool Compress(Codec codec, std::string_view data, std::string *out) {
+  switch (codec) {
+#if FLOWPIPE_RPC_LZ4
+  case Codec::kLz4: {
+    if (data.size() > LZ4_MAX_INPUT_SIZE) {
+      return false;
+    }
+    out->resize(LZ4_compressBound(static_cast<int>(data.size())));
+    const int size = LZ4_compress_default(data.data(), out->data(),
+                                          static_cast<int>(data.size()),
+                                          static_cast<int>(out->size()));
+    if (size <= 0 || static_cast<size_t>(size) >= data.size()) {
+      return false;
+    }
+    out->resize(size);
+    return true;
+  }
+#endif
+#if FLOWPIPE_RPC_ZSTD
+  case Codec::kZstd: {
+    out->resize(ZSTD_compressBound(data.size()));
+    const size_t size = ZSTD_compressCCtx(ThreadCCtx(), out->data(), out->size(),
+                                          data.data(), data.size(), kZstdLevel);
+    if (ZSTD_isError(size) || size >= data.size()) {
+      return false;
+    }
+    out->resize(size);
+    return true;
+  }
+#endif
+  default:
+    (void)data;
+    (void)out;
+    return false;
+  }
+}
+
+// Parses a flow-decoded-length value no larger than limit.
+inline bool ParseLength(std::string_view value, size_t limit, size_t *length) {
+  uint64_t parsed = 0;
+  auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), parsed);
+  if (value.empty() || ec != std::errc{} || end != value.data() + value.size() ||
+      parsed > limit) {
+    return false;
+  }
+  *length = static_cast<size_t>(parsed);
+  return true;
+}
+
+// Decodes data into out, which holds exactly length bytes. False for
+// unknown codecs or corrupt bodies.
+inline bool Decompress(Codec codec, std::string_view data, void *out, size_t length) {
+  switch (codec) {
+#if FLOWPIPE_RPC_LZ4
+  case Codec::kLz4:
+    return data.size() <= LZ4_MAX_INPUT_SIZE && length <= LZ4_MAX_INPUT_SIZE &&
+           LZ4_decompress_safe(data.data(), static_cast<char *>(out),
+                               static_cast<int>(data.size()),
+                               static_cast<int>(length)) == static_cast<int>(length);
+#endif
+#if FLOWPIPE_RPC_ZSTD
+  case Codec::kZstd: {
+    const size_t size = ZSTD_decompressDCtx(ThreadDCtx(), out, length, data.data(), data.size());
+    return !ZSTD_isError(size) && size == length;
+  }
+#endif
+  default:
+    (void)data;
+    (void)out;
+    (void)length;
+    return false;
+  }
+}
+
+// Decodes a body received with the given content-encoding and
+// flow-decoded-length header values into out. False for unknown codecs,
+// bodies that decode to more than limit bytes, and corrupt bodies.
+inline bool Decompress(std::string_view encoding, std::string_view length,
+                       std::string_view data, size_t limit, std::string *out) {
+  const Codec codec = ParseCodec(encoding);
+  size_t size = 0;
+  if (codec == Codec::kNone || !ParseLength(length, limit, &size)) {
+    return false;
+  }
+  out->resize(size);
+  return Decompress(codec, data, out->data(), size);
+}
+
+} // namespace compression
@@ -0,0 +1,134 @@
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "ascii_case.h"
+#include "flowpipe/stage.h"
+#include "kernels.h"
+#include "traceparent.h"
+
+using namespace flowpipe;
+
+// Per-request hot paths of the rpc stages. Sizes sweep 16 B .. 64 KiB by
+// powers of 4; run with --benchmark_format=json (or --benchmark_out=FILE
+// --benchmark_out_format=json) to compare commits.
+namespace {
+
+constexpr int64_t kMinSize = 16;
+constexpr int64_t kMaxSize = 64 << 10;
+
+const std::string kTraceparent = "00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01";
+
+std::vector<uint8_t> make_text(size_t n) {
+  std::vector<uint8_t> data(n);
+  for (size_t i = 0; i < n; ++i) {
+    data[i] = static_cast<uint8_t>("Hello, Flow-Pipe! {\"k\": [1, 2]}\n"[i % 32]);
+  }
+  return data;
+}
+
+void BM_HexDecode(benchmark::State& state) {
+  uint8_t out[16];
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(rpc_stages::hex_decode(kTraceparent.data() + 3, out, 16));
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * 32);
+}
+BENCHMARK(BM_HexDecode);
+
+void BM_ParseTraceparent(benchmark::State& state) {
+  for (auto _ : state) {
+    PayloadMeta meta;
+    rpc_stages::parse_traceparent(kTraceparent, meta);
+    benchmark::DoNotOptimize(meta);
+  }
+}
+BENCHMARK(BM_ParseTraceparent);
+
+void BM_EncodeTraceparent(benchmark::State& state) {
+  PayloadMeta meta;
+  rpc_stages::parse_traceparent(kTraceparent, meta);
+  char out[rpc_stages::kTraceparentSize];
+  for (auto _ : state) {
+    rpc_stages::encode_traceparent(meta, out);
+    benchmark::DoNotOptimize(out);
+    benchmark::ClobberMemory();
+  }
+}
+BENCHMARK(BM_EncodeTraceparent);
+
+// The conversion RPCTransform::process runs, per instruction set the CPU
+// supports (arg 1 is the ascii::Isa).
+void BM_Uppercase(benchmark::State& state) {
+  const auto isa = static_cast<ascii::Isa>(state.range(1));
+  if (!ascii::isa_supported(isa)) {
+    state.SkipWithError("isa not supported on this cpu");
+    return;
+  }
+  const auto size = static_cast<size_t>(state.range(0));
+  const auto src = make_text(size);
+  std::vector<uint8_t> dst(size);
+  for (auto _ : state) {
+    ascii::to_upper(isa, src.data(), dst.data(), size);
+    benchmark::DoNotOptimize(dst.data());
+    benchmark::ClobberMemory();
+  }
+  state.SetLabel(ascii::isa_name(isa));
+  state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(size));
+}
+BENCHMARK(BM_Uppercase)
+    ->ArgsProduct({benchmark::CreateRange(kMinSize, kMaxSize, 4),
+                   {static_cast<int64_t>(ascii::Isa::kScalar), static_cast<int64_t>(ascii::Isa::kSse2),
+                    static_cast<int64_t>(ascii::Isa::kAvx2), static_cast<int64_t>(ascii::Isa::kAvx512)}});
+
+// Every registered rpc_transform kernel (arg 1 indexes kernels::kRegistry).
+void BM_Kernel(benchmark::State& state) {
+  const auto& kernel = kernels::kRegistry[static_cast<size_t>(state.range(1))];
+  const auto size = static_cast<size_t>(state.range(0));
+  auto src = make_text(size);
+  if (kernel.name == "base64_decode") {
+    // Feed it valid input: the encoding of the text.
+    const auto& encode = *kernels::find("base64_encode");
+    std::vector<uint8_t> encoded(encode.max_output(size));
+    size_t n = 0;
+    encode.run(src.data(), size, encoded.data(), &n);
+    encoded.resize(n);
+    src = std::move(encoded);
+  }
+  std::vector<uint8_t> dst(kernel.max_output(src.size()));
+  size_t out_size = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(kernel.run(src.data(), src.size(), dst.data(), &out_size));
+    benchmark::ClobberMemory();
+  }
+  state.SetLabel(std::string(kernel.name));
+  state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(src.size()));
+}
+BENCHMARK(BM_Kernel)->ArgsProduct(
+    {benchmark::CreateRange(kMinSize, kMaxSize, 4),
+     benchmark::CreateDenseRange(0, static_cast<int64_t>(kernels::kRegistry.size()) - 1, 1)});
+
+// What the source does per message when it cannot adopt the NATS buffer,
+// and what the transform does per payload when it cannot work in place.
+void BM_PayloadAllocateCopy(benchmark::State& state) {
+  const auto size = static_cast<size_t>(state.range(0));
+  const auto src = make_text(size);
+  PayloadMeta meta;
+  rpc_stages::parse_traceparent(kTraceparent, meta);
+  for (auto _ : state) {
+    auto buffer = AllocatePayloadBuffer(size);
+    std::memcpy(buffer.get(), src.data(), size);
+    Payload payload(std::move(buffer), size, meta);
+    benchmark::DoNotOptimize(payload.data());
+  }
+  state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(size));
+}
+BENCHMARK(BM_PayloadAllocateCopy)->Range(kMinSize, kMaxSize)->RangeMultiplier(4);
+
+}  // namespace
+
+BENCHMARK_MAIN();
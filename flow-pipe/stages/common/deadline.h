@@ -0,0 +1,57 @@
+#pragma once
+
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <variant>
+
+#include "flowpipe/stage.h"
+
+// Request deadlines propagated from the gateway. The gateway sends the time
+// budget left at publish as `flow-deadline-ms`; nats_request_source turns it
+// into an absolute steady_clock deadline for this process (so stages never
+// compare clocks across hosts) and later stages drop payloads whose caller
+// has already given up.
+namespace rpc_stages {
+
+inline constexpr const char* kDeadlineHeader = "flow-deadline-ms";
+inline constexpr const char* kDeadlineAttr = "deadline_ns";
+
+inline int64_t steady_now_ns() noexcept {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Records the deadline carried by a `flow-deadline-ms` header value.
+// Malformed or empty values leave the payload without a deadline.
+inline void record_deadline(std::string_view remaining_ms, flowpipe::PayloadMeta& meta) {
+  int64_t ms = 0;
+  auto [end, ec] = std::from_chars(remaining_ms.data(), remaining_ms.data() + remaining_ms.size(), ms);
+  if (remaining_ms.empty() || ec != std::errc{} || end != remaining_ms.data() + remaining_ms.size()) {
+    return;
+  }
+  meta.set_attr(kDeadlineAttr, std::to_string(steady_now_ns() + ms * 1'000'000));
+}
+
+// The payload's deadline in steady_now_ns() terms, or 0 when it has none.
+inline int64_t deadline_ns(const flowpipe::PayloadMeta& meta) noexcept {
+  const auto* value = meta.get_attr(kDeadlineAttr);
+  const std::string* deadline = value ? std::get_if<std::string>(value) : nullptr;
+  if (!deadline) {
+    return 0;
+  }
+  int64_t ns = 0;
+  auto [end, ec] = std::from_chars(deadline->data(), deadline->data() + deadline->size(), ns);
+  return ec == std::errc{} ? ns : 0;
+}
+
+// True if the payload carries a deadline that has passed.
+inline bool deadline_expired(const flowpipe::PayloadMeta& meta) noexcept {
+  const int64_t deadline = deadline_ns(meta);
+  return deadline != 0 && steady_now_ns() >= deadline;
+}
+
+}  // namespace rpc_stages
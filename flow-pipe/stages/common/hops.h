@@ -0,0 +1,62 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <variant>
+
+#include "flowpipe/stage.h"
+
+// Per-hop latency breakdown. When the gateway is asked to time hops it sends
+// `flow-hops: pub=<ns>`; every stage appends `,<hop>=<ns>` as the request
+// passes and nats_reply_sink returns the list on the reply, where the
+// gateway turns consecutive pairs into per-segment durations. Timestamps are
+// wall-clock nanoseconds since the epoch, so segments that cross hosts
+// (NATS transit) include any clock skew between them. Requests without the
+// header are not touched.
+namespace rpc_stages {
+
+inline constexpr const char* kHopsHeader = "flow-hops";
+inline constexpr const char* kHopsAttr = "hops";
+
+inline int64_t wall_now_ns() noexcept {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+// The hop list carried by the payload, or null when it is not being timed.
+inline const std::string* hops(const flowpipe::PayloadMeta& meta) noexcept {
+  const auto* value = meta.get_attr(kHopsAttr);
+  return value ? std::get_if<std::string>(value) : nullptr;
+}
+
+// Appends `,<hop>=<ns>` to the list.
+inline void append_hop(std::string& list, std::string_view hop, int64_t ns) {
+  list.append(",").append(hop).append("=").append(std::to_string(ns));
+}
+
+// Source side: adopts the list from a `flow-hops` header value and stamps
+// the receive time. Empty values leave the payload untimed.
+inline void record_hops(std::string_view header, flowpipe::PayloadMeta& meta) {
+  if (header.empty()) {
+    return;
+  }
+  std::string list(header);
+  append_hop(list, "recv", wall_now_ns());
+  meta.set_attr(kHopsAttr, std::move(list));
+}
+
+// Stamps a hop on a payload that is being timed.
+inline void stamp_hop(flowpipe::PayloadMeta& meta, std::string_view hop, int64_t ns) {
+  const std::string* current = hops(meta);
+  if (!current) {
+    return;
+  }
+  std::string list = *current;
+  append_hop(list, hop, ns);
+  meta.set_attr(kHopsAttr, std::move(list));
+}
+
+}  // namespace rpc_stages
@@ -0,0 +1,19 @@
+# ------------------------------------------------------------
+# OTLP metrics for a stage plugin (see stage_metrics.h). Enabled when
+# opentelemetry-cpp with the OTLP gRPC metrics exporter is installed;
+# otherwise the instruments compile to no-ops.
+# ------------------------------------------------------------
+find_package(opentelemetry-cpp CONFIG QUIET)
+
+function(stage_enable_metrics target)
+  if(TARGET opentelemetry-cpp::metrics AND TARGET opentelemetry-cpp::otlp_grpc_metrics_exporter)
+    target_compile_definitions(${target} PRIVATE FLOWPIPE_STAGE_METRICS=1)
+    target_link_libraries(${target}
+            PRIVATE
+            opentelemetry-cpp::metrics
+            opentelemetry-cpp::otlp_grpc_metrics_exporter
+    )
+  else()
+    message(STATUS "${target}: opentelemetry-cpp metrics not found, stage metrics disabled")
+  endif()
+endfunction()
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+#if defined(FLOWPIPE_STAGE_METRICS)
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+#include <opentelemetry/context/context.h>
+#include <opentelemetry/exporters/otlp/otlp_grpc_metric_exporter_factory.h>
+#include <opentelemetry/exporters/otlp/otlp_grpc_metric_exporter_options.h>
+#include <opentelemetry/metrics/meter.h>
+#include <opentelemetry/sdk/metrics/export/periodic_exporting_metric_reader_factory.h>
+#include <opentelemetry/sdk/metrics/meter_provider.h>
+#include <opentelemetry/sdk/metrics/view/view_registry.h>
+#include <opentelemetry/sdk/resource/resource.h>
+#endif
+
+// Always-on OTLP metrics for the rpc stages, independent of trace sampling.
+// Each plugin library owns one MeterProvider exporting to
+// OTEL_EXPORTER_OTLP_ENDPOINT (or FLOWPIPE_OTEL_ENDPOINT) every
+// OTEL_METRIC_EXPORT_INTERVAL ms (OTEL_METRICS_EXPORTER=none turns export
+// off). Built without opentelemetry-cpp
+// (FLOWPIPE_STAGE_METRICS undefined) every instrument is a no-op.
+namespace rpc_stages::metrics {
+
+#if defined(FLOWPIPE_STAGE_METRICS)
+
+namespace detail {
+
+inline const char* env_or(const char* name, const char* fallback) {
+  const char* value = std::getenv(name);
+  return (value != nullptr && *value != '\0') ? value : fallback;
+}
+
+inline opentelemetry::metrics::Meter& meter() {
+  namespace metrics_sdk = opentelemetry::sdk::metrics;
+  namespace otlp = opentelemetry::exporter::otlp;
+
+  static std::shared_ptr<metrics_sdk::MeterProvider> provider = [] {
+    otlp::OtlpGrpcMetricExporterOptions exporter_opts;
+    const char* endpoint = env_or("OTEL_EXPORTER_OTLP_ENDPOINT", env_or("FLOWPIPE_OTEL_ENDPOINT", nullptr));
+    if (endpoint != nullptr) {
+      exporter_opts.endpoint = endpoint;
+    }
+    metrics_sdk::PeriodicExportingMetricReaderOptions reader_opts;
+    reader_opts.export_interval_millis =
+        std::chrono::milliseconds(std::atol(env_or("OTEL_METRIC_EXPORT_INTERVAL", "10000")));
+    reader_opts.export_timeout_millis = std::chrono::milliseconds(5000);
+    if (reader_opts.export_interval_millis.count() <= reader_opts.export_timeout_millis.count()) {
+      reader_opts.export_interval_millis = std::chrono::milliseconds(10000);
+    }
+
+    auto resource = opentelemetry::sdk::resource::Resource::Create(
+        {{"service.name", std::string(env_or("OTEL_SERVICE_NAME", "flow-pipe"))}});
+    auto sdk_provider = std::make_shared<metrics_sdk::MeterProvider>(
+        std::make_unique<metrics_sdk::ViewRegistry>(), resource);
+    if (std::string(env_or("OTEL_METRICS_EXPORTER", "otlp")) == "none") {
+      return sdk_provider;  // instruments work, nothing is exported
+    }
+    sdk_provider->AddMetricReader(metrics_sdk::PeriodicExportingMetricReaderFactory::Create(
+        otlp::OtlpGrpcMetricExporterFactory::Create(exporter_opts), reader_opts));
+    return sdk_provider;
+  }();
+  static auto meter = provider->GetMeter("flow-pipe-rpc-stages", "1.0.0");
+  return *meter;
+}
+
+}  // namespace detail
+
+class Counter {
+ public:
+  Counter(const char* name, const char* description, const char* unit = "")
+      : instrument_(detail::meter().CreateUInt64Counter(name, description, unit)) {}
+  void add(uint64_t value) { instrument_->Add(value); }
+  // Adds to the series tagged key=attribute, e.g. one per source lane.
+  void add(uint64_t value, const char* key, std::string_view attribute) {
+    instrument_->Add(value, {{key, opentelemetry::nostd::string_view(attribute.data(), attribute.size())}});
+  }
+
+ private:
+  opentelemetry::nostd::unique_ptr<opentelemetry::metrics::Counter<uint64_t>> instrument_;
+};
+
+class UpDownCounter {
+ public:
+  UpDownCounter(const char* name, const char* description, const char* unit = "")
+      : instrument_(detail::meter().CreateInt64UpDownCounter(name, description, unit)) {}
+  void add(int64_t value) { instrument_->Add(value); }
+  void add(int64_t value, const char* key, std::string_view attribute) {
+    instrument_->Add(value, {{key, opentelemetry::nostd::string_view(attribute.data(), attribute.size())}});
+  }
+
+ private:
+  opentelemetry::nostd::unique_ptr<opentelemetry::metrics::UpDownCounter<int64_t>> instrument_;
+};
+
+class Histogram {
+ public:
+  Histogram(const char* name, const char* description, const char* unit = "")
+      : instrument_(detail::meter().CreateDoubleHistogram(name, description, unit)) {}
+  void record(double value) { instrument_->Record(value, opentelemetry::context::Context{}); }
+
+ private:
+  opentelemetry::nostd::unique_ptr<opentelemetry::metrics::Histogram<double>> instrument_;
+};
+
+#else
+
+class Counter {
+ public:
+  Counter(const char*, const char*, const char* = "") {}
+  void add(uint64_t) {}
+  void add(uint64_t, const char*, std::string_view) {}
+};
+
+class UpDownCounter {
+ public:
+  UpDownCounter(const char*, const char*, const char* = "") {}
+  void add(int64_t) {}
+  void add(int64_t, const char*, std::string_view) {}
+};
+
+class Histogram {
+ public:
+  Histogram(const char*, const char*, const char* = "") {}
+  void record(double) {}
+};
+
+#endif
+
+}  // namespace rpc_stages::metrics
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "flowpipe/stage.h"
+
+// W3C traceparent codec shared by the stages that move trace context
+// between NATS headers and PayloadMeta:
+// "00-<32hex trace-id>-<16hex parent-id>-<2hex flags>".
+namespace rpc_stages {
+
+inline constexpr const char* kTraceparentHeader = "traceparent";
+
+// 2 + 1 + 32 + 1 + 16 + 1 + 2
+inline constexpr size_t kTraceparentSize = 55;
+
+inline bool hex_nibble(char c, uint8_t& out) noexcept {
+  if (c >= '0' && c <= '9') { out = static_cast<uint8_t>(c - '0'); return true; }
+  if (c >= 'a' && c <= 'f') { out = static_cast<uint8_t>(c - 'a' + 10); return true; }
+  if (c >= 'A' && c <= 'F') { out = static_cast<uint8_t>(c - 'A' + 10); return true; }
+  return false;
+}
+
+inline bool hex_decode(const char* src, uint8_t* dst, size_t n) noexcept {
+  for (size_t i = 0; i < n; ++i) {
+    uint8_t hi{}, lo{};
+    if (!hex_nibble(src[i * 2], hi) || !hex_nibble(src[i * 2 + 1], lo)) return false;
+    dst[i] = static_cast<uint8_t>((hi << 4) | lo);
+  }
+  return true;
+}
+
+// Fills meta's trace context from a traceparent value. Malformed values
+// leave meta untouched.
+inline void parse_traceparent(std::string_view tp, flowpipe::PayloadMeta& meta) noexcept {
+  if (tp.size() < kTraceparentSize || tp[2] != '-' || tp[35] != '-' || tp[52] != '-') return;
+  if (!hex_decode(tp.data() + 3, meta.trace_id, 16)) return;
+  if (!hex_decode(tp.data() + 36, meta.span_id, 8)) return;
+  uint8_t flags_byte = 0;
+  if (hex_decode(tp.data() + 53, &flags_byte, 1)) meta.flags = flags_byte;
+}
+
+inline char* hex_encode(const uint8_t* bytes, size_t n, char* out) noexcept {
+  constexpr char kHexChars[] = "0123456789abcdef";
+  for (size_t i = 0; i < n; ++i) {
+    *out++ = kHexChars[(bytes[i] >> 4) & 0xF];
+    *out++ = kHexChars[bytes[i] & 0xF];
+  }
+  return out;
+}
+
+// Writes meta's trace context as a traceparent value into out, which must
+// have room for kTraceparentSize chars.
+inline void encode_traceparent(const flowpipe::PayloadMeta& meta, char* out) noexcept {
+  *out++ = '0';
+  *out++ = '0';
+  *out++ = '-';
+  out = hex_encode(meta.trace_id, flowpipe::PayloadMeta::trace_id_size, out);
+  *out++ = '-';
+  out = hex_encode(meta.span_id, flowpipe::PayloadMeta::span_id_size, out);
+  *out++ = '-';
+  hex_encode(&meta.flags, 1, out);
+}
+
+}  // namespace rpc_stages
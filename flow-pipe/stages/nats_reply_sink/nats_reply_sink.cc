@@ -1,47 +1,49 @@
 #include <google/protobuf/struct.pb.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdlib>
+#include <memory>
 #include <string>
+#include <string_view>
 
 #include <natscpp/connection.hpp>
 #include <natscpp/error.hpp>
 
+#include "chunking.h"
+#include "compression.h"
+#include "deadline.h"
 #include "flowpipe/configurable_stage.h"
 #include "flowpipe/observability/logging.h"
 #include "flowpipe/plugin.h"
 #include "flowpipe/protobuf_config.h"
 #include "flowpipe/stage.h"
+#include "hops.h"
 #include "nats_reply_sink.pb.h"
+#include "stage_metrics.h"
+#include "traceparent.h"
 
 using namespace flowpipe;
 
 using NatsReplySinkConfig =
     flowpipe::v1::stages::nats::reply::sink::v1::NatsReplySinkConfig;
 
+using rpc_stages::encode_traceparent;
+using rpc_stages::kTraceparentSize;
+
 namespace {
 const char* kDefaultNatsUrl = "nats://127.0.0.1:4222";
 
-static constexpr char kHexChars[] = "0123456789abcdef";
+// Bound on a chunked send when the request carries no deadline.
+constexpr auto kChunkedSendTimeout = std::chrono::seconds(10);
+constexpr uint32_t kDefaultCompressMinBytes = 1024;
 
-// Encode PayloadMeta trace context as a W3C traceparent header value.
-static std::string encode_traceparent(const flowpipe::PayloadMeta& meta) {
-  std::string out;
-  out.reserve(55);
-  out += "00-";
-  for (int i = 0; i < flowpipe::PayloadMeta::trace_id_size; ++i) {
-    out += kHexChars[(meta.trace_id[i] >> 4) & 0xF];
-    out += kHexChars[meta.trace_id[i] & 0xF];
-  }
-  out += '-';
-  for (int i = 0; i < flowpipe::PayloadMeta::span_id_size; ++i) {
-    out += kHexChars[(meta.span_id[i] >> 4) & 0xF];
-    out += kHexChars[meta.span_id[i] & 0xF];
-  }
-  out += '-';
-  out += kHexChars[(meta.flags >> 4) & 0xF];
-  out += kHexChars[meta.flags & 0xF];
-  return out;
-}
+// How a reply body is encoded on the wire.
+struct BodyEncoding {
+  compression::Codec codec{compression::Codec::kNone};
+  size_t decoded_length{0};
+};
 }  // namespace
 
 class NatsReplySink final : public ISinkStage, public ConfigurableStage {
@@ -56,7 +58,9 @@ class NatsReplySink final : public ISinkStage, public ConfigurableStage {
 
   ~NatsReplySink() override {
     connection_.reset();
-    FP_LOG_INFO("nats_reply_sink destroyed");
+    FP_LOG_INFO("nats_reply_sink destroyed (dropped " +
+                std::to_string(expired_.load(std::memory_order_relaxed)) +
+                " expired replies)");
   }
 
   bool configure(const google::protobuf::Struct& config) override {
@@ -80,13 +84,27 @@ class NatsReplySink final : public ISinkStage, public ConfigurableStage {
     }
 
     config_ = std::move(cfg);
-
-    FP_LOG_INFO("nats_reply_sink configured");
+    codec_ = compression::ParseCodec(config_.compression());
+    if (codec_ == compression::Codec::kNone && !config_.compression().empty() &&
+        config_.compression() != "none") {
+      FP_LOG_ERROR("nats_reply_sink compression " + config_.compression() +
+                   " not built in, replies go out uncompressed");
+    }
+    compress_min_bytes_ =
+        config_.compress_min_bytes() > 0 ? config_.compress_min_bytes() : kDefaultCompressMinBytes;
+    FP_LOG_INFO(std::string("nats_reply_sink configured") +
+                (codec_ != compression::Codec::kNone
+                     ? " (compression=" + std::string(compression::Name(codec_)) + ")"
+                     : ""));
     return true;
   }
 
   void consume(StageContext& ctx, const Payload& payload) override {
-    if (ctx.stop.stop_requested() || payload.empty() || !connection_) {
+    if (ctx.stop.stop_requested() || !connection_) {
+      return;
+    }
+    if (payload.empty()) {
+      // Idle heartbeat (or a dropped payload): nothing to reply.
       return;
     }
 
@@ -98,23 +116,137 @@ class NatsReplySink final : public ISinkStage, public ConfigurableStage {
       return;
     }
 
+    // Nobody is waiting on this reply any more.
+    if (rpc_stages::deadline_expired(payload.meta)) {
+      expired_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    std::string_view data(reinterpret_cast<const char*>(payload.data()), payload.size);
+    const flowpipe::PayloadMeta* trace = payload.meta.has_trace() ? &payload.meta : nullptr;
+    const std::string* hops = rpc_stages::hops(payload.meta);
+    const std::string_view hop_list = hops ? std::string_view(*hops) : std::string_view();
+
+    // Compressed only with a codec the gateway listed in accept-encoding.
+    BodyEncoding encoding;
+    if (codec_ != compression::Codec::kNone && data.size() >= compress_min_bytes_ &&
+        accepts_codec(payload.meta)) {
+      thread_local std::string compressed;
+      if (compression::Compress(codec_, data, &compressed)) {
+        encoding = {codec_, data.size()};
+        data = compressed;
+      }
+    }
+
+    if (config_.chunk_bytes() > 0 && data.size() > config_.chunk_bytes()) {
+      const auto start = std::chrono::steady_clock::now();
+      try {
+        publish_chunked(*dest, trace, hop_list, encoding, data, payload.meta);
+      } catch (const natscpp::nats_error& e) {
+        publish_errors_metric_.add(1);
+        FP_LOG_ERROR("nats_reply_sink chunked publish failed: " + std::string(e.what()));
+      }
+      record_flush(start);
+      return;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
     try {
-      std::string_view data(reinterpret_cast<const char*>(payload.data()), payload.size);
-      if (payload.meta.has_trace()) {
-        auto msg = natscpp::message::create(*dest, "", data);
-        msg.set_header("traceparent", encode_traceparent(payload.meta));
-        connection_->publish(std::move(msg));
+      if (trace) {
+        char traceparent[kTraceparentSize];
+        encode_traceparent(*trace, traceparent);
+        publish(*dest, std::string_view(traceparent, kTraceparentSize), hop_list, encoding, data);
       } else {
-        connection_->publish(*dest, data);
+        publish(*dest, {}, hop_list, encoding, data);
       }
     } catch (const natscpp::nats_error& e) {
+      publish_errors_metric_.add(1);
       FP_LOG_ERROR("nats_reply_sink publish failed: " + std::string(e.what()));
     }
+    record_flush(start);
   }
 
  private:
+  bool accepts_codec(const flowpipe::PayloadMeta& meta) const {
+    const auto* value = meta.get_attr(compression::kAcceptAttr);
+    const std::string* accept = value ? std::get_if<std::string>(value) : nullptr;
+    return accept && compression::Accepts(*accept, codec_);
+  }
+
+  // Publishes one reply. Empty traceparent or hops are left out; a hop list
+  // is returned with the publish time appended.
+  void publish(std::string_view dest, std::string_view traceparent, std::string_view hops,
+               BodyEncoding encoding, std::string_view data) {
+    if (traceparent.empty() && hops.empty() && encoding.codec == compression::Codec::kNone) {
+      connection_->publish(dest, data);
+      return;
+    }
+    auto msg = natscpp::message::create(dest, "", data);
+    set_reply_headers(msg, traceparent, hops, encoding);
+    connection_->publish(std::move(msg));
+  }
+
+  // Sends a reply too large for one message in chunks, waiting for the
+  // gateway's credit until the request's deadline.
+  void publish_chunked(std::string_view dest, const flowpipe::PayloadMeta* trace,
+                       std::string_view hops, BodyEncoding encoding, std::string_view data,
+                       const flowpipe::PayloadMeta& meta) {
+    chunking::ChunkSender chunks(data, config_.chunk_bytes(), dest);
+    const std::string credit_inbox = connection_->new_inbox();
+    auto credits = connection_->subscribe_sync(credit_inbox);
+    auto msg = natscpp::message::create(dest, credit_inbox, chunks.first());
+    char traceparent[kTraceparentSize];
+    if (trace) {
+      encode_traceparent(*trace, traceparent);
+    }
+    set_reply_headers(msg, trace ? std::string_view(traceparent, kTraceparentSize) : std::string_view(),
+                      hops, encoding);
+    chunks.Label(msg);
+    connection_->publish(std::move(msg));
+
+    auto deadline = std::chrono::steady_clock::now() + kChunkedSendTimeout;
+    if (const int64_t deadline_ns = rpc_stages::deadline_ns(meta)) {
+      deadline = std::min(deadline, std::chrono::steady_clock::now() +
+                                        std::chrono::nanoseconds(deadline_ns - rpc_stages::steady_now_ns()));
+    }
+    if (!chunking::SendRest(*connection_, credits, chunks, deadline)) {
+      publish_errors_metric_.add(1);
+      FP_LOG_ERROR("nats_reply_sink chunked reply to " + std::string(dest) + " got no credit in time");
+    }
+  }
+
+  void set_reply_headers(natscpp::message& msg, std::string_view traceparent, std::string_view hops,
+                         BodyEncoding encoding) {
+    if (encoding.codec != compression::Codec::kNone) {
+      msg.set_header(compression::kEncodingHeader, compression::Name(encoding.codec));
+      msg.set_header(compression::kLengthHeader, std::to_string(encoding.decoded_length));
+    }
+    if (!traceparent.empty()) {
+      msg.set_header(rpc_stages::kTraceparentHeader, traceparent);
+    }
+    if (!hops.empty()) {
+      std::string list(hops);
+      rpc_stages::append_hop(list, "sink", rpc_stages::wall_now_ns());
+      msg.set_header(rpc_stages::kHopsHeader, list);
+    }
+  }
+
+  void record_flush(std::chrono::steady_clock::time_point start) {
+    flush_duration_metric_.record(
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+  }
+
   NatsReplySinkConfig config_{};
   std::unique_ptr<natscpp::connection> connection_{};
+  std::atomic<uint64_t> expired_{0};
+
+  compression::Codec codec_{compression::Codec::kNone};
+  size_t compress_min_bytes_{kDefaultCompressMinBytes};
+
+  rpc_stages::metrics::Counter publish_errors_metric_{
+      "flowpipe.sink.publish.errors", "Replies that failed to publish"};
+  rpc_stages::metrics::Histogram flush_duration_metric_{
+      "flowpipe.sink.flush.duration", "Time to publish one reply", "ms"};
 };
 
 extern "C" {
@@ -1,19 +1,39 @@
 #include <google/protobuf/struct.pb.h>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stop_token>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
 
 #include <natscpp/connection.hpp>
 #include <natscpp/error.hpp>
 
+#include "chunking.h"
+#include "compression.h"
+#include "deadline.h"
 #include "flowpipe/configurable_stage.h"
 #include "flowpipe/observability/logging.h"
 #include "flowpipe/plugin.h"
 #include "flowpipe/protobuf_config.h"
 #include "flowpipe/stage.h"
+#include "hops.h"
+#include "mpmc_ring.h"
 #include "nats_request_source.pb.h"
+#include "stage_metrics.h"
+#include "traceparent.h"
 
 using namespace flowpipe;
 
@@ -22,34 +42,115 @@ using NatsRequestSourceConfig =
 
 namespace {
 constexpr int kDefaultPollTimeoutMs = 1000;
+constexpr uint32_t kDefaultPendingLimit = 4096;
+constexpr uint64_t kDefaultPendingBytesLimit = uint64_t{64} << 20;
+// Failed pops retried before a consumer parks on the ring's ready counter.
+constexpr int kSpinBeforeWait = 64;
+constexpr auto kBlockBackoff = std::chrono::microseconds(100);
+constexpr uint32_t kDefaultChunkWindow = 8;
+// Bounds the weighted schedule, which has one slot per unit of weight.
+constexpr uint32_t kMaxLaneWeight = 1000;
+// A chunked request whose sender went quiet for this long is abandoned.
+constexpr auto kAssemblyTimeout = std::chrono::seconds(30);
+// Largest body decompressed when max_request_bytes does not set the bound.
+constexpr size_t kMaxDecodedBytes = size_t{64} << 20;
 const char* kDefaultNatsUrl = "nats://127.0.0.1:4222";
 
-static bool hex_nibble(char c, uint8_t& out) noexcept {
-  if (c >= '0' && c <= '9') { out = static_cast<uint8_t>(c - '0'); return true; }
-  if (c >= 'a' && c <= 'f') { out = static_cast<uint8_t>(c - 'a' + 10); return true; }
-  if (c >= 'A' && c <= 'F') { out = static_cast<uint8_t>(c - 'A' + 10); return true; }
-  return false;
+enum class SlowConsumerPolicy { kBlock, kDropNewest, kDropOldest };
+
+struct LaneSpec {
+  std::string name;
+  std::vector<std::string> subjects;
+  uint32_t weight;
+};
+
+// Smooth weighted round-robin order of lane indices: each lane appears
+// weight times, spread out rather than in runs.
+std::vector<uint32_t> weighted_schedule(const std::vector<LaneSpec>& lanes) {
+  int64_t total = 0;
+  for (const auto& lane : lanes) {
+    total += lane.weight;
+  }
+  std::vector<int64_t> current(lanes.size(), 0);
+  std::vector<uint32_t> schedule;
+  for (int64_t slot = 0; slot < total; ++slot) {
+    size_t best = 0;
+    for (size_t i = 0; i < lanes.size(); ++i) {
+      current[i] += lanes[i].weight;
+      if (current[i] > current[best]) {
+        best = i;
+      }
+    }
+    current[best] -= total;
+    schedule.push_back(static_cast<uint32_t>(best));
+  }
+  return schedule;
+}
+
+// Outcome of waiting for the next message.
+enum class Receive { kMessage, kIdle, kStop };
+
+using IngestBuffer = decltype(AllocatePayloadBuffer(0));
+
+// Deleter that keeps a received natscpp::message alive for as long as a
+// payload buffer points into its body.
+struct MessageOwner {
+  natscpp::message* message;
+  void operator()(void*) const noexcept { delete message; }
+};
+
+// Wraps the message body as a payload buffer without copying it, taking
+// ownership of message. Zero-copy ingest needs a buffer type that accepts a
+// foreign pointer with a custom deleter; for any other runtime buffer type
+// this returns an empty buffer and leaves message untouched, and the caller
+// copies into a pooled buffer instead.
+template <class Buffer>
+Buffer adopt_message(natscpp::message& message) {
+  if constexpr (std::is_constructible_v<Buffer, uint8_t*, MessageOwner>) {
+    auto* owner = new natscpp::message(std::move(message));
+    auto* body = reinterpret_cast<uint8_t*>(const_cast<char*>(owner->data().data()));
+    return Buffer(body, MessageOwner{owner});
+  } else {
+    return Buffer{};
+  }
 }
 
-static bool hex_decode(const char* src, uint8_t* dst, size_t n) noexcept {
-  for (size_t i = 0; i < n; ++i) {
-    uint8_t hi{}, lo{};
-    if (!hex_nibble(src[i * 2], hi) || !hex_nibble(src[i * 2 + 1], lo)) return false;
-    dst[i] = static_cast<uint8_t>((hi << 4) | lo);
+// Whether this runtime's payload buffer can adopt message bodies; logged at
+// configure, since otherwise copy_payload: false silently copies.
+constexpr bool kZeroCopyIngest = std::is_constructible_v<IngestBuffer, uint8_t*, MessageOwner>;
+
+IngestBuffer copy_message(const natscpp::message& message) {
+  std::string_view data = message.data();
+  auto buffer = AllocatePayloadBuffer(data.size());
+  if (buffer && !data.empty()) {
+    std::memcpy(buffer.get(), data.data(), data.size());
   }
-  return true;
+  return buffer;
 }
 
 // Parse W3C traceparent header: "00-<32hex trace-id>-<16hex parent-id>-<2hex flags>"
 static flowpipe::PayloadMeta parse_traceparent(const natscpp::message& msg) noexcept {
   flowpipe::PayloadMeta meta;
-  std::string tp = msg.header("traceparent");
-  // Minimum valid length: 2 + 1 + 32 + 1 + 16 + 1 + 2 = 55
-  if (tp.size() < 55 || tp[2] != '-' || tp[35] != '-' || tp[52] != '-') return meta;
-  if (!hex_decode(tp.data() + 3, meta.trace_id, 16)) return meta;
-  if (!hex_decode(tp.data() + 36, meta.span_id, 8)) return meta;
-  uint8_t flags_byte = 0;
-  if (hex_decode(tp.data() + 53, &flags_byte, 1)) meta.flags = flags_byte;
+  std::string tp = msg.header(rpc_stages::kTraceparentHeader);
+  rpc_stages::parse_traceparent(tp, meta);
+  return meta;
+}
+
+// Trace context, deadline, hop list and reply subject of a request.
+flowpipe::PayloadMeta request_meta(const natscpp::message& message, std::string_view reply_to) {
+  flowpipe::PayloadMeta meta = parse_traceparent(message);
+  rpc_stages::record_deadline(message.header(rpc_stages::kDeadlineHeader), meta);
+  rpc_stages::record_hops(message.header(rpc_stages::kHopsHeader), meta);
+  // Carry the NATS reply-to inbox so nats_reply_sink can route the
+  // response back to the correct per-request subscriber.
+  if (!reply_to.empty()) {
+    meta.set_attr("reply_to", std::string(reply_to));
+  }
+  // Codecs nats_reply_sink may compress the reply with.
+  std::string accept = message.header(compression::kAcceptHeader);
+  if (!accept.empty()) {
+    meta.set_attr(compression::kAcceptAttr, std::move(accept));
+  }
   return meta;
 }
 }  // namespace
@@ -65,7 +166,19 @@ class NatsRequestSource final : public ISourceStage, public ConfigurableStage {
   }
 
   ~NatsRequestSource() override {
-    subscription_.reset();
+    stop_receiver();
+    if (dropped_.load(std::memory_order_relaxed) > 0) {
+      FP_LOG_INFO("nats_request_source dropped " + std::to_string(dropped_.load()) +
+                  " messages (slow consumer)");
+    }
+    if (lanes_.size() > 1) {
+      std::string counts;
+      for (const auto& lane : lanes_) {
+        counts += (counts.empty() ? "" : ", ") + lane->name + "=" +
+                  std::to_string(lane->dequeued.load(std::memory_order_relaxed));
+      }
+      FP_LOG_INFO("nats_request_source dequeued per lane: " + counts);
+    }
     connection_.reset();
     FP_LOG_INFO("nats_request_source destroyed");
   }
@@ -78,30 +191,151 @@ class NatsRequestSource final : public ISourceStage, public ConfigurableStage {
       return false;
     }
 
-    if (cfg.subject().empty()) {
+    // Lanes in priority order; `subject` / `subjects` form one more lane
+    // after the configured ones.
+    std::vector<LaneSpec> lanes;
+    for (const auto& lane : cfg.lanes()) {
+      if (lane.subjects().empty()) {
+        FP_LOG_ERROR("nats_request_source lane " + lane.name() + " has no subjects");
+        return false;
+      }
+      lanes.push_back({lane.name().empty() ? lane.subjects(0) : lane.name(),
+                       {lane.subjects().begin(), lane.subjects().end()},
+                       std::clamp<uint32_t>(lane.weight(), 1, kMaxLaneWeight)});
+    }
+    std::vector<std::string> subjects;
+    if (!cfg.subject().empty()) {
+      subjects.push_back(cfg.subject());
+    }
+    subjects.insert(subjects.end(), cfg.subjects().begin(), cfg.subjects().end());
+    if (!subjects.empty()) {
+      lanes.push_back({"default", std::move(subjects), 1});
+    }
+    if (lanes.empty()) {
       FP_LOG_ERROR("nats_request_source requires subject");
       return false;
     }
+    size_t subject_count = 0;
+    for (const auto& lane : lanes) {
+      subject_count += lane.subjects.size();
+    }
+
+    bool strict = true;
+    if (cfg.lane_scheduling() == "weighted") {
+      strict = false;
+    } else if (!cfg.lane_scheduling().empty() && cfg.lane_scheduling() != "strict") {
+      FP_LOG_ERROR("nats_request_source unknown lane_scheduling: " + cfg.lane_scheduling());
+      return false;
+    }
+
+    bool async = false;
+    if (cfg.receive_mode() == "async") {
+      async = true;
+    } else if (!cfg.receive_mode().empty() && cfg.receive_mode() != "sync") {
+      FP_LOG_ERROR("nats_request_source unknown receive_mode: " + cfg.receive_mode());
+      return false;
+    }
+    // One blocking receive cannot wait on several subscriptions.
+    async = async || subject_count > 1 || cfg.max_request_bytes() > 0;
+
+    SlowConsumerPolicy policy = SlowConsumerPolicy::kBlock;
+    if (cfg.slow_consumer_policy() == "drop_newest") {
+      policy = SlowConsumerPolicy::kDropNewest;
+    } else if (cfg.slow_consumer_policy() == "drop_oldest") {
+      policy = SlowConsumerPolicy::kDropOldest;
+    } else if (!cfg.slow_consumer_policy().empty() && cfg.slow_consumer_policy() != "block") {
+      FP_LOG_ERROR("nats_request_source unknown slow_consumer_policy: " + cfg.slow_consumer_policy());
+      return false;
+    }
+
+    stop_receiver();
+
+    config_ = std::move(cfg);
+    poll_timeout_ms_ =
+        config_.poll_timeout_ms() > 0 ? static_cast<int>(config_.poll_timeout_ms()) : kDefaultPollTimeoutMs;
+    policy_ = policy;
+    heartbeat_ms_ = static_cast<int>(config_.idle_heartbeat_ms());
+    chunk_window_ = config_.chunk_window() > 0 ? config_.chunk_window() : kDefaultChunkWindow;
+    const uint32_t pending_limit = config_.pending_limit() > 0 ? config_.pending_limit() : kDefaultPendingLimit;
+
+    // The rings exist before the subscriptions, whose callbacks start
+    // filling them as soon as they are made.
+    lanes_.clear();
+    schedule_.clear();
+    if (async) {
+      for (const auto& spec : lanes) {
+        auto lane = std::make_unique<Lane>();
+        lane->name = spec.name;
+        lane->ring = std::make_unique<MpmcRing<natscpp::message>>(pending_limit);
+        lanes_.push_back(std::move(lane));
+      }
+      if (!strict && lanes.size() > 1) {
+        schedule_ = weighted_schedule(lanes);
+      }
+      receiver_stop_.store(false, std::memory_order_relaxed);
+    }
 
     const char* env_url = std::getenv("NATS_URL");
-    std::string url = cfg.url().empty() ? (env_url ? env_url : kDefaultNatsUrl) : cfg.url();
+    std::string url = config_.url().empty() ? (env_url ? env_url : kDefaultNatsUrl) : config_.url();
 
     try {
       natscpp::connection_options opts;
       opts.url = url;
       connection_ = std::make_unique<natscpp::connection>(opts);
-      subscription_ = std::make_unique<natscpp::subscription>(
-          connection_->subscribe_sync(cfg.subject()));
+      for (size_t lane = 0; lane < lanes.size(); ++lane) {
+        for (const auto& subject : lanes[lane].subjects) {
+          // Queue group members share the subject's traffic; without a group
+          // every worker would process every request.
+          subscriptions_.push_back(std::make_unique<natscpp::subscription>(subscribe(subject, lane, async)));
+        }
+      }
+      // Continuation chunks are addressed to this worker, whichever queue
+      // group member took chunk 0. They join the top lane: their request
+      // has already been admitted.
+      chunk_prefix_.clear();
+      if (config_.max_request_bytes() > 0) {
+        chunk_prefix_ = connection_->new_inbox() + ".";
+        subscriptions_.push_back(std::make_unique<natscpp::subscription>(
+            connection_->subscribe(chunk_prefix_ + "*", receiver(0))));
+      }
+      if (async) {
+        // Bound what the client library queues per subscription while a
+        // full ring holds the callback up; past it NATS drops messages
+        // (slow consumer) instead of growing without limit.
+        const uint64_t pending_bytes =
+            config_.pending_bytes_limit() > 0 ? config_.pending_bytes_limit() : kDefaultPendingBytesLimit;
+        for (auto& subscription : subscriptions_) {
+          subscription->set_pending_limits(static_cast<int>(pending_limit),
+                                           static_cast<int>(std::min<uint64_t>(pending_bytes, INT32_MAX)));
+        }
+      }
     } catch (const natscpp::nats_error& e) {
       FP_LOG_ERROR("nats_request_source setup failed: " + std::string(e.what()));
+      stop_receiver();
       return false;
     }
 
-    config_ = std::move(cfg);
-    poll_timeout_ms_ =
-        config_.poll_timeout_ms() > 0 ? static_cast<int>(config_.poll_timeout_ms()) : kDefaultPollTimeoutMs;
+    if (async && heartbeat_ms_ > 0) {
+      heartbeat_ = std::thread([this] { heartbeat_loop(); });
+    }
 
-    FP_LOG_INFO("nats_request_source configured");
+    std::string subject_list;
+    for (const auto& lane : lanes) {
+      if (lanes.size() > 1) {
+        subject_list += (subject_list.empty() ? "" : " ") + lane.name + ":";
+      }
+      for (size_t i = 0; i < lane.subjects.size(); ++i) {
+        subject_list += (i == 0 ? "" : ",") + lane.subjects[i];
+      }
+    }
+    FP_LOG_INFO(std::string("nats_request_source configured (") + (async ? "async" : "sync") +
+                ", subjects=" + subject_list +
+                (lanes.size() > 1 ? std::string(strict ? ", strict" : ", weighted") + " lanes" : "") +
+                (config_.queue_group().empty() ? "" : ", queue_group=" + config_.queue_group()) +
+                (config_.copy_payload() ? ", copying payloads"
+                 : kZeroCopyIngest      ? ", zero-copy payloads"
+                                        : ", copying payloads (buffer type cannot adopt messages)") +
+                ")");
     return true;
   }
 
@@ -109,55 +343,439 @@ class NatsRequestSource final : public ISourceStage, public ConfigurableStage {
     if (ctx.stop.stop_requested()) {
       return false;
     }
-    if (!subscription_) {
+    if (subscriptions_.empty()) {
       FP_LOG_ERROR("nats_request_source subscription not initialized");
       return false;
     }
 
-    natscpp::message message;
     while (true) {
-      if (ctx.stop.stop_requested()) {
+      natscpp::message message;
+      const Receive received = lanes_.empty() ? next_message(ctx, message) : pop_message(ctx, message);
+      if (received == Receive::kStop) {
+        return false;
+      }
+      if (received == Receive::kIdle) {
+        // Heartbeat: lets downstream stages that hold payloads across calls
+        // (rpc_transform async mode) flush while no requests arrive.
+        payload = Payload();
+        return true;
+      }
+
+      uint32_t index = 0;
+      uint32_t count = 0;
+      if (chunking::ParseChunk(message.header(chunking::kChunkHeader), &index, &count) &&
+          count > 1) {
+        if (!assemble(message, index, count, payload)) {
+          continue;
+        }
+        received_metric_.add(1);
+        return true;
+      }
+
+      flowpipe::PayloadMeta meta = request_meta(message, message.reply_to());
+      const std::string encoding = message.header(compression::kEncodingHeader);
+      if (!encoding.empty()) {
+        if (!decode(message.data(), encoding, message.header(compression::kLengthHeader),
+                    std::move(meta), payload)) {
+          continue;
+        }
+        received_metric_.add(1);
+        return true;
+      }
+      const size_t size = message.data().size();
+      IngestBuffer buffer;
+      if (!config_.copy_payload() && size > 0) {
+        buffer = adopt_message<IngestBuffer>(message);
+      }
+      if (!buffer) {
+        buffer = copy_message(message);
+        if (!buffer) {
+          FP_LOG_ERROR("nats_request_source failed to allocate payload");
+          return false;
+        }
+      }
+      payload = Payload(std::move(buffer), size, std::move(meta));
+      received_metric_.add(1);
+      return true;
+    }
+  }
+
+ private:
+  // Async mode: one ring per priority lane, highest priority first.
+  struct Lane {
+    std::string name;
+    std::unique_ptr<MpmcRing<natscpp::message>> ring;
+    std::atomic<uint64_t> dequeued{0};
+  };
+
+  // A chunked request being reassembled in its payload buffer.
+  struct Assembly {
+    IngestBuffer buffer;
+    size_t size;
+    size_t filled;
+    size_t chunk_size;
+    uint32_t count;
+    uint32_t received;
+    uint32_t granted;
+    flowpipe::PayloadMeta meta;
+    std::string credit_to;
+    std::chrono::steady_clock::time_point expires;
+    // content-encoding and flow-decoded-length of a compressed body.
+    std::string encoding;
+    std::string decoded_length;
+  };
+
+  // Takes one chunk of a request (common/chunking.h). Returns true with
+  // payload set once the last chunk is in. Chunks are placed by index, so
+  // consumers popping them off the ring in parallel need not keep order.
+  bool assemble(const natscpp::message& message, uint32_t index, uint32_t count, Payload& payload) {
+    if (chunk_prefix_.empty()) {
+      FP_LOG_ERROR("nats_request_source dropping chunked request (max_request_bytes not set)");
+      return false;
+    }
+    const std::string_view data = message.data();
+    if (index == 0) {
+      begin_assembly(message, count);
+      return false;
+    }
+
+    const std::string_view subject = message.subject();
+    uint64_t id = 0;
+    if (!subject.starts_with(chunk_prefix_) ||
+        !chunking::ParseSize(subject.substr(chunk_prefix_.size()), &id)) {
+      return false;
+    }
+    std::string credit_to;
+    uint32_t granted = 0;
+    std::optional<Assembly> done;
+    {
+      std::lock_guard<std::mutex> lock(assemblies_mu_);
+      auto it = assemblies_.find(id);
+      if (it == assemblies_.end()) {
+        return false;
+      }
+      Assembly& assembly = it->second;
+      const size_t offset = static_cast<size_t>(index) * assembly.chunk_size;
+      if (count != assembly.count || offset + data.size() > assembly.size) {
+        FP_LOG_ERROR("nats_request_source dropping chunked request (malformed chunk)");
+        assemblies_.erase(it);
         return false;
       }
+      std::memcpy(assembly.buffer.get() + offset, data.data(), data.size());
+      assembly.filled += data.size();
+      assembly.expires = std::chrono::steady_clock::now() + kAssemblyTimeout;
+      if (++assembly.received == assembly.count) {
+        done.emplace(std::move(assembly));
+        assemblies_.erase(it);
+      } else {
+        granted = chunking::NextGrant(assembly.received, assembly.granted, assembly.count, chunk_window_);
+        if (granted == assembly.granted) {
+          return false;
+        }
+        assembly.granted = granted;
+        credit_to = assembly.credit_to;
+      }
+    }
+    if (done) {
+      return finish_assembly(std::move(*done), payload);
+    }
+    send_credit(credit_to, granted, subject);
+    return false;
+  }
+
+  bool finish_assembly(Assembly&& assembly, Payload& payload) {
+    if (assembly.filled != assembly.size) {
+      FP_LOG_ERROR("nats_request_source dropping chunked request (size mismatch)");
+      return false;
+    }
+    if (!assembly.encoding.empty()) {
+      const std::string_view body(reinterpret_cast<const char*>(assembly.buffer.get()), assembly.size);
+      return decode(body, assembly.encoding, assembly.decoded_length, std::move(assembly.meta), payload);
+    }
+    payload = Payload(std::move(assembly.buffer), assembly.size, std::move(assembly.meta));
+    return true;
+  }
+
+  // Decompresses a request body (common/compression.h) into a pooled
+  // payload buffer. Unknown codecs and corrupt bodies are dropped.
+  bool decode(std::string_view body, const std::string& encoding, std::string_view length,
+              flowpipe::PayloadMeta&& meta, Payload& payload) {
+    const compression::Codec codec = compression::ParseCodec(encoding);
+    const size_t limit = config_.max_request_bytes() > 0 ? config_.max_request_bytes() : kMaxDecodedBytes;
+    size_t size = 0;
+    IngestBuffer buffer;
+    if (codec != compression::Codec::kNone && compression::ParseLength(length, limit, &size) &&
+        size > 0) {
+      buffer = AllocatePayloadBuffer(size);
+    }
+    if (!buffer || !compression::Decompress(codec, body, buffer.get(), size)) {
+      FP_LOG_ERROR("nats_request_source dropping undecodable " + encoding + " request");
+      return false;
+    }
+    payload = Payload(std::move(buffer), size, std::move(meta));
+    return true;
+  }
+
+  // Chunk 0: allocates the whole body and grants the first window, naming
+  // this worker's chunk subject for the rest.
+  void begin_assembly(const natscpp::message& message, uint32_t count) {
+    const std::string_view data = message.data();
+    uint64_t total = 0;
+    if (!chunking::ParseSize(message.header(chunking::kTotalHeader), &total) ||
+        total > config_.max_request_bytes() || data.empty() || data.size() > total ||
+        message.reply_to().empty()) {
+      FP_LOG_ERROR("nats_request_source dropping chunked request of " +
+                   message.header(chunking::kTotalHeader) + " bytes");
+      return;
+    }
+    auto buffer = AllocatePayloadBuffer(total);
+    if (!buffer) {
+      FP_LOG_ERROR("nats_request_source failed to allocate payload");
+      return;
+    }
+    std::memcpy(buffer.get(), data.data(), data.size());
+    const uint32_t granted = chunking::NextGrant(1, 1, count, chunk_window_);
+    Assembly assembly{std::move(buffer),
+                      total,
+                      data.size(),
+                      data.size(),
+                      count,
+                      1,
+                      granted,
+                      request_meta(message, message.header(chunking::kReplyHeader)),
+                      std::string(message.reply_to()),
+                      std::chrono::steady_clock::now() + kAssemblyTimeout,
+                      message.header(compression::kEncodingHeader),
+                      message.header(compression::kLengthHeader)};
+
+    uint64_t id = 0;
+    {
+      std::lock_guard<std::mutex> lock(assemblies_mu_);
+      const auto now = std::chrono::steady_clock::now();
+      std::erase_if(assemblies_, [now](const auto& entry) { return entry.second.expires <= now; });
+      id = next_assembly_++;
+      assemblies_.emplace(id, std::move(assembly));
+    }
+    send_credit(message.reply_to(), granted, chunk_prefix_ + std::to_string(id));
+  }
+
+  void send_credit(std::string_view to, uint32_t granted, std::string_view send_to) {
+    try {
+      chunking::SendCredit(*connection_, to, granted, send_to);
+    } catch (const natscpp::nats_error& e) {
+      FP_LOG_ERROR("nats_request_source credit publish failed: " + std::string(e.what()));
+    }
+  }
+
+  // Sync mode: waits on the subscription directly.
+  Receive next_message(StageContext& ctx, natscpp::message& out) {
+    while (true) {
+      if (ctx.stop.stop_requested()) {
+        return Receive::kStop;
+      }
       try {
-        message = subscription_->next_message(std::chrono::milliseconds(poll_timeout_ms_));
-        break;
+        out = subscriptions_.front()->next_message(receive_wait());
+        return Receive::kMessage;
       } catch (const natscpp::nats_error& e) {
         if (e.status() == NATS_TIMEOUT) {
+          if (heartbeat_ms_ > 0) {
+            return Receive::kIdle;
+          }
           continue;
         }
         FP_LOG_ERROR("nats_request_source receive failed: " + std::string(e.what()));
-        return false;
+        return Receive::kStop;
       }
     }
+  }
 
-    std::string_view data = message.data();
-    auto buffer = AllocatePayloadBuffer(data.size());
-    if (!buffer) {
-      FP_LOG_ERROR("nats_request_source failed to allocate payload");
-      return false;
+  // How long one receive waits: the heartbeat interval when heartbeats
+  // are enabled, the poll timeout otherwise.
+  std::chrono::milliseconds receive_wait() const {
+    return std::chrono::milliseconds(heartbeat_ms_ > 0 ? heartbeat_ms_ : poll_timeout_ms_);
+  }
+
+  // Pops from the lane whose turn it is: always the top lane under strict
+  // scheduling, the next weighted_schedule() slot otherwise. An empty lane
+  // passes its turn down the lanes in priority order, so no lane waits
+  // while another has work.
+  bool try_pop_lanes(natscpp::message& out) {
+    const size_t first =
+        schedule_.empty() ? 0 : schedule_[turn_.fetch_add(1, std::memory_order_relaxed) % schedule_.size()];
+    for (size_t i = 0; i < lanes_.size(); ++i) {
+      Lane& lane = *lanes_[i == 0 ? first : (i <= first ? i - 1 : i)];
+      if (lane.ring->try_pop(out)) {
+        lane.dequeued.fetch_add(1, std::memory_order_relaxed);
+        ring_depth_metric_.add(-1, "lane", lane.name);
+        lane_dequeued_metric_.add(1, "lane", lane.name);
+        return true;
+      }
     }
+    return false;
+  }
 
-    if (!data.empty()) {
-      std::memcpy(buffer.get(), data.data(), data.size());
+  // Async mode: pops from the lane rings, parking on ready_seq_ only once
+  // they have stayed empty for a few retries.
+  Receive pop_message(StageContext& ctx, natscpp::message& out) {
+    for (int spin = 0;; ++spin) {
+      if (try_pop_lanes(out)) {
+        return Receive::kMessage;
+      }
+      if (ctx.stop.stop_requested()) {
+        return Receive::kStop;
+      }
+      if (idle_pending_.exchange(false, std::memory_order_relaxed)) {
+        return Receive::kIdle;
+      }
+      if (spin < kSpinBeforeWait) {
+        continue;
+      }
+      const uint32_t seen = ready_seq_.load(std::memory_order_seq_cst);
+      waiters_.fetch_add(1, std::memory_order_seq_cst);
+      if (try_pop_lanes(out)) {
+        waiters_.fetch_sub(1, std::memory_order_relaxed);
+        return Receive::kMessage;
+      }
+      {
+        std::stop_callback wake(ctx.stop, [this] { wake_consumers(); });
+        ready_seq_.wait(seen, std::memory_order_seq_cst);
+      }
+      waiters_.fetch_sub(1, std::memory_order_relaxed);
+      spin = 0;
     }
+  }
 
-    flowpipe::PayloadMeta meta = parse_traceparent(message);
-    // Carry the NATS reply-to inbox so nats_reply_sink can route the
-    // response back to the correct per-request subscriber.
-    std::string_view reply_to = message.reply_to();
-    if (!reply_to.empty()) {
-      meta.set_attr("reply_to", std::string(reply_to));
+  void wake_consumers() {
+    ready_seq_.fetch_add(1, std::memory_order_seq_cst);
+    if (waiters_.load(std::memory_order_seq_cst) > 0) {
+      ready_seq_.notify_all();
+    }
+  }
+
+  // Sync mode subscribes for next_message(); async mode has NATS deliver
+  // to a callback that feeds the lane's ring.
+  natscpp::subscription subscribe(const std::string& subject, size_t lane, bool async) {
+    const std::string& group = config_.queue_group();
+    if (!async) {
+      return group.empty() ? connection_->subscribe_sync(subject) : connection_->queue_subscribe_sync(subject, group);
+    }
+    return group.empty() ? connection_->subscribe(subject, receiver(lane))
+                         : connection_->queue_subscribe(subject, group, receiver(lane));
+  }
+
+  // Async mode: the subscription callback, run on the client library's
+  // delivery thread for that subscription.
+  std::function<void(natscpp::message)> receiver(size_t lane) {
+    return [this, lane](natscpp::message message) {
+      // Pairs with stop_receiver(): both sides store then load, which needs
+      // seq_cst so that either stop_receiver() sees this callback counted or
+      // the callback sees the stop flag.
+      active_callbacks_.fetch_add(1, std::memory_order_seq_cst);
+      if (!receiver_stop_.load(std::memory_order_seq_cst)) {
+        enqueue(*lanes_[lane], std::move(message));
+      }
+      active_callbacks_.fetch_sub(1, std::memory_order_release);
+    };
+  }
+
+  // Async mode with idle_heartbeat_ms: signals idle once a whole interval
+  // passed without a request.
+  void heartbeat_loop() {
+    const auto interval = std::chrono::milliseconds(heartbeat_ms_);
+    std::unique_lock<std::mutex> lock(heartbeat_mu_);
+    while (!heartbeat_cv_.wait_for(lock, interval, [this] { return receiver_stop_.load(); })) {
+      if (!received_since_beat_.exchange(false, std::memory_order_relaxed)) {
+        idle_pending_.store(true, std::memory_order_relaxed);
+        wake_consumers();
+      }
+    }
+  }
+
+  void enqueue(Lane& lane, natscpp::message&& message) {
+    while (!lane.ring->try_push(std::move(message))) {
+      if (policy_ == SlowConsumerPolicy::kDropNewest) {
+        count_drop();
+        return;
+      }
+      if (policy_ == SlowConsumerPolicy::kDropOldest) {
+        natscpp::message oldest;
+        if (lane.ring->try_pop(oldest)) {
+          ring_depth_metric_.add(-1, "lane", lane.name);
+          count_drop();
+        }
+        continue;
+      }
+      if (receiver_stop_.load(std::memory_order_relaxed)) {
+        return;
+      }
+      std::this_thread::sleep_for(kBlockBackoff);
+    }
+    ring_depth_metric_.add(1, "lane", lane.name);
+    received_since_beat_.store(true, std::memory_order_relaxed);
+    wake_consumers();
+  }
+
+  void count_drop() {
+    dropped_metric_.add(1);
+    if (dropped_.fetch_add(1, std::memory_order_relaxed) == 0) {
+      FP_LOG_ERROR("nats_request_source ring full, dropping messages (slow consumer)");
+    }
+  }
+
+  // Ends delivery: callbacks blocked on a full ring give up, and no
+  // callback runs once the subscriptions are gone.
+  void stop_receiver() {
+    {
+      std::lock_guard<std::mutex> lock(heartbeat_mu_);
+      receiver_stop_.store(true, std::memory_order_seq_cst);
+    }
+    heartbeat_cv_.notify_all();
+    if (heartbeat_.joinable()) {
+      heartbeat_.join();
+    }
+    subscriptions_.clear();
+    while (active_callbacks_.load(std::memory_order_seq_cst) > 0) {
+      std::this_thread::yield();
     }
-    payload = Payload(std::move(buffer), data.size(), std::move(meta));
-    return true;
   }
 
- private:
   NatsRequestSourceConfig config_{};
   std::unique_ptr<natscpp::connection> connection_{};
-  std::unique_ptr<natscpp::subscription> subscription_{};
+  std::vector<std::unique_ptr<natscpp::subscription>> subscriptions_{};
   int poll_timeout_ms_{kDefaultPollTimeoutMs};
+  SlowConsumerPolicy policy_{SlowConsumerPolicy::kBlock};
+  int heartbeat_ms_{0};
+
+  // Chunked requests, keyed by the last token of their chunk subject.
+  std::string chunk_prefix_{};
+  uint32_t chunk_window_{kDefaultChunkWindow};
+  std::mutex assemblies_mu_;
+  std::unordered_map<uint64_t, Assembly> assemblies_;
+  uint64_t next_assembly_{1};
+
+  std::vector<std::unique_ptr<Lane>> lanes_{};
+  // Weighted lane order; empty for strict scheduling.
+  std::vector<uint32_t> schedule_{};
+  std::atomic<uint64_t> turn_{0};
+  std::atomic<bool> receiver_stop_{false};
+  std::thread heartbeat_{};
+  std::mutex heartbeat_mu_;
+  std::condition_variable heartbeat_cv_;
+  std::atomic<bool> received_since_beat_{false};
+  std::atomic<uint32_t> active_callbacks_{0};
+  std::atomic<uint32_t> ready_seq_{0};
+  std::atomic<uint32_t> waiters_{0};
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<bool> idle_pending_{false};
+
+  rpc_stages::metrics::Counter received_metric_{
+      "flowpipe.source.messages.received", "NATS requests turned into payloads"};
+  rpc_stages::metrics::Counter dropped_metric_{
+      "flowpipe.source.messages.dropped", "Requests dropped by the slow-consumer policy"};
+  rpc_stages::metrics::UpDownCounter ring_depth_metric_{
+      "flowpipe.source.ring.depth", "Requests received but not yet produced, per lane (async mode)"};
+  rpc_stages::metrics::Counter lane_dequeued_metric_{
+      "flowpipe.source.lane.dequeued", "Requests taken off each lane's ring (async mode)"};
 };
 
 extern "C" {
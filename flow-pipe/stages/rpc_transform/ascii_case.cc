@@ -0,0 +1,158 @@
+#include "ascii_case.h"
+
+#include <initializer_list>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ASCII_CASE_X86 1
+#endif
+
+namespace ascii {
+namespace {
+
+// Flips bit 0x20 of every byte in [lo, hi]: 'a'-'z' -> upper, 'A'-'Z' -> lower.
+using CaseFn = void (*)(const uint8_t*, uint8_t*, size_t, uint8_t lo, uint8_t hi);
+
+void case_scalar(const uint8_t* src, uint8_t* dst, size_t n, uint8_t lo, uint8_t hi) {
+  for (size_t i = 0; i < n; ++i) {
+    const uint8_t c = src[i];
+    dst[i] = static_cast<uint8_t>(c ^ ((static_cast<uint8_t>(c - lo) <= static_cast<uint8_t>(hi - lo)) << 5));
+  }
+}
+
+#ifdef ASCII_CASE_X86
+// Bytes >= 0x80 compare as negative, so signed compares against the
+// (positive) ASCII bounds exclude them without extra masking.
+__attribute__((target("sse2")))
+void case_sse2(const uint8_t* src, uint8_t* dst, size_t n, uint8_t lo, uint8_t hi) {
+  const __m128i below = _mm_set1_epi8(static_cast<char>(lo - 1));
+  const __m128i above = _mm_set1_epi8(static_cast<char>(hi + 1));
+  const __m128i flip = _mm_set1_epi8(0x20);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    __m128i in_range = _mm_and_si128(_mm_cmpgt_epi8(v, below), _mm_cmplt_epi8(v, above));
+    v = _mm_xor_si128(v, _mm_and_si128(in_range, flip));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), v);
+  }
+  case_scalar(src + i, dst + i, n - i, lo, hi);
+}
+
+__attribute__((target("avx2")))
+void case_avx2(const uint8_t* src, uint8_t* dst, size_t n, uint8_t lo, uint8_t hi) {
+  const __m256i below = _mm256_set1_epi8(static_cast<char>(lo - 1));
+  const __m256i above = _mm256_set1_epi8(static_cast<char>(hi + 1));
+  const __m256i flip = _mm256_set1_epi8(0x20);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+    __m256i in_range = _mm256_and_si256(_mm256_cmpgt_epi8(v, below), _mm256_cmpgt_epi8(above, v));
+    v = _mm256_xor_si256(v, _mm256_and_si256(in_range, flip));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), v);
+  }
+  case_sse2(src + i, dst + i, n - i, lo, hi);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void case_avx512(const uint8_t* src, uint8_t* dst, size_t n, uint8_t lo, uint8_t hi) {
+  const __m512i below = _mm512_set1_epi8(static_cast<char>(lo - 1));
+  const __m512i above = _mm512_set1_epi8(static_cast<char>(hi + 1));
+  const __m512i flip = _mm512_set1_epi8(0x20);
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    __m512i v = _mm512_loadu_si512(src + i);
+    __mmask64 in_range = _mm512_cmpgt_epi8_mask(v, below) & _mm512_cmplt_epi8_mask(v, above);
+    v = _mm512_xor_si512(v, _mm512_maskz_mov_epi8(in_range, flip));
+    _mm512_storeu_si512(dst + i, v);
+  }
+  // Masked load/store handles the tail without a scalar loop.
+  if (i < n) {
+    const __mmask64 tail = (__mmask64{1} << (n - i)) - 1;
+    __m512i v = _mm512_maskz_loadu_epi8(tail, src + i);
+    __mmask64 in_range = _mm512_cmpgt_epi8_mask(v, below) & _mm512_cmplt_epi8_mask(v, above);
+    v = _mm512_xor_si512(v, _mm512_maskz_mov_epi8(in_range, flip));
+    _mm512_mask_storeu_epi8(dst + i, tail, v);
+  }
+}
+#endif
+
+CaseFn impl_for(Isa isa) {
+  switch (isa) {
+#ifdef ASCII_CASE_X86
+    case Isa::kAvx512:
+      return case_avx512;
+    case Isa::kAvx2:
+      return case_avx2;
+    case Isa::kSse2:
+      return case_sse2;
+#endif
+    default:
+      return case_scalar;
+  }
+}
+
+// Resolved once at load time.
+const Isa kBestIsa = best_isa();
+const CaseFn kCase = impl_for(kBestIsa);
+
+}  // namespace
+
+bool isa_supported(Isa isa) {
+#ifdef ASCII_CASE_X86
+  __builtin_cpu_init();
+  switch (isa) {
+    case Isa::kAvx512:
+      return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+    case Isa::kAvx2:
+      return __builtin_cpu_supports("avx2");
+    case Isa::kSse2:
+      return __builtin_cpu_supports("sse2");
+    case Isa::kScalar:
+      return true;
+  }
+  return false;
+#else
+  return isa == Isa::kScalar;
+#endif
+}
+
+Isa best_isa() {
+  for (Isa isa : {Isa::kAvx512, Isa::kAvx2, Isa::kSse2}) {
+    if (isa_supported(isa)) {
+      return isa;
+    }
+  }
+  return Isa::kScalar;
+}
+
+const char* isa_name(Isa isa) {
+  switch (isa) {
+    case Isa::kAvx512:
+      return "avx512bw";
+    case Isa::kAvx2:
+      return "avx2";
+    case Isa::kSse2:
+      return "sse2";
+    case Isa::kScalar:
+      return "scalar";
+  }
+  return "unknown";
+}
+
+void to_upper(const uint8_t* src, uint8_t* dst, size_t n) {
+  kCase(src, dst, n, 'a', 'z');
+}
+
+void to_lower(const uint8_t* src, uint8_t* dst, size_t n) {
+  kCase(src, dst, n, 'A', 'Z');
+}
+
+void to_upper(Isa isa, const uint8_t* src, uint8_t* dst, size_t n) {
+  impl_for(isa)(src, dst, n, 'a', 'z');
+}
+
+void to_lower(Isa isa, const uint8_t* src, uint8_t* dst, size_t n) {
+  impl_for(isa)(src, dst, n, 'A', 'Z');
+}
+
+}  // namespace ascii
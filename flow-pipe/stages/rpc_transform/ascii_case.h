@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// ASCII case conversion with runtime CPU dispatch. Only 'a'-'z' / 'A'-'Z'
+// change (the same bytes std::toupper/std::tolower touch in the "C" locale);
+// every other byte, including UTF-8 continuation bytes, is copied as-is.
+// src and dst may alias exactly for in-place conversion.
+namespace ascii {
+
+enum class Isa { kScalar, kSse2, kAvx2, kAvx512 };
+
+// Widest implementation the running CPU supports.
+Isa best_isa();
+bool isa_supported(Isa isa);
+const char* isa_name(Isa isa);
+
+void to_upper(const uint8_t* src, uint8_t* dst, size_t n);
+void to_lower(const uint8_t* src, uint8_t* dst, size_t n);
+
+// Explicit-ISA variants for benchmarks; isa must be supported.
+void to_upper(Isa isa, const uint8_t* src, uint8_t* dst, size_t n);
+void to_lower(Isa isa, const uint8_t* src, uint8_t* dst, size_t n);
+
+}  // namespace ascii
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Minimal coroutine runtime for latency-bound work in rpc_transform.
+// Coroutines suspend on Scheduler::sleep_for (the stand-in for a downstream
+// call); a single timer thread only moves expired handles to a ready queue,
+// and the stage's worker threads resume them from run_ready(), so CPU work
+// still scales with the stage's thread count while any number of payloads
+// wait concurrently.
+namespace coro {
+
+// Fire-and-forget coroutine. The frame starts eagerly and frees itself when
+// the body returns; a frame still suspended at shutdown is destroyed by the
+// Scheduler that holds its handle.
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+};
+
+class Scheduler {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  Scheduler() : timer_thread_([this] { timer_loop(); }) {}
+
+  ~Scheduler() {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      stopping_ = true;
+    }
+    timer_cv_.notify_all();
+    ready_cv_.notify_all();
+    timer_thread_.join();
+    // Whatever is still parked never resumes; free the frames.
+    while (!timers_.empty()) {
+      timers_.top().handle.destroy();
+      timers_.pop();
+    }
+    for (auto handle : ready_) {
+      handle.destroy();
+    }
+  }
+
+  Scheduler(const Scheduler&) = delete;
+  Scheduler& operator=(const Scheduler&) = delete;
+
+  // co_await scheduler.sleep_for(d): resumes on a worker thread in
+  // run_ready() once d has elapsed.
+  auto sleep_for(std::chrono::nanoseconds delay) {
+    struct Awaiter {
+      Scheduler& scheduler;
+      Clock::time_point when;
+      bool await_ready() const noexcept { return when <= Clock::now(); }
+      void await_suspend(std::coroutine_handle<> handle) { scheduler.add_timer(when, handle); }
+      void await_resume() const noexcept {}
+    };
+    return Awaiter{*this, Clock::now() + delay};
+  }
+
+  // Resumes coroutines whose timers have fired on the calling thread.
+  // Returns how many were resumed.
+  size_t run_ready() {
+    size_t resumed = 0;
+    for (;;) {
+      std::coroutine_handle<> handle;
+      {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (ready_.empty()) {
+          return resumed;
+        }
+        handle = ready_.front();
+        ready_.pop_front();
+      }
+      handle.resume();
+      ++resumed;
+    }
+  }
+
+  // Blocks until a coroutine is ready to resume or timeout elapses.
+  void wait_ready(std::chrono::nanoseconds timeout) {
+    std::unique_lock<std::mutex> lock(mu_);
+    ready_cv_.wait_for(lock, timeout, [this] { return stopping_ || !ready_.empty(); });
+  }
+
+ private:
+  struct Timer {
+    Clock::time_point when;
+    std::coroutine_handle<> handle;
+    bool operator>(const Timer& other) const { return when > other.when; }
+  };
+
+  void add_timer(Clock::time_point when, std::coroutine_handle<> handle) {
+    bool earliest;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      earliest = timers_.empty() || when < timers_.top().when;
+      timers_.push(Timer{when, handle});
+    }
+    if (earliest) {
+      timer_cv_.notify_one();
+    }
+  }
+
+  void timer_loop() {
+    std::unique_lock<std::mutex> lock(mu_);
+    while (!stopping_) {
+      if (timers_.empty()) {
+        timer_cv_.wait(lock);
+        continue;
+      }
+      const auto next = timers_.top().when;
+      if (Clock::now() < next) {
+        timer_cv_.wait_until(lock, next);
+        continue;
+      }
+      bool fired = false;
+      const auto now = Clock::now();
+      while (!timers_.empty() && timers_.top().when <= now) {
+        ready_.push_back(timers_.top().handle);
+        timers_.pop();
+        fired = true;
+      }
+      if (fired) {
+        ready_cv_.notify_all();
+      }
+    }
+  }
+
+  std::mutex mu_;
+  std::condition_variable timer_cv_;
+  std::condition_variable ready_cv_;
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers_;
+  std::deque<std::coroutine_handle<>> ready_;
+  bool stopping_{false};
+  std::thread timer_thread_;
+};
+
+}  // namespace coro
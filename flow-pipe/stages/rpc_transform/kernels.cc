@@ -0,0 +1,325 @@
+#include "kernels.h"
+
+#include <cstring>
+
+#include "ascii_case.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define KERNELS_X86_64 1
+#endif
+
+namespace kernels {
+namespace {
+
+constexpr char kHexChars[] = "0123456789abcdef";
+
+void write_hex(uint64_t value, int digits, uint8_t* dst) {
+  for (int i = digits - 1; i >= 0; --i) {
+    dst[i] = static_cast<uint8_t>(kHexChars[value & 0xF]);
+    value >>= 4;
+  }
+}
+
+// ------------------------------------------------------------
+// CRC32C (Castagnoli): SSE4.2 crc32 instruction, table fallback
+// ------------------------------------------------------------
+constexpr std::array<uint32_t, 256> make_crc32c_table() {
+  std::array<uint32_t, 256> table{};
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1u)));
+    }
+    table[i] = crc;
+  }
+  return table;
+}
+
+constexpr auto kCrc32cTable = make_crc32c_table();
+
+uint32_t crc32c_table(uint32_t crc, const uint8_t* data, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    crc = kCrc32cTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#ifdef KERNELS_X86_64
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const uint8_t* data, size_t n) {
+  uint64_t crc64 = crc;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, data + i, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  uint32_t crc32 = static_cast<uint32_t>(crc64);
+  for (; i < n; ++i) {
+    crc32 = _mm_crc32_u8(crc32, data[i]);
+  }
+  return crc32;
+}
+
+const bool kHasSse42 = [] {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse4.2") != 0;
+}();
+#endif
+
+// ------------------------------------------------------------
+// XXH64
+// ------------------------------------------------------------
+constexpr uint64_t kP1 = 11400714785074694791ULL;
+constexpr uint64_t kP2 = 14029467366897019727ULL;
+constexpr uint64_t kP3 = 1609587929392839161ULL;
+constexpr uint64_t kP4 = 9650029242287828579ULL;
+constexpr uint64_t kP5 = 2870177450012600261ULL;
+
+inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t read64(const uint8_t* p) {
+  uint64_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint32_t read32(const uint8_t* p) {
+  uint32_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+  acc += input * kP2;
+  acc = rotl64(acc, 31);
+  return acc * kP1;
+}
+
+inline uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+  acc ^= xxh_round(0, val);
+  return acc * kP1 + kP4;
+}
+
+// ------------------------------------------------------------
+// Base64 (RFC 4648, padded)
+// ------------------------------------------------------------
+constexpr char kBase64Chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+constexpr std::array<int8_t, 256> make_base64_decode_table() {
+  std::array<int8_t, 256> table{};
+  for (auto& v : table) {
+    v = -1;
+  }
+  for (int i = 0; i < 64; ++i) {
+    table[static_cast<uint8_t>(kBase64Chars[i])] = static_cast<int8_t>(i);
+  }
+  return table;
+}
+
+constexpr auto kBase64Decode = make_base64_decode_table();
+
+}  // namespace
+
+uint32_t crc32c(const uint8_t* data, size_t n) {
+#ifdef KERNELS_X86_64
+  if (kHasSse42) {
+    return ~crc32c_sse42(~0u, data, n);
+  }
+#endif
+  return ~crc32c_table(~0u, data, n);
+}
+
+uint64_t xxhash64(const uint8_t* data, size_t n, uint64_t seed) {
+  const uint8_t* p = data;
+  const uint8_t* const end = data + n;
+  uint64_t h;
+  if (n >= 32) {
+    uint64_t v1 = seed + kP1 + kP2;
+    uint64_t v2 = seed + kP2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - kP1;
+    const uint8_t* const limit = end - 32;
+    do {
+      v1 = xxh_round(v1, read64(p));
+      v2 = xxh_round(v2, read64(p + 8));
+      v3 = xxh_round(v3, read64(p + 16));
+      v4 = xxh_round(v4, read64(p + 24));
+      p += 32;
+    } while (p <= limit);
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = xxh_merge(h, v1);
+    h = xxh_merge(h, v2);
+    h = xxh_merge(h, v3);
+    h = xxh_merge(h, v4);
+  } else {
+    h = seed + kP5;
+  }
+  h += static_cast<uint64_t>(n);
+  for (; p + 8 <= end; p += 8) {
+    h ^= xxh_round(0, read64(p));
+    h = rotl64(h, 27) * kP1 + kP4;
+  }
+  if (p + 4 <= end) {
+    h ^= static_cast<uint64_t>(read32(p)) * kP1;
+    h = rotl64(h, 23) * kP2 + kP3;
+    p += 4;
+  }
+  for (; p < end; ++p) {
+    h ^= (*p) * kP5;
+    h = rotl64(h, 11) * kP1;
+  }
+  h ^= h >> 33;
+  h *= kP2;
+  h ^= h >> 29;
+  h *= kP3;
+  h ^= h >> 32;
+  return h;
+}
+
+// ------------------------------------------------------------
+// Kernel specializations
+// ------------------------------------------------------------
+size_t Kernel<Id::kUpper>::max_output(size_t n) {
+  return n;
+}
+
+bool Kernel<Id::kUpper>::run(const uint8_t* src, size_t n, uint8_t* dst, size_t* out_size) {
+  ascii::to_upper(src, dst, n);
+  *out_size = n;
+  return true;
+}
+
+size_t Kernel<Id::kLower>::max_output(size_t n) {
+  return n;
+}
+
+bool Kernel<Id::kLower>::run(const uint8_t* src, size_t n, uint8_t* dst, size_t* out_size) {
+  ascii::to_lower(src, dst, n);
+  *out_size = n;
+  return true;
+}
+
+size_t Kernel<Id::kCrc32c>::max_output(size_t) {
+  return 8;
+}
+
+bool Kernel<Id::kCrc32c>::run(const uint8_t* src, size_t n, uint8_t* dst, size_t* out_size) {
+  write_hex(crc32c(src, n), 8, dst);
+  *out_size = 8;
+  return true;
+}
+
+size_t Kernel<Id::kXxHash64>::max_output(size_t) {
+  return 16;
+}
+
+bool Kernel<Id::kXxHash64>::run(const uint8_t* src, size_t n, uint8_t* dst, size_t* out_size) {
+  write_hex(xxhash64(src, n), 16, dst);
+  *out_size = 16;
+  return true;
+}
+
+size_t Kernel<Id::kBase64Encode>::max_output(size_t n) {
+  return (n + 2) / 3 * 4;
+}
+
+bool Kernel<Id::kBase64Encode>::run(const uint8_t* src, size_t n, uint8_t* dst, size_t* out_size) {
+  size_t i = 0;
+  uint8_t* out = dst;
+  for (; i + 3 <= n; i += 3) {
+    const uint32_t v = (uint32_t{src[i]} << 16) | (uint32_t{src[i + 1]} << 8) | src[i + 2];
+    *out++ = static_cast<uint8_t>(kBase64Chars[(v >> 18) & 0x3F]);
+    *out++ = static_cast<uint8_t>(kBase64Chars[(v >> 12) & 0x3F]);
+    *out++ = static_cast<uint8_t>(kBase64Chars[(v >> 6) & 0x3F]);
+    *out++ = static_cast<uint8_t>(kBase64Chars[v & 0x3F]);
+  }
+  if (i < n) {
+    uint32_t v = uint32_t{src[i]} << 16;
+    if (i + 1 < n) {
+      v |= uint32_t{src[i + 1]} << 8;
+    }
+    *out++ = static_cast<uint8_t>(kBase64Chars[(v >> 18) & 0x3F]);
+    *out++ = static_cast<uint8_t>(kBase64Chars[(v >> 12) & 0x3F]);
+    *out++ = i + 1 < n ? static_cast<uint8_t>(kBase64Chars[(v >> 6) & 0x3F]) : '=';
+    *out++ = '=';
+  }
+  *out_size = static_cast<size_t>(out - dst);
+  return true;
+}
+
+size_t Kernel<Id::kBase64Decode>::max_output(size_t n) {
+  return n / 4 * 3;
+}
+
+bool Kernel<Id::kBase64Decode>::run(const uint8_t* src, size_t n, uint8_t* dst, size_t* out_size) {
+  if (n % 4 != 0) {
+    return false;
+  }
+  uint8_t* out = dst;
+  for (size_t i = 0; i < n; i += 4) {
+    const bool last = i + 4 == n;
+    const int pad = last ? (src[i + 3] == '=') + (src[i + 2] == '=') : 0;
+    if (pad == 1 && src[i + 2] == '=') {
+      return false;
+    }
+    const int8_t a = kBase64Decode[src[i]];
+    const int8_t b = kBase64Decode[src[i + 1]];
+    const int8_t c = pad >= 2 ? 0 : kBase64Decode[src[i + 2]];
+    const int8_t d = pad >= 1 ? 0 : kBase64Decode[src[i + 3]];
+    if ((a | b | c | d) < 0) {
+      return false;
+    }
+    const uint32_t v = (uint32_t(a) << 18) | (uint32_t(b) << 12) | (uint32_t(c) << 6) | uint32_t(d);
+    *out++ = static_cast<uint8_t>(v >> 16);
+    if (pad < 2) {
+      *out++ = static_cast<uint8_t>(v >> 8);
+    }
+    if (pad < 1) {
+      *out++ = static_cast<uint8_t>(v);
+    }
+  }
+  *out_size = static_cast<size_t>(out - dst);
+  return true;
+}
+
+size_t Kernel<Id::kJsonMinify>::max_output(size_t n) {
+  return n;
+}
+
+// Drops insignificant whitespace outside string literals; the document is
+// not otherwise validated.
+bool Kernel<Id::kJsonMinify>::run(const uint8_t* src, size_t n, uint8_t* dst, size_t* out_size) {
+  uint8_t* out = dst;
+  bool in_string = false;
+  bool escaped = false;
+  for (size_t i = 0; i < n; ++i) {
+    const uint8_t c = src[i];
+    if (in_string) {
+      *out++ = c;
+      if (escaped) {
+        escaped = false;
+      } else if (c == '\\') {
+        escaped = true;
+      } else if (c == '"') {
+        in_string = false;
+      }
+      continue;
+    }
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+      continue;
+    }
+    if (c == '"') {
+      in_string = true;
+    }
+    *out++ = c;
+  }
+  *out_size = static_cast<size_t>(out - dst);
+  return true;
+}
+
+}  // namespace kernels
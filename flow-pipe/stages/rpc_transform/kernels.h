@@ -0,0 +1,85 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Compute kernels selectable through RPCTransformConfig.kernel. Each kernel
+// is a specialization of Kernel<Id> with static members, so the registry
+// below is a constexpr table of plain function pointers built at compile
+// time and the per-payload call is one indirect call into the kernel.
+namespace kernels {
+
+enum class Id {
+  kUpper,
+  kLower,
+  kCrc32c,
+  kXxHash64,
+  kBase64Encode,
+  kBase64Decode,
+  kJsonMinify,
+};
+
+// Specializations provide:
+//   static constexpr std::string_view name;
+//   static constexpr bool same_size;  // output size == input size (in-place capable)
+//   static size_t max_output(size_t n);
+//   static bool run(const uint8_t* src, size_t n, uint8_t* dst, size_t* out_size);
+// run returns false for malformed input; dst may alias src when same_size.
+template <Id>
+struct Kernel;
+
+struct Entry {
+  std::string_view name;
+  bool same_size;
+  size_t (*max_output)(size_t n);
+  bool (*run)(const uint8_t* src, size_t n, uint8_t* dst, size_t* out_size);
+};
+
+template <Id id>
+constexpr Entry make_entry() {
+  return Entry{Kernel<id>::name, Kernel<id>::same_size, &Kernel<id>::max_output, &Kernel<id>::run};
+}
+
+#define KERNEL_DECL(ID, NAME, SAME_SIZE)                                            \
+  template <>                                                                       \
+  struct Kernel<Id::ID> {                                                           \
+    static constexpr std::string_view name = NAME;                                  \
+    static constexpr bool same_size = SAME_SIZE;                                    \
+    static size_t max_output(size_t n);                                             \
+    static bool run(const uint8_t* src, size_t n, uint8_t* dst, size_t* out_size);  \
+  };
+
+KERNEL_DECL(kUpper, "upper", true)
+KERNEL_DECL(kLower, "lower", true)
+KERNEL_DECL(kCrc32c, "crc32c", false)
+KERNEL_DECL(kXxHash64, "xxhash64", false)
+KERNEL_DECL(kBase64Encode, "base64_encode", false)
+KERNEL_DECL(kBase64Decode, "base64_decode", false)
+KERNEL_DECL(kJsonMinify, "json_minify", false)
+
+#undef KERNEL_DECL
+
+inline constexpr std::array kRegistry = {
+    make_entry<Id::kUpper>(),        make_entry<Id::kLower>(),
+    make_entry<Id::kCrc32c>(),       make_entry<Id::kXxHash64>(),
+    make_entry<Id::kBase64Encode>(), make_entry<Id::kBase64Decode>(),
+    make_entry<Id::kJsonMinify>(),
+};
+
+// nullptr if name is not registered.
+constexpr const Entry* find(std::string_view name) {
+  for (const Entry& entry : kRegistry) {
+    if (entry.name == name) {
+      return &entry;
+    }
+  }
+  return nullptr;
+}
+
+// Raw digests, exposed for benchmarks and reuse.
+uint32_t crc32c(const uint8_t* data, size_t n);
+uint64_t xxhash64(const uint8_t* data, size_t n, uint64_t seed = 0);
+
+}  // namespace kernels
@@ -1,6 +1,13 @@
+#include <atomic>
 #include <thread>
 #include <chrono>
 
+#include "ascii_case.h"
+#include "coro.h"
+#include "deadline.h"
+#include "hops.h"
+#include "kernels.h"
+#include "stage_metrics.h"
 #include "flowpipe/stage.h"
 #include "flowpipe/configurable_stage.h"
 #include "flowpipe/observability/logging.h"
@@ -13,12 +20,29 @@
 
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
 
 using namespace flowpipe;
 
 using RPCTransformConfig =
     flowpipe::stages::rpc::v1::RPCTransformConfig;
 
+namespace {
+// True when nothing but `payload` references its buffer. Runtimes whose
+// Payload does not expose a shared buffer are trusted to hand each payload
+// to a single consumer, which the in_place option asserts.
+template <class P>
+bool uniquely_owned(const P& payload) {
+  if constexpr (requires { payload.buffer.use_count(); }) {
+    return payload.buffer.use_count() == 1;
+  } else {
+    return true;
+  }
+}
+}  // namespace
+
 // ============================================================
 // RPCTransform
 // ============================================================
@@ -35,7 +59,17 @@ public:
   }
 
   ~RPCTransform() override {
-    FP_LOG_INFO("rpc_transform destroyed");
+    const uint64_t bytes = bytes_.load(std::memory_order_relaxed);
+    const uint64_t ns = kernel_ns_.load(std::memory_order_relaxed);
+    const double ns_per_byte = bytes ? static_cast<double>(ns) / static_cast<double>(bytes) : 0.0;
+    FP_LOG_INFO("rpc_transform destroyed (kernel " +
+                std::string(kernel_ ? kernel_->name : "none") + ": " +
+                std::to_string(bytes) + " bytes, " +
+                std::to_string(ns_per_byte) + " ns/byte; dropped " +
+                std::to_string(expired_.load(std::memory_order_relaxed)) +
+                " expired, " +
+                std::to_string(rejected_.load(std::memory_order_relaxed)) +
+                " rejected payloads)");
   }
 
   // ------------------------------------------------------------
@@ -51,8 +85,35 @@ public:
       return false;
     }
 
+    const std::string kernel_name = cfg.kernel().empty() ? "upper" : cfg.kernel();
+    const kernels::Entry* kernel = kernels::find(kernel_name);
+    if (!kernel) {
+      FP_LOG_ERROR("rpc_transform unknown kernel: " + kernel_name);
+      return false;
+    }
+
+    bool async = false;
+    if (cfg.execution_mode() == "async") {
+      async = true;
+    } else if (!cfg.execution_mode().empty() && cfg.execution_mode() != "sync") {
+      FP_LOG_ERROR("rpc_transform unknown execution_mode: " + cfg.execution_mode());
+      return false;
+    }
+
     config_ = std::move(cfg);
-    FP_LOG_INFO("rpc_transform configured");
+    kernel_ = kernel;
+    max_in_flight_ = config_.max_in_flight() > 0
+                         ? static_cast<size_t>(config_.max_in_flight())
+                         : kDefaultMaxInFlight;
+    scheduler_.reset();
+    if (async) {
+      scheduler_ = std::make_unique<coro::Scheduler>();
+    }
+    FP_LOG_INFO("rpc_transform configured (kernel=" + kernel_name +
+                ", isa=" + ascii::isa_name(ascii::best_isa()) +
+                (config_.in_place() ? ", in_place" : "") +
+                (async ? ", async max_in_flight=" + std::to_string(max_in_flight_) : "") +
+                ")");
     return true;
   }
 
@@ -66,36 +127,224 @@ public:
       return;
     }
 
-    const size_t size = input.size;
+    if (scheduler_) {
+      process_async(ctx, input, output);
+      return;
+    }
+
+    // Idle heartbeat from the source; nothing to do in sync mode.
+    if (input.empty()) {
+      return;
+    }
+
+    // The caller has already timed out; leave the output empty so the
+    // sink skips it too.
+    if (rpc_stages::deadline_expired(input.meta)) {
+      expired_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    const int64_t started_ns = hop_start(input);
 
     // Simulate work
     std::this_thread::sleep_for(std::chrono::milliseconds(config_.processing_delay_ms()));
 
+    if (transform(input, output)) {
+      stamp_hops(output, started_ns);
+    }
+  }
+
+private:
+  // ------------------------------------------------------------
+  // Async mode
+  // ------------------------------------------------------------
+  // The runtime hands us one input and takes one output per call, so
+  // async mode pipelines across calls: the input starts a coroutine that
+  // suspends for the simulated latency, and the output is whichever
+  // earlier payload has finished (or empty if none has). Empty inputs
+  // (source idle heartbeats) only drain finished results. At most
+  // max_in_flight payloads are admitted and not yet emitted; beyond that
+  // the calling thread resumes ready coroutines until one frees up.
+  //
+  // Heartbeats are the only drain path: without them the payloads still in
+  // flight when traffic stops would never be emitted. Until the first one
+  // arrives, each call therefore waits for a finished payload before
+  // returning, which keeps every result flowing at the cost of one payload
+  // in flight per worker thread.
+  void process_async(StageContext& ctx, const Payload& input, Payload& output) {
+    if (input.empty()) {
+      heartbeats_.store(true, std::memory_order_relaxed);
+    } else {
+      while (in_flight_.load(std::memory_order_acquire) >= max_in_flight_) {
+        if (ctx.stop.stop_requested()) {
+          return;
+        }
+        if (output.empty() && pop_finished(output)) {
+          break;
+        }
+        if (scheduler_->run_ready() == 0) {
+          scheduler_->wait_ready(kAdmitWait);
+        }
+      }
+      in_flight_.fetch_add(1, std::memory_order_acq_rel);
+      run_async(input);
+    }
+
+    scheduler_->run_ready();
+    if (output.empty()) {
+      pop_finished(output);
+    }
+    if (input.empty() || heartbeats_.load(std::memory_order_relaxed)) {
+      return;
+    }
+    // Stops once everything admitted is out, this call's payload having
+    // been dropped or emitted by another call.
+    while (output.empty() && in_flight_.load(std::memory_order_acquire) > 0) {
+      if (ctx.stop.stop_requested()) {
+        return;
+      }
+      if (pop_finished(output)) {
+        return;
+      }
+      if (scheduler_->run_ready() == 0) {
+        scheduler_->wait_ready(kAdmitWait);
+      }
+    }
+  }
+
+  coro::Detached run_async(Payload input) {
+    const int64_t started_ns = hop_start(input);
+
+    // Stand-in for a downstream call: the payload waits without holding
+    // a thread.
+    co_await scheduler_->sleep_for(std::chrono::milliseconds(config_.processing_delay_ms()));
+
+    if (rpc_stages::deadline_expired(input.meta)) {
+      expired_.fetch_add(1, std::memory_order_relaxed);
+      in_flight_.fetch_sub(1, std::memory_order_acq_rel);
+      co_return;
+    }
+
+    Payload result;
+    if (!transform(input, result)) {
+      in_flight_.fetch_sub(1, std::memory_order_acq_rel);
+      co_return;
+    }
+    stamp_hops(result, started_ns);
+    std::lock_guard<std::mutex> lock(finished_mu_);
+    finished_.push_back(std::move(result));
+  }
+
+  bool pop_finished(Payload& output) {
+    {
+      std::lock_guard<std::mutex> lock(finished_mu_);
+      if (finished_.empty()) {
+        return false;
+      }
+      output = std::move(finished_.front());
+      finished_.pop_front();
+    }
+    in_flight_.fetch_sub(1, std::memory_order_acq_rel);
+    return true;
+  }
+
+  // ------------------------------------------------------------
+  // Kernel application
+  // ------------------------------------------------------------
+  // Returns false (leaving output untouched) when the payload is dropped.
+  bool transform(const Payload& input, Payload& output) {
+    const size_t size = input.size;
+
+    // ----------------------------------------------------------
+    // Run in place when the kernel keeps the size and the input
+    // buffer is ours alone
+    // ----------------------------------------------------------
+    if (kernel_->same_size && config_.in_place() && uniquely_owned(input)) {
+      output = input;
+      auto* data = const_cast<uint8_t*>(output.data());
+      size_t out_size = 0;
+      run_kernel(data, size, data, &out_size);
+      return true;
+    }
+
     // ----------------------------------------------------------
     // Allocate new payload for output
     // ----------------------------------------------------------
-    auto buffer = AllocatePayloadBuffer(size);
+    auto buffer = AllocatePayloadBuffer(kernel_->max_output(size));
     if (!buffer) {
       FP_LOG_ERROR("rpc_transform failed to allocate payload");
-      return;
+      return false;
     }
 
     // get access to input data
     const uint8_t* src = input.data();
     uint8_t* dst = static_cast<uint8_t*>(buffer.get());
 
-    // convert input string uppercase
-    for (size_t i = 0; i < size; ++i) {
-      dst[i] = static_cast<uint8_t>(
-          std::toupper(static_cast<unsigned char>(src[i])));
+    size_t out_size = 0;
+    if (!run_kernel(src, size, dst, &out_size)) {
+      // Malformed input for this kernel (e.g. bad base64); leave the
+      // output empty so no reply is sent.
+      rejected_.fetch_add(1, std::memory_order_relaxed);
+      return false;
     }
 
     // build output, preserving input meta (carries reply_to and trace context)
-    output = Payload(std::move(buffer), size, input.meta);
+    output = Payload(std::move(buffer), out_size, input.meta);
+    return true;
   }
 
-private:
+  // ------------------------------------------------------------
+  // Hop timing
+  // ------------------------------------------------------------
+  // Start time for payloads carrying a hop list, 0 for the rest.
+  static int64_t hop_start(const Payload& input) {
+    return rpc_stages::hops(input.meta) ? rpc_stages::wall_now_ns() : 0;
+  }
+
+  static void stamp_hops(Payload& output, int64_t started_ns) {
+    if (started_ns == 0) {
+      return;
+    }
+    rpc_stages::stamp_hop(output.meta, "tx_start", started_ns);
+    rpc_stages::stamp_hop(output.meta, "tx_end", rpc_stages::wall_now_ns());
+  }
+
+  // Runs the configured kernel and accounts its cost per input byte.
+  bool run_kernel(const uint8_t* src, size_t n, uint8_t* dst, size_t* out_size) {
+    const auto start = std::chrono::steady_clock::now();
+    const bool ok = kernel_->run(src, n, dst, out_size);
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    kernel_ns_.fetch_add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+        std::memory_order_relaxed);
+    bytes_.fetch_add(n, std::memory_order_relaxed);
+    if (n > 0) {
+      ns_per_byte_metric_.record(
+          static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) /
+          static_cast<double>(n));
+    }
+    return ok;
+  }
+
+  static constexpr auto kAdmitWait = std::chrono::milliseconds(1);
+  static constexpr size_t kDefaultMaxInFlight = 256;
+
   RPCTransformConfig config_{};
+  const kernels::Entry* kernel_{kernels::find("upper")};
+  size_t max_in_flight_{kDefaultMaxInFlight};
+  std::atomic<size_t> in_flight_{0};
+  std::mutex finished_mu_;
+  std::deque<Payload> finished_;
+  std::atomic<bool> heartbeats_{false};
+  std::atomic<uint64_t> expired_{0};
+  std::atomic<uint64_t> rejected_{0};
+  std::atomic<uint64_t> bytes_{0};
+  std::atomic<uint64_t> kernel_ns_{0};
+  rpc_stages::metrics::Histogram ns_per_byte_metric_{
+      "flowpipe.transform.kernel.ns_per_byte", "Kernel time per input byte", "ns/By"};
+  // Declared last so it is destroyed first: parked coroutines are freed
+  // before the state they refer to.
+  std::unique_ptr<coro::Scheduler> scheduler_;
 };
 
 // ============================================================
@@ -56,6 +56,35 @@ int main() {
 
   std::cout << "status=" << resp.status() << " payload='" << resp.payload()
             << "' processed_by=" << resp.processed_by() << std::endl;
+
+  // A short RunStream call, so the smoke test covers the streaming path too.
+  grpc::ClientContext stream_ctx;
+  GrpcMetadataCarrier stream_carrier(stream_ctx);
+  propagator->Inject(stream_carrier, opentelemetry::context::RuntimeContext::GetCurrent());
+  auto stream = stub->RunStream(&stream_ctx);
+  constexpr int kStreamRequests = 3;
+  for (int i = 0; i < kStreamRequests; ++i) {
+    flowpipe::rpc::v1::RPCRequest item;
+    item.set_payload("stream item " + std::to_string(i));
+    stream->Write(item);
+  }
+  stream->WritesDone();
+  int stream_ok = 0;
+  flowpipe::rpc::v1::RPCResponse item;
+  while (stream->Read(&item)) {
+    if (item.code() == 0) {
+      ++stream_ok;
+    }
+  }
+  status = stream->Finish();
+  if (!status.ok()) {
+    span->SetStatus(opentelemetry::trace::StatusCode::kError, status.error_message());
+    std::cerr << "RunStream failed: " << status.error_message() << std::endl;
+    span->End();
+    otel::ShutdownTracer();
+    return 1;
+  }
+  std::cout << "stream_ok=" << stream_ok << "/" << kStreamRequests << std::endl;
   span->End();
   otel::ShutdownTracer();
   return 0;
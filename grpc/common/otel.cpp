@@ -1,11 +1,24 @@
 #include "otel.h"
 
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
+#include <memory>
 
 #include <opentelemetry/context/propagation/global_propagator.h>
 #include <opentelemetry/exporters/otlp/otlp_grpc_exporter_factory.h>
+#include <opentelemetry/exporters/otlp/otlp_grpc_metric_exporter_factory.h>
+#include <opentelemetry/exporters/otlp/otlp_grpc_metric_exporter_options.h>
+#include <opentelemetry/metrics/provider.h>
+#include <opentelemetry/sdk/metrics/export/periodic_exporting_metric_reader_factory.h>
+#include <opentelemetry/sdk/metrics/meter_provider.h>
+#include <opentelemetry/sdk/metrics/view/view_registry.h>
 #include <opentelemetry/sdk/resource/resource.h>
 #include <opentelemetry/sdk/trace/batch_span_processor.h>
+#include <opentelemetry/sdk/trace/samplers/always_off.h>
+#include <opentelemetry/sdk/trace/samplers/always_on.h>
+#include <opentelemetry/sdk/trace/samplers/parent.h>
+#include <opentelemetry/sdk/trace/samplers/trace_id_ratio.h>
 #include <opentelemetry/sdk/trace/tracer_provider.h>
 #include <opentelemetry/trace/propagation/http_trace_context.h>
 
@@ -13,9 +26,75 @@ namespace otel {
 namespace trace_sdk = opentelemetry::sdk::trace;
 namespace resource = opentelemetry::sdk::resource;
 namespace trace = opentelemetry::trace;
+namespace metrics_sdk = opentelemetry::sdk::metrics;
+namespace metrics_api = opentelemetry::metrics;
 
 // Held so ShutdownTracer() can flush and release buffered spans.
 static std::shared_ptr<trace_sdk::TracerProvider> g_sdk_provider;
+// Looked up once; TracerProvider::GetTracer takes a lock per call.
+static opentelemetry::nostd::shared_ptr<trace::Tracer> g_tracer;
+// Whether the sampler follows the parent's sampled flag, and whether it
+// can sample a request that has no (usable) parent.
+static bool g_parent_based = true;
+static bool g_root_may_sample = true;
+
+// Held so ShutdownMetrics() can export the last interval.
+static std::shared_ptr<metrics_sdk::MeterProvider> g_meter_provider;
+
+static std::string EnvString(const char *name, const char *fallback) {
+  const char *value = std::getenv(name);
+  return (value != nullptr && *value != '\0') ? value : fallback;
+}
+
+static size_t EnvSize(const char *name, size_t fallback) {
+  const char *value = std::getenv(name);
+  if (value == nullptr || *value == '\0') {
+    return fallback;
+  }
+  char *end = nullptr;
+  long parsed = std::strtol(value, &end, 10);
+  return (end != nullptr && *end == '\0' && parsed > 0) ? static_cast<size_t>(parsed)
+                                                         : fallback;
+}
+
+static double SamplerRatio() {
+  const char *value = std::getenv("OTEL_TRACES_SAMPLER_ARG");
+  if (value == nullptr || *value == '\0') {
+    return 1.0;
+  }
+  char *end = nullptr;
+  double parsed = std::strtod(value, &end);
+  if (end == nullptr || *end != '\0' || parsed < 0.0 || parsed > 1.0) {
+    return 1.0;
+  }
+  return parsed;
+}
+
+static std::unique_ptr<trace_sdk::Sampler> MakeRootSampler(const std::string &name) {
+  if (name == "always_off") {
+    return std::make_unique<trace_sdk::AlwaysOffSampler>();
+  }
+  if (name == "traceidratio") {
+    return std::make_unique<trace_sdk::TraceIdRatioBasedSampler>(SamplerRatio());
+  }
+  return std::make_unique<trace_sdk::AlwaysOnSampler>();
+}
+
+// Sampler named by OTEL_TRACES_SAMPLER, parentbased_always_on by default.
+static std::unique_ptr<trace_sdk::Sampler> MakeSampler() {
+  const std::string name = EnvString("OTEL_TRACES_SAMPLER", "parentbased_always_on");
+  g_parent_based = name.rfind("parentbased_", 0) == 0;
+  const std::string root = g_parent_based ? name.substr(12) : name;
+  g_root_may_sample = !(root == "always_off" ||
+                        (root == "traceidratio" && SamplerRatio() == 0.0));
+
+  auto sampler = MakeRootSampler(root);
+  if (g_parent_based) {
+    return std::make_unique<trace_sdk::ParentBasedSampler>(
+        std::shared_ptr<trace_sdk::Sampler>(std::move(sampler)));
+  }
+  return sampler;
+}
 
 void InitTracer(const std::string &service_name) {
   opentelemetry::exporter::otlp::OtlpGrpcExporterOptions opts;
@@ -24,16 +103,26 @@ void InitTracer(const std::string &service_name) {
     opts.endpoint = endpoint;
   }
 
+  trace_sdk::BatchSpanProcessorOptions batch_opts;
+  batch_opts.max_queue_size = EnvSize("OTEL_BSP_MAX_QUEUE_SIZE", batch_opts.max_queue_size);
+  batch_opts.max_export_batch_size =
+      std::min(EnvSize("OTEL_BSP_MAX_EXPORT_BATCH_SIZE", batch_opts.max_export_batch_size),
+               batch_opts.max_queue_size);
+  batch_opts.schedule_delay_millis = std::chrono::milliseconds(EnvSize(
+      "OTEL_BSP_SCHEDULE_DELAY",
+      static_cast<size_t>(batch_opts.schedule_delay_millis.count())));
+
   auto exporter = opentelemetry::exporter::otlp::OtlpGrpcExporterFactory::Create(opts);
   auto processor = std::make_unique<trace_sdk::BatchSpanProcessor>(std::move(exporter),
-                                                                    trace_sdk::BatchSpanProcessorOptions{});
+                                                                    batch_opts);
 
   auto attrs = resource::ResourceAttributes{{"service.name", service_name}};
   g_sdk_provider = std::make_shared<trace_sdk::TracerProvider>(
-      std::move(processor), resource::Resource::Create(attrs));
+      std::move(processor), resource::Resource::Create(attrs), MakeSampler());
   trace::Provider::SetTracerProvider(
       opentelemetry::nostd::shared_ptr<trace::TracerProvider>(
           std::static_pointer_cast<trace::TracerProvider>(g_sdk_provider)));
+  g_tracer = g_sdk_provider->GetTracer("flow-pipe-rpc-demo", OPENTELEMETRY_SDK_VERSION);
 
   opentelemetry::context::propagation::GlobalTextMapPropagator::SetGlobalPropagator(
       opentelemetry::nostd::shared_ptr<opentelemetry::context::propagation::TextMapPropagator>(
@@ -41,15 +130,73 @@ void InitTracer(const std::string &service_name) {
 }
 
 opentelemetry::nostd::shared_ptr<trace::Tracer> GetTracer() {
+  if (g_tracer) {
+    return g_tracer;
+  }
   auto provider = trace::Provider::GetTracerProvider();
   return provider->GetTracer("flow-pipe-rpc-demo", OPENTELEMETRY_SDK_VERSION);
 }
 
+bool MaySample(std::string_view traceparent) {
+  // "00-<32hex trace-id>-<16hex parent-id>-<2hex flags>"; the sampled flag
+  // is the low bit of the last hex digit.
+  if (g_parent_based && traceparent.size() >= 55 && traceparent[52] == '-') {
+    const char last = traceparent[54];
+    const int nibble = (last >= '0' && last <= '9')   ? last - '0'
+                       : (last >= 'a' && last <= 'f') ? last - 'a' + 10
+                       : (last >= 'A' && last <= 'F') ? last - 'A' + 10
+                                                      : 1;
+    return (nibble & 1) != 0;
+  }
+  return g_root_may_sample;
+}
+
 void ShutdownTracer() {
   if (g_sdk_provider) {
     g_sdk_provider->Shutdown();
     g_sdk_provider.reset();
   }
+  g_tracer = opentelemetry::nostd::shared_ptr<trace::Tracer>();
+}
+
+void InitMetrics(const std::string &service_name) {
+  // Standard switch; the API's no-op meter provider stays in place.
+  if (EnvString("OTEL_METRICS_EXPORTER", "otlp") == "none") {
+    return;
+  }
+
+  opentelemetry::exporter::otlp::OtlpGrpcMetricExporterOptions opts;
+  const char *endpoint = std::getenv("OTEL_EXPORTER_OTLP_ENDPOINT");
+  if (endpoint != nullptr) {
+    opts.endpoint = endpoint;
+  }
+
+  metrics_sdk::PeriodicExportingMetricReaderOptions reader_opts;
+  reader_opts.export_interval_millis =
+      std::chrono::milliseconds(EnvSize("OTEL_METRIC_EXPORT_INTERVAL", 10000));
+  reader_opts.export_timeout_millis = std::chrono::milliseconds(
+      std::min<long>(5000, reader_opts.export_interval_millis.count() / 2));
+
+  auto attrs = resource::ResourceAttributes{{"service.name", service_name}};
+  g_meter_provider = std::make_shared<metrics_sdk::MeterProvider>(
+      std::make_unique<metrics_sdk::ViewRegistry>(), resource::Resource::Create(attrs));
+  g_meter_provider->AddMetricReader(metrics_sdk::PeriodicExportingMetricReaderFactory::Create(
+      opentelemetry::exporter::otlp::OtlpGrpcMetricExporterFactory::Create(opts), reader_opts));
+  metrics_api::Provider::SetMeterProvider(
+      opentelemetry::nostd::shared_ptr<metrics_api::MeterProvider>(
+          std::static_pointer_cast<metrics_api::MeterProvider>(g_meter_provider)));
+}
+
+opentelemetry::nostd::shared_ptr<metrics_api::Meter> GetMeter() {
+  return metrics_api::Provider::GetMeterProvider()->GetMeter("flow-pipe-rpc-demo",
+                                                             OPENTELEMETRY_SDK_VERSION);
+}
+
+void ShutdownMetrics() {
+  if (g_meter_provider) {
+    g_meter_provider->Shutdown();
+    g_meter_provider.reset();
+  }
 }
 
 } // namespace otel
@@ -1,14 +1,35 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 
+#include <opentelemetry/metrics/meter.h>
 #include <opentelemetry/nostd/shared_ptr.h>
 #include <opentelemetry/trace/provider.h>
 
 namespace otel {
 
+// Sampling and export batching follow the standard SDK environment
+// variables: OTEL_TRACES_SAMPLER (always_on, always_off, traceidratio,
+// parentbased_always_on [default], parentbased_always_off,
+// parentbased_traceidratio), OTEL_TRACES_SAMPLER_ARG (ratio),
+// OTEL_BSP_MAX_QUEUE_SIZE, OTEL_BSP_MAX_EXPORT_BATCH_SIZE and
+// OTEL_BSP_SCHEDULE_DELAY (ms).
 void InitTracer(const std::string &service_name);
 opentelemetry::nostd::shared_ptr<opentelemetry::trace::Tracer> GetTracer();
 void ShutdownTracer();
 
+// False when a request whose incoming W3C traceparent is `traceparent`
+// (empty if none) can never be sampled: tracing is off, or the sampler is
+// parent-based and the parent is unsampled. Callers skip context
+// extraction and span work entirely in that case.
+bool MaySample(std::string_view traceparent);
+
+// Always-on OTLP metrics, exported to OTEL_EXPORTER_OTLP_ENDPOINT every
+// OTEL_METRIC_EXPORT_INTERVAL ms (default 10000) regardless of trace
+// sampling. OTEL_METRICS_EXPORTER=none disables them.
+void InitMetrics(const std::string &service_name);
+opentelemetry::nostd::shared_ptr<opentelemetry::metrics::Meter> GetMeter();
+void ShutdownMetrics();
+
 } // namespace otel
@@ -0,0 +1,76 @@
+#include "concurrency_limiter.h"
+
+#include <algorithm>
+
+ConcurrencyLimiter::ConcurrencyLimiter(const Options &options)
+    : options_(options) {
+  options_.min_limit = std::max<size_t>(options_.min_limit, 1);
+  options_.max_limit = std::max(options_.max_limit, options_.min_limit);
+  exact_limit_ = static_cast<double>(
+      std::clamp(options_.initial_limit, options_.min_limit, options_.max_limit));
+  limit_.store(static_cast<size_t>(exact_limit_), std::memory_order_relaxed);
+}
+
+bool ConcurrencyLimiter::TryAcquire() {
+  size_t current = in_flight_.load(std::memory_order_relaxed);
+  do {
+    if (current >= limit_.load(std::memory_order_relaxed)) {
+      rejected_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+  } while (!in_flight_.compare_exchange_weak(current, current + 1,
+                                             std::memory_order_relaxed));
+  return true;
+}
+
+void ConcurrencyLimiter::OnReply(Clock::duration latency, size_t bytes) {
+  const size_t in_flight = in_flight_.fetch_sub(1, std::memory_order_relaxed);
+  if (options_.max_sample_bytes > 0 && bytes > options_.max_sample_bytes) {
+    return;
+  }
+  const auto now = Clock::now();
+
+  std::lock_guard<std::mutex> lock(mu_);
+  window_min_rtt_ = std::min(window_min_rtt_, latency);
+  if (now - window_start_ >= kRttWindow) {
+    min_rtt_ = window_min_rtt_;
+    window_min_rtt_ = Clock::duration::max();
+    window_start_ = now;
+  }
+  min_rtt_ = std::min(min_rtt_, latency);
+
+  if (latency > min_rtt_ * options_.tolerance) {
+    DecreaseLocked(now, latency);
+  } else if (in_flight * 2 >= limit_.load(std::memory_order_relaxed)) {
+    // Only grow while the limit is what holds traffic back.
+    SetLimitLocked(exact_limit_ + 1.0 / exact_limit_);
+  }
+}
+
+void ConcurrencyLimiter::OnDrop() {
+  in_flight_.fetch_sub(1, std::memory_order_relaxed);
+  const auto now = Clock::now();
+  std::lock_guard<std::mutex> lock(mu_);
+  DecreaseLocked(now, min_rtt_ == Clock::duration::max() ? Clock::duration::zero() : min_rtt_);
+}
+
+void ConcurrencyLimiter::OnIgnore() {
+  in_flight_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void ConcurrencyLimiter::DecreaseLocked(Clock::time_point now,
+                                        Clock::duration latency) {
+  // Replies already in flight when the limit was cut still report the old
+  // congestion; let one latency pass before cutting again.
+  if (now - last_decrease_ < latency) {
+    return;
+  }
+  last_decrease_ = now;
+  SetLimitLocked(exact_limit_ * options_.backoff);
+}
+
+void ConcurrencyLimiter::SetLimitLocked(double limit) {
+  exact_limit_ = std::clamp(limit, static_cast<double>(options_.min_limit),
+                            static_cast<double>(options_.max_limit));
+  limit_.store(static_cast<size_t>(exact_limit_), std::memory_order_relaxed);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+// Adaptive cap on requests in the pipeline (AIMD on reply latency). The
+// baseline is the lowest latency seen over a sliding window. While replies
+// come back within tolerance x baseline and the limit is being used, each
+// one adds 1/limit, so the limit grows by about one per limit's worth of
+// replies. A slower reply or a timeout cuts it by backoff, at most once per
+// observed latency so one slow burst does not collapse it. Requests over the
+// limit are turned away instead of queuing behind work that will time out
+// anyway.
+//
+// Large requests and replies take longer because of their size
+// (compression, chunked transfer), not because the pipeline is congested.
+// Their latency would pass for congestion, so they return their permit
+// without being judged.
+class ConcurrencyLimiter {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Options {
+    size_t initial_limit;
+    size_t min_limit;
+    size_t max_limit;
+    double tolerance;
+    double backoff;
+    // Replies whose request or reply payload is larger than this are not
+    // judged; 0 judges every reply.
+    size_t max_sample_bytes;
+  };
+
+  explicit ConcurrencyLimiter(const Options &options);
+
+  ConcurrencyLimiter(const ConcurrencyLimiter &) = delete;
+  ConcurrencyLimiter &operator=(const ConcurrencyLimiter &) = delete;
+
+  // Takes a permit unless the limit is reached.
+  bool TryAcquire();
+
+  // Returns a permit with the request's reply latency and the larger of its
+  // request and reply payload sizes.
+  void OnReply(Clock::duration latency, size_t bytes);
+  // Returns a permit for a request that got no reply in time.
+  void OnDrop();
+  // Returns a permit without judging the limit (e.g. publish failure).
+  void OnIgnore();
+
+  size_t limit() const { return limit_.load(std::memory_order_relaxed); }
+  size_t in_flight() const { return in_flight_.load(std::memory_order_relaxed); }
+  uint64_t rejected() const { return rejected_.load(std::memory_order_relaxed); }
+
+private:
+  static constexpr auto kRttWindow = std::chrono::seconds(10);
+
+  void SetLimitLocked(double limit);
+  void DecreaseLocked(Clock::time_point now, Clock::duration latency);
+
+  Options options_;
+
+  std::atomic<size_t> limit_;
+  std::atomic<size_t> in_flight_{0};
+  std::atomic<uint64_t> rejected_{0};
+
+  std::mutex mu_;
+  double exact_limit_;
+  Clock::duration min_rtt_{Clock::duration::max()};
+  Clock::duration window_min_rtt_{Clock::duration::max()};
+  Clock::time_point window_start_{Clock::now()};
+  Clock::time_point last_decrease_{};
+};
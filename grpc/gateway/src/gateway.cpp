@@ -0,0 +1,1048 @@
+#include "gateway.h"
+
+#include "chunking.h"
+#include "otel.h"
+
+#include <natscpp/error.hpp>
+#include <opentelemetry/context/propagation/global_propagator.h>
+#include <opentelemetry/metrics/observer_result.h>
+#include <opentelemetry/trace/context.h>
+#include <opentelemetry/trace/scope.h>
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <string>
+
+using flowpipe::rpc::v1::RPCRequest;
+using flowpipe::rpc::v1::RPCResponse;
+
+namespace {
+constexpr size_t kDefaultReplySlots = 16384;
+constexpr int kDefaultReplySweepMs = 50;
+constexpr const char *kDefaultSubject = "flow.jobs";
+constexpr long kDefaultCacheTtlMs = 60000;
+constexpr long kDefaultCacheShards = 16;
+constexpr long kDefaultLimitInitial = 64;
+constexpr long kDefaultLimitMin = 8;
+constexpr long kDefaultLimitMax = 4096;
+constexpr long kDefaultLimitTolerancePct = 200;
+constexpr long kDefaultLimitBackoffPct = 90;
+constexpr long kDefaultLimitMaxSampleBytes = 64l << 10;
+constexpr long kDefaultCompressMinBytes = 1024;
+constexpr long kDefaultChunkWindow = 8;
+constexpr long kDefaultChunkMaxBytes = 64l << 20;
+constexpr long kDefaultMaxReplyBytes = 64l << 20;
+constexpr long kDefaultReplyWorkers = 2;
+constexpr long kDefaultStreamWindow = 256;
+constexpr long kDefaultHedgePercentile = 95;
+constexpr long kDefaultHedgeMinMs = 10;
+constexpr long kDefaultHedgeBudgetPct = 10;
+// Upper bound on the wait when the client sets no (or a longer) deadline.
+constexpr std::chrono::milliseconds kReplyTimeout{10000};
+// Remaining time budget, in milliseconds at publish time, so the pipeline
+// can shed work nobody is waiting for any more.
+constexpr std::string_view kDeadlineHeader = "flow-deadline-ms";
+// Wall-clock hop timestamps, "pub=<ns>" at publish; the stages append theirs
+// (flow-pipe/stages/common/hops.h) and the sink returns the list.
+constexpr std::string_view kHopsHeader = "flow-hops";
+// Hops in pipeline order. Segment i runs from kHops[i] to kHops[i + 1]; the
+// last one ends when the reply reaches the gateway.
+constexpr std::array<std::string_view, 5> kHops = {"pub", "recv", "tx_start", "tx_end", "sink"};
+constexpr std::array<const char *, 5> kSegments = {"nats_request", "q_in", "transform",
+                                                   "q_out", "nats_reply"};
+
+long EnvLong(const char *name, long fallback) {
+  const char *value = std::getenv(name);
+  if (value == nullptr || *value == '\0') {
+    return fallback;
+  }
+  char *end = nullptr;
+  long parsed = std::strtol(value, &end, 10);
+  return (end != nullptr && *end == '\0' && parsed > 0) ? parsed : fallback;
+}
+
+// Per-request cache policy from the `flow-cache` client metadata:
+// "no-cache" skips the lookup but stores the fresh reply, "no-store" leaves
+// the cache out entirely.
+enum class CachePolicy { kUse, kRefresh, kBypass };
+
+CachePolicy RequestCachePolicy(const grpc::ServerContextBase &ctx) {
+  auto it = ctx.client_metadata().find("flow-cache");
+  if (it == ctx.client_metadata().end()) {
+    return CachePolicy::kUse;
+  }
+  const std::string_view value(it->second.data(), it->second.size());
+  if (value == "no-store") {
+    return CachePolicy::kBypass;
+  }
+  return value == "no-cache" ? CachePolicy::kRefresh : CachePolicy::kUse;
+}
+
+// Shard key: the `flow-shard-key` client metadata when set, so related
+// requests stay on one shard, otherwise the payload.
+std::string_view ShardKey(const grpc::ServerContextBase &ctx,
+                          std::string_view payload) {
+  auto it = ctx.client_metadata().find("flow-shard-key");
+  if (it == ctx.client_metadata().end()) {
+    return payload;
+  }
+  return {it->second.data(), it->second.size()};
+}
+
+// The request's priority field, or else its `flow-priority` metadata.
+RPCRequest::Priority RequestPriority(const grpc::ServerContextBase &ctx,
+                                     const RPCRequest &request) {
+  if (request.priority() != RPCRequest::PRIORITY_UNSPECIFIED) {
+    return request.priority();
+  }
+  auto it = ctx.client_metadata().find("flow-priority");
+  if (it == ctx.client_metadata().end()) {
+    return RPCRequest::PRIORITY_UNSPECIFIED;
+  }
+  const std::string_view value(it->second.data(), it->second.size());
+  if (value == "interactive") {
+    return RPCRequest::PRIORITY_INTERACTIVE;
+  }
+  return value == "bulk" ? RPCRequest::PRIORITY_BULK
+                         : RPCRequest::PRIORITY_UNSPECIFIED;
+}
+
+// True when the client marked the call safe to run twice with the
+// `flow-idempotent` metadata.
+bool Idempotent(const grpc::ServerContextBase &ctx) {
+  auto it = ctx.client_metadata().find("flow-idempotent");
+  if (it == ctx.client_metadata().end()) {
+    return false;
+  }
+  const std::string_view value(it->second.data(), it->second.size());
+  return value == "true" || value == "1";
+}
+
+int64_t WallNowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+// Records each segment of a returned hop list whose two ends are present.
+// Cross-host segments absorb clock skew; negative ones are clamped to 0.
+void RecordHops(std::string_view list, int64_t replied_ns,
+                opentelemetry::metrics::Histogram<double> &histogram) {
+  std::array<int64_t, kHops.size() + 1> at{};
+  while (!list.empty()) {
+    const size_t comma = list.find(',');
+    const std::string_view item = list.substr(0, comma);
+    list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+    const size_t eq = item.find('=');
+    if (eq == std::string_view::npos) {
+      continue;
+    }
+    const auto hop = std::find(kHops.begin(), kHops.end(), item.substr(0, eq));
+    if (hop == kHops.end()) {
+      continue;
+    }
+    int64_t ns = 0;
+    const std::string_view value = item.substr(eq + 1);
+    auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), ns);
+    if (ec == std::errc{} && end == value.data() + value.size()) {
+      at[hop - kHops.begin()] = ns;
+    }
+  }
+  at.back() = replied_ns;
+  for (size_t i = 0; i < kSegments.size(); ++i) {
+    if (at[i] == 0 || at[i + 1] == 0) {
+      continue;
+    }
+    histogram.Record(static_cast<double>(std::max<int64_t>(at[i + 1] - at[i], 0)) / 1e6,
+                     {{"segment", kSegments[i]}}, opentelemetry::context::Context{});
+  }
+}
+
+// Extract incoming trace context from gRPC client metadata so the gateway
+// span is a child of the client span.
+class GrpcServerCarrier : public opentelemetry::context::propagation::TextMapCarrier {
+public:
+  explicit GrpcServerCarrier(const grpc::ServerContextBase &ctx) : ctx_(ctx) {}
+  opentelemetry::nostd::string_view Get(
+      opentelemetry::nostd::string_view key) const noexcept override {
+    auto it = ctx_.client_metadata().find(
+        grpc::string_ref(key.data(), key.size()));
+    if (it != ctx_.client_metadata().end())
+      return {it->second.data(), it->second.size()};
+    return "";
+  }
+  void Set(opentelemetry::nostd::string_view,
+           opentelemetry::nostd::string_view) noexcept override {}
+private:
+  const grpc::ServerContextBase &ctx_;
+};
+
+// The raw traceparent metadata value, used to decide sampling before
+// paying for a full propagator extraction.
+std::string_view IncomingTraceparent(const grpc::ServerContextBase &ctx) {
+  auto it = ctx.client_metadata().find("traceparent");
+  if (it == ctx.client_metadata().end()) {
+    return {};
+  }
+  return {it->second.data(), it->second.size()};
+}
+
+// "00-<32hex trace-id>-<16hex parent-id>-00" for a request that is not
+// sampled, so the pipeline leaves it out of its traces too. It stays in the
+// trace of span (a non-recording span), else of the caller's traceparent,
+// else a fresh trace id.
+std::string UnsampledTraceparent(
+    const opentelemetry::nostd::shared_ptr<opentelemetry::trace::Span> &span,
+    std::string_view incoming) {
+  std::string traceparent = "00-";
+  if (span) {
+    const auto context = span->GetContext();
+    char trace_id[32];
+    char span_id[16];
+    context.trace_id().ToLowerBase16(trace_id);
+    context.span_id().ToLowerBase16(span_id);
+    traceparent.append(trace_id, sizeof(trace_id)).append("-");
+    traceparent.append(span_id, sizeof(span_id));
+  } else if (incoming.size() >= 55 && incoming[2] == '-' && incoming[35] == '-' &&
+             incoming[52] == '-') {
+    traceparent.append(incoming.substr(3, 49));
+  } else {
+    thread_local std::mt19937_64 rng{std::random_device{}()};
+    char ids[50];
+    std::snprintf(ids, sizeof(ids), "%016llx%016llx-%016llx",
+                  static_cast<unsigned long long>(rng()),
+                  static_cast<unsigned long long>(rng()),
+                  static_cast<unsigned long long>(rng()));
+    traceparent.append(ids, 49);
+  }
+  return traceparent.append("-00");
+}
+
+class NatsCarrier : public opentelemetry::context::propagation::TextMapCarrier {
+public:
+  explicit NatsCarrier(natscpp::message &msg) : msg_(msg) {}
+  opentelemetry::nostd::string_view Get(
+      opentelemetry::nostd::string_view) const noexcept override {
+    return "";
+  }
+  void Set(opentelemetry::nostd::string_view key,
+           opentelemetry::nostd::string_view value) noexcept override {
+    try {
+      msg_.set_header(std::string_view{key.data(), key.size()},
+                      std::string_view{value.data(), value.size()});
+    } catch (...) {}
+  }
+private:
+  natscpp::message &msg_;
+};
+
+class ReplyCarrier : public opentelemetry::context::propagation::TextMapCarrier {
+public:
+  explicit ReplyCarrier(const std::string &tp) : tp_(tp) {}
+  opentelemetry::nostd::string_view Get(
+      opentelemetry::nostd::string_view key) const noexcept override {
+    if (key == "traceparent") return {tp_.data(), tp_.size()};
+    return "";
+  }
+  void Set(opentelemetry::nostd::string_view,
+           opentelemetry::nostd::string_view) noexcept override {}
+private:
+  const std::string &tp_;
+};
+// Reports the limit at each metrics collection; state is the limiter.
+void ObserveLimit(opentelemetry::metrics::ObserverResult result, void *state) {
+  const auto *limiter = static_cast<const ConcurrencyLimiter *>(state);
+  opentelemetry::nostd::get<opentelemetry::nostd::shared_ptr<
+      opentelemetry::metrics::ObserverResultT<int64_t>>>(result)
+      ->Observe(static_cast<int64_t>(limiter->limit()));
+}
+} // namespace
+
+Gateway::Metrics::Metrics() {
+  auto meter = otel::GetMeter();
+  in_flight = meter->CreateInt64UpDownCounter(
+      "gateway.requests.in_flight", "Requests published and awaiting a reply");
+  reply_latency = meter->CreateDoubleHistogram(
+      "gateway.reply.duration", "Time from NATS publish to reply", "ms");
+  timeouts = meter->CreateUInt64Counter(
+      "gateway.requests.timeouts", "Requests that got no reply before their deadline");
+  request_size = meter->CreateUInt64Histogram(
+      "gateway.request.size", "Request payload size", "By");
+  reply_size = meter->CreateUInt64Histogram(
+      "gateway.reply.size", "Reply payload size", "By");
+  hop_duration = meter->CreateDoubleHistogram(
+      "gateway.hop.duration", "Time spent in one pipeline segment", "ms");
+  cache_hits = meter->CreateUInt64Counter(
+      "gateway.cache.hits", "Requests answered from the reply cache");
+  cache_misses = meter->CreateUInt64Counter(
+      "gateway.cache.misses", "Cache lookups that went to the pipeline");
+  cache_evictions = meter->CreateUInt64Counter(
+      "gateway.cache.evictions", "Cached replies evicted to stay within the byte budget");
+  coalesced = meter->CreateUInt64Counter(
+      "gateway.requests.coalesced", "Requests that shared an identical in-flight request's reply");
+  concurrency_limit = meter->CreateInt64ObservableGauge(
+      "gateway.concurrency.limit", "Current adaptive cap on requests in the pipeline");
+  limited = meter->CreateUInt64Counter(
+      "gateway.requests.limited", "Requests rejected by the concurrency limit");
+  hedged = meter->CreateUInt64Counter(
+      "gateway.requests.hedged", "Duplicate requests published for slow replies");
+}
+
+Gateway::Gateway() {
+  const char *url = std::getenv("NATS_URL");
+  const char *pick = std::getenv("GATEWAY_NATS_PICK");
+  pick_by_hash_ = pick != nullptr && std::string_view(pick) == "hash";
+  hop_timings_ = EnvLong("GATEWAY_HOP_TIMINGS", 0) > 0;
+  chunk_bytes_ = static_cast<size_t>(EnvLong("GATEWAY_CHUNK_BYTES", 0));
+  if (const char *codec = std::getenv("GATEWAY_COMPRESSION");
+      codec != nullptr && *codec != '\0' && std::string_view(codec) != "none") {
+    compression_ = compression::ParseCodec(codec);
+    if (compression_ == compression::Codec::kNone) {
+      std::cerr << "Gateway: compression codec " << codec
+                << " not available (built with: " << compression::Supported()
+                << ")\n";
+    } else {
+      accept_encoding_ = compression::Supported();
+    }
+  }
+  compress_min_bytes_ = static_cast<size_t>(
+      EnvLong("GATEWAY_COMPRESS_MIN_BYTES", kDefaultCompressMinBytes));
+  max_reply_bytes_ = static_cast<size_t>(
+      EnvLong("GATEWAY_MAX_REPLY_BYTES", kDefaultMaxReplyBytes));
+  stream_window_ = static_cast<size_t>(
+      EnvLong("GATEWAY_STREAM_WINDOW", kDefaultStreamWindow));
+  const ReplyMux::ChunkOptions chunk_options{
+      static_cast<uint32_t>(EnvLong("GATEWAY_CHUNK_WINDOW", kDefaultChunkWindow)),
+      static_cast<size_t>(EnvLong("GATEWAY_CHUNK_MAX_BYTES", kDefaultChunkMaxBytes))};
+  const char *subject = std::getenv("GATEWAY_SUBJECT");
+  const std::string base = subject != nullptr && *subject != '\0' ? subject : kDefaultSubject;
+  const long shards = EnvLong("GATEWAY_SHARDS", 0);
+  if (shards > 0) {
+    for (long i = 0; i < shards; ++i) {
+      subjects_[0].push_back(base + "." + std::to_string(i));
+    }
+  } else {
+    subjects_[0].push_back(base);
+  }
+  // Without lanes every priority shares the default subjects.
+  const bool lanes = EnvLong("GATEWAY_PRIORITY_LANES", 0) > 0;
+  for (const auto &subject : subjects_[0]) {
+    subjects_[RPCRequest::PRIORITY_INTERACTIVE].push_back(
+        lanes ? subject + ".interactive" : subject);
+    subjects_[RPCRequest::PRIORITY_BULK].push_back(lanes ? subject + ".bulk" : subject);
+  }
+  const long cache_bytes = EnvLong("GATEWAY_CACHE_BYTES", 0);
+  if (cache_bytes > 0) {
+    cache_ = std::make_unique<ResponseCache>(
+        static_cast<size_t>(cache_bytes),
+        std::chrono::milliseconds(EnvLong("GATEWAY_CACHE_TTL_MS", kDefaultCacheTtlMs)),
+        static_cast<size_t>(EnvLong("GATEWAY_CACHE_SHARDS", kDefaultCacheShards)));
+  }
+  if (EnvLong("GATEWAY_SINGLE_FLIGHT", 0) > 0) {
+    single_flight_ = std::make_unique<SingleFlight>(kDefaultCacheShards);
+  }
+  const char *limit = std::getenv("GATEWAY_CONCURRENCY_LIMIT");
+  if (limit != nullptr && std::string_view(limit) == "aimd") {
+    ConcurrencyLimiter::Options options{
+        static_cast<size_t>(EnvLong("GATEWAY_LIMIT_INITIAL", kDefaultLimitInitial)),
+        static_cast<size_t>(EnvLong("GATEWAY_LIMIT_MIN", kDefaultLimitMin)),
+        static_cast<size_t>(EnvLong("GATEWAY_LIMIT_MAX", kDefaultLimitMax)),
+        EnvLong("GATEWAY_LIMIT_TOLERANCE_PCT", kDefaultLimitTolerancePct) / 100.0,
+        std::min(EnvLong("GATEWAY_LIMIT_BACKOFF_PCT", kDefaultLimitBackoffPct), 99L) / 100.0,
+        static_cast<size_t>(
+            EnvLong("GATEWAY_LIMIT_MAX_SAMPLE_BYTES", kDefaultLimitMaxSampleBytes))};
+    // Chunked requests are never judged, whatever the sample bound.
+    if (chunk_bytes_ > 0 && (options.max_sample_bytes == 0 ||
+                             options.max_sample_bytes > chunk_bytes_)) {
+      options.max_sample_bytes = chunk_bytes_;
+    }
+    limiter_ = std::make_unique<ConcurrencyLimiter>(options);
+    metrics_.concurrency_limit->AddCallback(ObserveLimit, limiter_.get());
+  }
+  const char *hedge = std::getenv("GATEWAY_HEDGE");
+  if (hedge != nullptr && (std::string_view(hedge) == "idempotent" ||
+                           std::string_view(hedge) == "all")) {
+    hedge_all_ = std::string_view(hedge) == "all";
+    HedgePolicy::Options options{
+        std::min(EnvLong("GATEWAY_HEDGE_PERCENTILE", kDefaultHedgePercentile), 99L) / 100.0,
+        std::chrono::milliseconds(EnvLong("GATEWAY_HEDGE_AFTER_MS", 0)),
+        std::chrono::milliseconds(EnvLong("GATEWAY_HEDGE_MIN_MS", kDefaultHedgeMinMs)),
+        EnvLong("GATEWAY_HEDGE_BUDGET_PCT", kDefaultHedgeBudgetPct) / 100.0};
+    hedge_ = std::make_unique<HedgePolicy>(options);
+    if (const char *hedge_subject = std::getenv("GATEWAY_HEDGE_SUBJECT")) {
+      hedge_subject_ = hedge_subject;
+    }
+  }
+
+  const long pool_size = EnvLong("GATEWAY_NATS_POOL_SIZE", 1);
+  for (long i = 0; i < pool_size; ++i) {
+    auto conn = std::make_unique<Connection>();
+    try {
+      natscpp::connection_options opts;
+      opts.url = url != nullptr ? url : "nats://nats:4222";
+      conn->nc = std::make_unique<natscpp::connection>(opts);
+      // One wildcard reply subscription per connection; replies are routed
+      // to waiting requests by the last token of the reply subject.
+      conn->mux = std::make_unique<ReplyMux>(
+          *conn->nc,
+          static_cast<size_t>(EnvLong("GATEWAY_REPLY_SLOTS", kDefaultReplySlots)),
+          std::chrono::milliseconds(
+              EnvLong("GATEWAY_REPLY_SWEEP_MS", kDefaultReplySweepMs)),
+          chunk_options);
+    } catch (const natscpp::nats_error &e) {
+      std::cerr << "Gateway: connect " << i << " failed: " << e.what() << "\n";
+      continue;
+    }
+    pool_.push_back(std::move(conn));
+  }
+
+  const long reply_workers = EnvLong("GATEWAY_REPLY_WORKERS", kDefaultReplyWorkers);
+  for (long i = 0; i < reply_workers; ++i) {
+    reply_workers_.emplace_back([this] { ReplyWorkLoop(); });
+  }
+
+  const long stats_interval = EnvLong("GATEWAY_STATS_INTERVAL_S", 0);
+  if (stats_interval > 0 && !pool_.empty()) {
+    stats_thread_ = std::thread(
+        [this, stats_interval] { StatsLoop(std::chrono::seconds(stats_interval)); });
+  }
+}
+
+Gateway::~Gateway() {
+  if (limiter_) {
+    metrics_.concurrency_limit->RemoveCallback(ObserveLimit, limiter_.get());
+  }
+  {
+    std::lock_guard<std::mutex> lock(stats_mu_);
+    stopping_ = true;
+  }
+  stats_cv_.notify_all();
+  if (stats_thread_.joinable()) {
+    stats_thread_.join();
+  }
+  {
+    std::lock_guard<std::mutex> lock(reply_work_mu_);
+    reply_work_stopping_ = true;
+  }
+  reply_work_cv_.notify_all();
+  for (auto &worker : reply_workers_) {
+    worker.join();
+  }
+}
+
+void Gateway::Offload(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(reply_work_mu_);
+    if (!reply_work_stopping_) {
+      reply_work_.push_back(std::move(task));
+      reply_work_cv_.notify_one();
+      return;
+    }
+  }
+  // Shutting down: the dispatchers outlive the workers.
+  task();
+}
+
+void Gateway::ReplyWorkLoop() {
+  std::unique_lock<std::mutex> lock(reply_work_mu_);
+  for (;;) {
+    reply_work_cv_.wait(lock, [this] { return reply_work_stopping_ || !reply_work_.empty(); });
+    if (reply_work_.empty()) {
+      return;
+    }
+    std::function<void()> task = std::move(reply_work_.front());
+    reply_work_.pop_front();
+    lock.unlock();
+    task();
+    lock.lock();
+  }
+}
+
+Gateway::Connection &Gateway::Pick(std::string_view key) {
+  const uint64_t n = pick_by_hash_ ? std::hash<std::string_view>{}(key)
+                                   : next_.fetch_add(1, std::memory_order_relaxed);
+  return *pool_[n % pool_.size()];
+}
+
+const std::string &Gateway::Subject(std::string_view key,
+                                    RPCRequest::Priority priority) const {
+  const size_t lane = static_cast<size_t>(priority);
+  const auto &subjects = subjects_[lane < subjects_.size() ? lane : 0];
+  if (subjects.size() == 1) {
+    return subjects.front();
+  }
+  return subjects[std::hash<std::string_view>{}(key) % subjects.size()];
+}
+
+void Gateway::DumpStats(std::ostream &out) const {
+  for (size_t i = 0; i < pool_.size(); ++i) {
+    const Connection &conn = *pool_[i];
+    out << "nats[" << i << "] published="
+        << conn.published.load(std::memory_order_relaxed)
+        << " in_flight=" << conn.mux->in_flight()
+        << " pending_bytes=" << conn.pending_bytes.load(std::memory_order_relaxed)
+        << "\n";
+  }
+  if (cache_) {
+    const ResponseCache::Stats stats = cache_->stats();
+    out << "cache hits=" << stats.hits << " misses=" << stats.misses
+        << " evictions=" << stats.evictions << " entries=" << stats.entries
+        << " bytes=" << stats.bytes << "\n";
+  }
+  if (single_flight_) {
+    out << "single_flight coalesced=" << single_flight_->coalesced() << "\n";
+  }
+  if (limiter_) {
+    out << "limiter limit=" << limiter_->limit()
+        << " in_flight=" << limiter_->in_flight()
+        << " rejected=" << limiter_->rejected() << "\n";
+  }
+  if (hedge_) {
+    out << "hedge hedged=" << hedge_->hedged() << " denied=" << hedge_->denied()
+        << "\n";
+  }
+}
+
+void Gateway::StatsLoop(std::chrono::seconds interval) {
+  std::unique_lock<std::mutex> lock(stats_mu_);
+  while (!stats_cv_.wait_for(lock, interval, [this] { return stopping_; })) {
+    DumpStats(std::cout);
+    std::cout.flush();
+  }
+}
+
+PendingRun::PendingRun(Gateway &gateway, RPCResponse *response)
+    : gateway_(gateway), response_(response) {}
+
+void PendingRun::Start(const grpc::ServerContextBase &ctx,
+                       const RPCRequest &request, const char *span_name) {
+  binary_ = request.body_case() == RPCRequest::kPayloadBytes;
+  priority_ = RequestPriority(ctx, request);
+  Start(ctx, binary_ ? request.payload_bytes() : request.payload(), span_name);
+}
+
+void PendingRun::Start(const grpc::ServerContextBase &ctx,
+                       std::string_view payload, const char *span_name) {
+  // Requests the sampler is bound to drop skip context extraction and
+  // every span; span_ stays null.
+  auto tracer = otel::GetTracer();
+  auto propagator =
+      opentelemetry::context::propagation::GlobalTextMapPropagator::
+          GetGlobalPropagator();
+  std::optional<opentelemetry::trace::Scope> scope;
+  if (otel::MaySample(IncomingTraceparent(ctx))) {
+    GrpcServerCarrier server_carrier(ctx);
+    auto current_ctx = opentelemetry::context::RuntimeContext::GetCurrent();
+    auto parent_ctx = propagator->Extract(server_carrier, current_ctx);
+    opentelemetry::trace::StartSpanOptions span_opts;
+    span_opts.parent = parent_ctx;
+    span_ = tracer->StartSpan(span_name, span_opts);
+    sampled_ = span_->IsRecording();
+    if (sampled_) {
+      scope.emplace(span_);
+    }
+  }
+  if (!sampled_) {
+    traceparent_ = UnsampledTraceparent(span_, IncomingTraceparent(ctx));
+  }
+
+  // A cache hit answers without touching NATS.
+  ResponseCache *cache = gateway_.cache();
+  const CachePolicy policy = cache ? RequestCachePolicy(ctx) : CachePolicy::kBypass;
+  if (policy == CachePolicy::kUse) {
+    std::string cached;
+    if (cache->Lookup(payload, &cached)) {
+      gateway_.metrics().cache_hits->Add(1);
+      FillResponse(std::move(cached));
+      if (span_) {
+        span_->SetAttribute("gateway.cache", "hit");
+        span_->End();
+      }
+      Finish(grpc::Status::OK);
+      return;
+    }
+    gateway_.metrics().cache_misses->Add(1);
+  }
+  if (policy != CachePolicy::kBypass) {
+    cache_payload_.assign(payload);
+    cache_store_ = true;
+  }
+
+  if (!gateway_.ready()) {
+    Fail(grpc::Status(grpc::StatusCode::UNAVAILABLE,
+                      "NATS connection not initialized"),
+         "NATS unavailable");
+    return;
+  }
+
+  // Honour the client's gRPC deadline, capped at kReplyTimeout.
+  const auto remaining = std::min<std::chrono::milliseconds>(
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          ctx.deadline() - std::chrono::system_clock::now()),
+      kReplyTimeout);
+  if (remaining.count() <= 0) {
+    Fail(grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
+                      "deadline expired before publish"),
+         "deadline expired");
+    return;
+  }
+
+  // Reserve a correlation slot BEFORE publishing so a fast reply always
+  // finds its waiter. The deadline is only armed once the request is out:
+  // until then the sweep cannot time the call out (and free it) while the
+  // setup below is still writing to it.
+  const auto deadline = ReplyMux::Clock::now() + remaining;
+  conn_ = &gateway_.Pick(payload);
+  ReplyMux &mux = *conn_->mux;
+  ticket_ = mux.Register(this);
+  if (!ticket_) {
+    Fail(grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED,
+                      "too many requests in flight"),
+         "reply table full");
+    return;
+  }
+  // Locals for use once the call may have been finished (and freed) by its
+  // reply or a timeout.
+  const ReplyMux::Ticket ticket = ticket_;
+  payload_ = payload;
+  deadline_ = deadline;
+  subject_ = &gateway_.Subject(ShardKey(ctx, payload), priority_);
+  hedgeable_ = gateway_.hedge() != nullptr && (gateway_.hedge_all() || Idempotent(ctx));
+
+  // An identical request already in the pipeline answers this one too. Its
+  // reply may complete (and free) this object as soon as it is attached.
+  if (Follow(mux, ticket)) {
+    mux.Arm(ticket, deadline);
+    return;
+  }
+
+  if (!Admit()) {
+    if (mux.Cancel(ticket)) {
+      Fail(grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED,
+                        "gateway concurrency limit reached"),
+           "concurrency limit");
+    }
+    return;
+  }
+
+  const auto hedge_at = Publish();
+  if (!hedge_at) {
+    // If the dispatcher already owns the slot (e.g. it timed out), it
+    // finishes the call instead.
+    if (mux.Cancel(ticket)) {
+      Fail(grpc::Status(grpc::StatusCode::INTERNAL, "publish failed"),
+           "publish failed");
+    }
+    return;
+  }
+  mux.Arm(ticket, deadline, *hedge_at);
+}
+
+bool PendingRun::Follow(ReplyMux &mux, const ReplyMux::Ticket &ticket) {
+  SingleFlight *flights = gateway_.single_flight();
+  if (flights == nullptr) {
+    return false;
+  }
+  // Once joined, the leader may complete (and free) this object.
+  auto &coalesced = *gateway_.metrics().coalesced;
+  if (flights->Join(payload_, {this, &mux, ticket}, &flight_) !=
+      SingleFlight::Role::kFollower) {
+    return false;
+  }
+  coalesced.Add(1);
+  return true;
+}
+
+bool PendingRun::Admit() {
+  // Past the adaptive limit the pipeline is already backed up; fail fast
+  // rather than queue behind requests that will time out. Coalesced and
+  // cached requests put no load on it and are never limited.
+  ConcurrencyLimiter *limiter = gateway_.limiter();
+  if (limiter == nullptr) {
+    return true;
+  }
+  if (!limiter->TryAcquire()) {
+    gateway_.metrics().limited->Add(1);
+    return false;
+  }
+  limited_ = true;
+  return true;
+}
+
+std::optional<ReplyMux::Clock::time_point> PendingRun::Publish() {
+  auto tracer = otel::GetTracer();
+  std::optional<opentelemetry::trace::Scope> scope;
+  if (sampled_) {
+    scope.emplace(span_);
+  }
+
+  // Compressible payloads travel encoded (compression.h); the source
+  // decodes them straight into the payload buffer. The encoded body is kept
+  // with the call, like the payload, for chunks and hedges sent later.
+  const std::string_view payload = payload_;
+  const bool compressed =
+      gateway_.compression() != compression::Codec::kNone &&
+      payload.size() >= gateway_.compress_min_bytes() &&
+      compression::Compress(gateway_.compression(), payload, &encoded_);
+  const std::string_view body = compressed ? std::string_view(encoded_) : payload;
+
+  // Bodies over GATEWAY_CHUNK_BYTES go out in chunks (chunking.h), the rest
+  // of them as the worker credits them (OnCredit).
+  const std::string &subject = *subject_;
+  if (gateway_.chunk_bytes() > 0 && body.size() > gateway_.chunk_bytes()) {
+    chunks_.emplace(body, gateway_.chunk_bytes(), subject);
+  }
+
+  // Set the ticket's reply subject as reply-to so the flow-pipe sink routes
+  // the response back to this request's correlation slot. For a chunked
+  // request it is also the credit inbox, and is repeated in a header for
+  // the sink.
+  auto msg = natscpp::message::create(subject, ticket_.reply_subject,
+                                      chunks_ ? chunks_->first() : body);
+  if (chunks_) {
+    chunks_->Label(msg);
+    msg.set_header(chunking::kReplyHeader, ticket_.reply_subject);
+  }
+
+  // Unsampled requests carry their traceparent, flagged 00, without a
+  // publish span.
+  opentelemetry::nostd::shared_ptr<opentelemetry::trace::Span> pub_span;
+  std::optional<opentelemetry::trace::Scope> pub_scope;
+  if (sampled_) {
+    pub_span = tracer->StartSpan("nats.publish");
+    pub_scope.emplace(pub_span);
+    NatsCarrier carrier(msg);
+    opentelemetry::context::propagation::GlobalTextMapPropagator::
+        GetGlobalPropagator()
+            ->Inject(carrier, opentelemetry::context::RuntimeContext::GetCurrent());
+  } else {
+    msg.set_header("traceparent", traceparent_);
+  }
+
+  const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+      deadline_ - ReplyMux::Clock::now());
+  request_bytes_ = payload.size();
+  pending_bytes_ = static_cast<int64_t>(payload.size());
+  conn_->pending_bytes.fetch_add(pending_bytes_, std::memory_order_relaxed);
+  conn_->published.fetch_add(1, std::memory_order_relaxed);
+  auto &metrics = gateway_.metrics();
+  metrics.in_flight->Add(1);
+  metrics.request_size->Record(payload.size(), opentelemetry::context::Context{});
+  in_flight_ = true;
+  published_at_ = ReplyMux::Clock::now();
+  // A request that may run twice keeps what it published, to duplicate it
+  // if no reply has come by the hedge delay. Chunked bodies are not hedged.
+  auto hedge_at = ReplyMux::Clock::time_point::max();
+  if (hedgeable_ && !chunks_) {
+    HedgePolicy *hedge = gateway_.hedge();
+    hedge->Deposit();
+    const auto delay = hedge->Delay();
+    if (delay && published_at_ + *delay < deadline_) {
+      hedge_ = std::make_unique<Hedge>(
+          Hedge{gateway_.HedgeSubject(subject), body,
+                sampled_ ? msg.header("traceparent") : traceparent_,
+                compressed ? payload.size() : 0, deadline_});
+      hedge_at = published_at_ + *delay;
+    }
+  }
+  try {
+    SetHeaders(msg, remaining, compressed ? payload.size() : 0);
+    conn_->nc->publish(std::move(msg));
+  } catch (const natscpp::nats_error &e) {
+    if (pub_span) {
+      pub_span->End();
+    }
+    return std::nullopt;
+  }
+  // The reply may already have finished the call; touch no members here.
+  if (pub_span) {
+    pub_span->End();
+  }
+  return hedge_at;
+}
+
+void PendingRun::SetHeaders(natscpp::message &msg,
+                            std::chrono::milliseconds remaining,
+                            size_t decoded_length) const {
+  msg.set_header(kDeadlineHeader, std::to_string(remaining.count()));
+  if (decoded_length > 0) {
+    msg.set_header(compression::kEncodingHeader,
+                   compression::Name(gateway_.compression()));
+    msg.set_header(compression::kLengthHeader, std::to_string(decoded_length));
+  }
+  if (!gateway_.accept_encoding().empty()) {
+    msg.set_header(compression::kAcceptHeader, gateway_.accept_encoding());
+  }
+  if (gateway_.hop_timings()) {
+    msg.set_header(kHopsHeader, "pub=" + std::to_string(WallNowNs()));
+  }
+}
+
+void PendingRun::Abandon(grpc::Status status) {
+  if (conn_ != nullptr && conn_->mux->Cancel(ticket_)) {
+    Fail(std::move(status), "cancelled");
+  }
+}
+
+void PendingRun::OnReply(natscpp::message reply) {
+  // Replies come back compressed only if this gateway offered the codec.
+  // Decoding one is left to a reply worker rather than done on the mux
+  // dispatcher, which every other reply on this connection waits behind.
+  if (!gateway_.accept_encoding().empty() &&
+      !reply.header(compression::kEncodingHeader).empty()) {
+    offloaded_.push_back(std::move(reply));
+    gateway_.Offload([this] { CompleteOffloaded(); });
+    return;
+  }
+  CompleteReply(std::move(reply));
+}
+
+void PendingRun::OnChunkedReply(std::vector<natscpp::message> chunks) {
+  // Joining the chunks copies the whole body, so it goes to a reply worker
+  // along with any decoding.
+  offloaded_ = std::move(chunks);
+  gateway_.Offload([this] { CompleteOffloaded(); });
+}
+
+void PendingRun::CompleteOffloaded() {
+  std::vector<natscpp::message> chunks = std::move(offloaded_);
+  if (chunks.size() == 1) {
+    CompleteReply(std::move(chunks.front()));
+    return;
+  }
+  size_t size = 0;
+  for (const auto &chunk : chunks) {
+    size += chunk.data().size();
+  }
+  std::string joined;
+  joined.reserve(size);
+  for (const auto &chunk : chunks) {
+    joined.append(chunk.data());
+  }
+  // The headers travel on chunk 0.
+  CompleteReply(std::move(chunks.front()), std::move(joined));
+}
+
+void PendingRun::CompleteReply(natscpp::message reply,
+                               std::optional<std::string> joined) {
+  // Link the flow-pipe span propagated back by nats_reply_sink so
+  // backends can correlate the pipeline trace with this gateway span.
+  std::string reply_traceparent =
+      sampled_ ? reply.header("traceparent") : std::string();
+  if (!reply_traceparent.empty()) {
+    auto propagator =
+        opentelemetry::context::propagation::GlobalTextMapPropagator::
+            GetGlobalPropagator();
+    ReplyCarrier reply_carrier(reply_traceparent);
+    opentelemetry::context::Context empty_ctx;
+    auto reply_ctx = propagator->Extract(reply_carrier, empty_ctx);
+    auto reply_span_ctx = opentelemetry::trace::GetSpan(reply_ctx)->GetContext();
+    if (reply_span_ctx.IsValid()) {
+      span_->SetAttribute("nats.reply.traceparent", reply_traceparent);
+    }
+  }
+
+  if (gateway_.hop_timings()) {
+    RecordHops(reply.header(kHopsHeader), WallNowNs(),
+               *gateway_.metrics().hop_duration);
+  }
+
+  std::optional<ReplyBody> body;
+  if (!gateway_.accept_encoding().empty()) {
+    const std::string encoding = reply.header(compression::kEncodingHeader);
+    if (!encoding.empty()) {
+      std::string decoded;
+      if (!compression::Decompress(encoding,
+                                   reply.header(compression::kLengthHeader),
+                                   joined ? std::string_view(*joined)
+                                          : reply.data(),
+                                   gateway_.max_reply_bytes(), &decoded)) {
+        Fail(grpc::Status(grpc::StatusCode::INTERNAL,
+                          "undecodable flow-pipe reply"),
+             "reply decode failed");
+        return;
+      }
+      body.emplace(std::move(decoded));
+    }
+  }
+  if (!body && joined) {
+    body.emplace(std::move(*joined));
+  } else if (!body) {
+    body.emplace(std::move(reply));
+  }
+
+  std::string_view data = body->data();
+  LandFlight(data);
+
+  auto &metrics = gateway_.metrics();
+  const auto latency = ReplyMux::Clock::now() - published_at_;
+  metrics.reply_latency->Record(
+      std::chrono::duration<double, std::milli>(latency).count(),
+      opentelemetry::context::Context{});
+  if (limited_) {
+    gateway_.limiter()->OnReply(latency, std::max(request_bytes_, data.size()));
+    limited_ = false;
+  }
+  if (HedgePolicy *hedge = gateway_.hedge()) {
+    hedge->Observe(latency);
+  }
+  metrics.reply_size->Record(data.size(), opentelemetry::context::Context{});
+  if (cache_store_) {
+    if (const size_t evicted = gateway_.cache()->Insert(cache_payload_, data)) {
+      metrics.cache_evictions->Add(evicted);
+    }
+  }
+  AdoptReply(std::move(*body));
+  Release();
+  if (span_) {
+    span_->End();
+  }
+  Finish(grpc::Status::OK);
+}
+
+void PendingRun::OnHedge() {
+  // The duplicate shares this request's reply subject, so its reply lands
+  // in the same correlation slot and only the first one to arrive is kept.
+  std::unique_ptr<Hedge> hedge = std::move(hedge_);
+  if (!hedge) {
+    return;
+  }
+  const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+      hedge->deadline - ReplyMux::Clock::now());
+  if (remaining.count() <= 0 || !gateway_.hedge()->TrySpend()) {
+    return;
+  }
+  try {
+    auto msg = natscpp::message::create(hedge->subject, ticket_.reply_subject,
+                                        hedge->body);
+    if (!hedge->traceparent.empty()) {
+      msg.set_header("traceparent", hedge->traceparent);
+    }
+    SetHeaders(msg, remaining, hedge->decoded_length);
+    conn_->nc->publish(std::move(msg));
+  } catch (const natscpp::nats_error &e) {
+    std::cerr << "Gateway: hedge publish failed: " << e.what() << "\n";
+    return;
+  }
+  gateway_.metrics().hedged->Add(1);
+  if (span_) {
+    span_->AddEvent("gateway.hedge");
+  }
+}
+
+void PendingRun::OnCredit(const natscpp::message &credit) {
+  if (!chunks_) {
+    return;
+  }
+  try {
+    chunks_->OnCredit(*conn_->nc, credit);
+  } catch (const natscpp::nats_error &e) {
+    // The worker stops granting and the request times out.
+    std::cerr << "Gateway: chunk publish failed: " << e.what() << "\n";
+    chunks_.reset();
+  }
+}
+
+void PendingRun::OnTimeout() {
+  gateway_.metrics().timeouts->Add(1);
+  if (limited_) {
+    gateway_.limiter()->OnDrop();
+    limited_ = false;
+  }
+  Fail(grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
+                    "timeout waiting flow-pipe reply"),
+       "timeout waiting reply");
+}
+
+void PendingRun::Release() {
+  if (pending_bytes_ != 0) {
+    conn_->pending_bytes.fetch_sub(pending_bytes_, std::memory_order_relaxed);
+    pending_bytes_ = 0;
+  }
+  if (in_flight_) {
+    gateway_.metrics().in_flight->Add(-1);
+    in_flight_ = false;
+  }
+  if (limited_) {
+    gateway_.limiter()->OnIgnore();
+    limited_ = false;
+  }
+}
+
+void PendingRun::Fail(grpc::Status status, const char *reason) {
+  // A leader's failure (its deadline, its cancellation, the limit it hit)
+  // says nothing about the followers' own calls; they carry on alone, with
+  // the permit this call held already returned.
+  Release();
+  LandFlight(std::nullopt);
+  if (span_) {
+    span_->SetStatus(opentelemetry::trace::StatusCode::kError, reason);
+    span_->End();
+  }
+  Finish(std::move(status));
+}
+
+void PendingRun::AdoptReply(ReplyBody reply) {
+  FillResponse(reply.TakeString());
+}
+
+void PendingRun::FillResponse(std::string payload) {
+  if (binary_) {
+    response_->set_payload_bytes(std::move(payload));
+  } else {
+    response_->set_payload(std::move(payload));
+  }
+  response_->set_status("OK");
+  response_->set_processed_by("transform_stage");
+}
+
+void PendingRun::LandFlight(std::optional<std::string_view> reply) {
+  if (!flight_) {
+    return;
+  }
+  std::shared_ptr<SingleFlight::Flight> flight = std::move(flight_);
+  gateway_.single_flight()->Settle(flight, reply);
+}
+
+void PendingRun::OnOrphaned() {
+  // Runs on the failed leader's thread with this call's slot held, so
+  // neither its own timeout nor a cancellation can finish it meanwhile.
+  ReplyMux &mux = *conn_->mux;
+  const ReplyMux::Ticket ticket = ticket_;
+  // Past its own deadline the sweep times it out once released.
+  if (ReplyMux::Clock::now() >= deadline_ || Follow(mux, ticket)) {
+    mux.Release(ticket);
+    return;
+  }
+  if (!Admit()) {
+    mux.Drop(ticket);
+    Fail(grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED,
+                      "gateway concurrency limit reached"),
+         "concurrency limit");
+    return;
+  }
+  const auto hedge_at = Publish();
+  if (!hedge_at) {
+    mux.Drop(ticket);
+    Fail(grpc::Status(grpc::StatusCode::INTERNAL, "publish failed"),
+         "publish failed");
+    return;
+  }
+  mux.Release(ticket, *hedge_at);
+}
+
+void PendingRun::OnShared(std::string_view reply) {
+  FillResponse(std::string(reply));
+  if (span_) {
+    span_->SetAttribute("gateway.coalesced", true);
+    span_->End();
+  }
+  Finish(grpc::Status::OK);
+}
@@ -0,0 +1,323 @@
+#pragma once
+
+#include "chunking.h"
+#include "compression.h"
+#include "concurrency_limiter.h"
+#include "hedge_policy.h"
+#include "reply_mux.h"
+#include "response_cache.h"
+#include "single_flight.h"
+
+#include "service.grpc.pb.h"
+
+#include <grpcpp/grpcpp.h>
+#include <natscpp/connection.hpp>
+#include <opentelemetry/metrics/meter.h>
+#include <opentelemetry/trace/provider.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// NATS side of the gateway: a pool of connections requests are published on,
+// each with its own reply multiplexer, so gRPC threads do not all serialize
+// on one connection's write lock. Shared by the sync and callback services.
+class Gateway {
+public:
+  // One pooled NATS connection and its counters.
+  struct Connection {
+    std::unique_ptr<natscpp::connection> nc;
+    std::unique_ptr<ReplyMux> mux;
+    std::atomic<uint64_t> published{0};
+    // Request bytes published on this connection still awaiting a reply.
+    std::atomic<int64_t> pending_bytes{0};
+  };
+
+  // Always-on request metrics, exported over OTLP independently of trace
+  // sampling.
+  struct Metrics {
+    Metrics();
+
+    opentelemetry::nostd::unique_ptr<opentelemetry::metrics::UpDownCounter<int64_t>> in_flight;
+    opentelemetry::nostd::unique_ptr<opentelemetry::metrics::Histogram<double>> reply_latency;
+    opentelemetry::nostd::unique_ptr<opentelemetry::metrics::Counter<uint64_t>> timeouts;
+    opentelemetry::nostd::unique_ptr<opentelemetry::metrics::Histogram<uint64_t>> request_size;
+    opentelemetry::nostd::unique_ptr<opentelemetry::metrics::Histogram<uint64_t>> reply_size;
+    // Per-segment time from the reply's hop list, with a "segment" attribute.
+    opentelemetry::nostd::unique_ptr<opentelemetry::metrics::Histogram<double>> hop_duration;
+    opentelemetry::nostd::unique_ptr<opentelemetry::metrics::Counter<uint64_t>> cache_hits;
+    opentelemetry::nostd::unique_ptr<opentelemetry::metrics::Counter<uint64_t>> cache_misses;
+    opentelemetry::nostd::unique_ptr<opentelemetry::metrics::Counter<uint64_t>> cache_evictions;
+    opentelemetry::nostd::unique_ptr<opentelemetry::metrics::Counter<uint64_t>> coalesced;
+    // Observes limiter()->limit(); its callback is registered only when the
+    // gateway has a limiter.
+    opentelemetry::nostd::shared_ptr<opentelemetry::metrics::ObservableInstrument> concurrency_limit;
+    opentelemetry::nostd::unique_ptr<opentelemetry::metrics::Counter<uint64_t>> limited;
+    opentelemetry::nostd::unique_ptr<opentelemetry::metrics::Counter<uint64_t>> hedged;
+  };
+
+  Gateway();
+  ~Gateway();
+
+  Metrics &metrics() { return metrics_; }
+
+  // True when requests carry a flow-hops list for the per-hop breakdown
+  // (GATEWAY_HOP_TIMINGS).
+  bool hop_timings() const { return hop_timings_; }
+
+  // Payloads above this many bytes are sent in chunks; 0 unless
+  // GATEWAY_CHUNK_BYTES is set.
+  size_t chunk_bytes() const { return chunk_bytes_; }
+
+  // Codec for request payloads of at least compress_min_bytes(), and the
+  // accept-encoding value offered for replies; kNone and empty unless
+  // GATEWAY_COMPRESSION names a built-in codec.
+  compression::Codec compression() const { return compression_; }
+  size_t compress_min_bytes() const { return compress_min_bytes_; }
+  const std::string &accept_encoding() const { return accept_encoding_; }
+  // Compressed replies that would decode to more than this are failed
+  // rather than allocated (GATEWAY_MAX_REPLY_BYTES).
+  size_t max_reply_bytes() const { return max_reply_bytes_; }
+  // Most items one RunStream call keeps between reading their request and
+  // writing their response.
+  size_t stream_window() const { return stream_window_; }
+
+  // Reply cache, or null unless GATEWAY_CACHE_BYTES is set.
+  ResponseCache *cache() { return cache_.get(); }
+
+  // In-flight request coalescing, or null unless GATEWAY_SINGLE_FLIGHT is
+  // set.
+  SingleFlight *single_flight() { return single_flight_.get(); }
+
+  // Adaptive in-flight cap, or null unless GATEWAY_CONCURRENCY_LIMIT=aimd.
+  ConcurrencyLimiter *limiter() { return limiter_.get(); }
+
+  // Hedging policy, or null unless GATEWAY_HEDGE is set. hedge_all() is
+  // true when every call may be hedged, not only those marked idempotent.
+  HedgePolicy *hedge() { return hedge_.get(); }
+  bool hedge_all() const { return hedge_all_; }
+
+  // False if no NATS connection could be established.
+  bool ready() const { return !pool_.empty(); }
+
+  // Pins a request to a pooled connection, round-robin or by hash of key
+  // (GATEWAY_NATS_PICK).
+  Connection &Pick(std::string_view key);
+
+  // Subject a request is published on: GATEWAY_SUBJECT, or with
+  // GATEWAY_SHARDS=n one of "<subject>.0" .. "<subject>.<n-1>" chosen by
+  // hash of key, so each key always lands on the same shard. With
+  // GATEWAY_PRIORITY_LANES=1, interactive and bulk requests go to that
+  // subject's ".interactive" / ".bulk" lane.
+  const std::string &Subject(std::string_view key,
+                             flowpipe::rpc::v1::RPCRequest::Priority priority) const;
+  // Subject a hedge of a request published on subject goes to:
+  // GATEWAY_HEDGE_SUBJECT when set, otherwise the same subject, so the
+  // duplicate reaches the workers that own the request's shard and lane.
+  const std::string &HedgeSubject(const std::string &subject) const {
+    return hedge_subject_.empty() ? subject : hedge_subject_;
+  }
+
+  // Runs task on one of GATEWAY_REPLY_WORKERS threads. Reply handling too
+  // heavy for a mux dispatcher (decoding a compressed reply) goes here, so
+  // it does not hold up every other reply on the connection.
+  void Offload(std::function<void()> task);
+
+  void DumpStats(std::ostream &out) const;
+
+private:
+  void StatsLoop(std::chrono::seconds interval);
+  void ReplyWorkLoop();
+
+  Metrics metrics_;
+  bool hop_timings_{false};
+  size_t chunk_bytes_{0};
+  compression::Codec compression_{compression::Codec::kNone};
+  size_t compress_min_bytes_{0};
+  std::string accept_encoding_;
+  size_t max_reply_bytes_{0};
+  size_t stream_window_{0};
+  std::unique_ptr<ResponseCache> cache_;
+  std::unique_ptr<SingleFlight> single_flight_;
+  std::unique_ptr<ConcurrencyLimiter> limiter_;
+  std::unique_ptr<HedgePolicy> hedge_;
+  bool hedge_all_{false};
+  std::string hedge_subject_;
+  std::vector<std::unique_ptr<Connection>> pool_;
+  bool pick_by_hash_{false};
+  // Per priority (RPCRequest::Priority value), per shard.
+  std::array<std::vector<std::string>, 3> subjects_;
+  std::atomic<uint64_t> next_{0};
+
+  std::mutex stats_mu_;
+  std::condition_variable stats_cv_;
+  bool stopping_{false};
+  std::thread stats_thread_;
+
+  std::mutex reply_work_mu_;
+  std::condition_variable reply_work_cv_;
+  std::deque<std::function<void()>> reply_work_;
+  bool reply_work_stopping_{false};
+  std::vector<std::thread> reply_workers_;
+};
+
+// A pipeline reply's body: the NATS message as received, or the body
+// decoded from it, which is kept as is rather than copied into a message.
+class ReplyBody {
+public:
+  explicit ReplyBody(natscpp::message message) : message_(std::move(message)) {}
+  explicit ReplyBody(std::string decoded)
+      : decoded_(std::move(decoded)), is_decoded_(true) {}
+
+  std::string_view data() const {
+    return is_decoded_ ? std::string_view(decoded_) : message_.data();
+  }
+  // The body as a string: moved out when decoded, copied otherwise.
+  std::string TakeString() {
+    return is_decoded_ ? std::move(decoded_) : std::string(message_.data());
+  }
+
+private:
+  natscpp::message message_;
+  std::string decoded_;
+  bool is_decoded_{false};
+};
+
+// One Run call in flight: owns the gateway span, publishes the request to
+// its flow.jobs subject (or shard) and turns the ReplyMux outcome into the
+// RPCResponse. Subclasses decide how the final status reaches gRPC; Finish
+// is invoked exactly once, from Start, a mux dispatcher thread or a reply
+// worker, and is always the last thing PendingRun does with the object.
+class PendingRun : public ReplyHandler, public SingleFlight::Follower {
+public:
+  PendingRun(Gateway &gateway, flowpipe::rpc::v1::RPCResponse *response);
+
+  // Extracts the caller's trace context from ctx and publishes payload,
+  // which must stay valid until the call finishes: chunked and hedged
+  // requests are sent from it after Start returns.
+  void Start(const grpc::ServerContextBase &ctx, std::string_view payload,
+             const char *span_name = "grpc.gateway.Run");
+  // Publishes request's payload, string or bytes, on its priority lane;
+  // the reply uses the same field.
+  void Start(const grpc::ServerContextBase &ctx,
+             const flowpipe::rpc::v1::RPCRequest &request,
+             const char *span_name = "grpc.gateway.Run");
+
+protected:
+  virtual void Finish(grpc::Status status) = 0;
+
+  // Takes the pipeline reply just before Finish(OK). The default moves its
+  // body into the response (copying it out of a NATS message); overrides
+  // can keep the body and serialize from its buffer instead.
+  virtual void AdoptReply(ReplyBody reply);
+
+  bool binary_reply() const { return binary_; }
+
+  // Detaches from the mux and finishes with status unless the reply or
+  // timeout has already been claimed. Used for client cancellation.
+  void Abandon(grpc::Status status);
+
+private:
+  // What a hedge needs to republish the request.
+  struct Hedge {
+    std::string subject;
+    // The payload, or encoded_.
+    std::string_view body;
+    std::string traceparent;
+    // Uncompressed size when body is compressed, else 0.
+    size_t decoded_length;
+    ReplyMux::Clock::time_point deadline;
+  };
+
+  // Joins an identical request's flight; true when this call is now a
+  // follower, whose reply comes from the leader.
+  bool Follow(ReplyMux &mux, const ReplyMux::Ticket &ticket);
+  // Takes a concurrency limiter permit, if the gateway has a limiter.
+  bool Admit();
+  // Publishes the request on ticket_ and returns its hedge time, max() for
+  // none; nullopt if the publish failed. The reply may finish the call as
+  // soon as it is out.
+  std::optional<ReplyMux::Clock::time_point> Publish();
+
+  void OnReply(natscpp::message reply) override;
+  void OnChunkedReply(std::vector<natscpp::message> chunks) override;
+  // Joins the offloaded_ chunks, on a reply worker, and completes with them.
+  void CompleteOffloaded();
+  // Decodes the reply if it is compressed and finishes the call with it.
+  // reply carries the headers; the body is joined when it was chunked.
+  void CompleteReply(natscpp::message reply,
+                     std::optional<std::string> joined = std::nullopt);
+  void OnTimeout() override;
+  // Publishes a duplicate of the request, budget permitting.
+  void OnHedge() override;
+  // Publishes the request chunks the worker has credited.
+  void OnCredit(const natscpp::message &credit) override;
+  void Fail(grpc::Status status, const char *reason);
+  // Headers every published copy of the request carries.
+  void SetHeaders(natscpp::message &msg, std::chrono::milliseconds remaining,
+                  size_t decoded_length) const;
+  // Sets a successful response around payload.
+  void FillResponse(std::string payload);
+
+  // Leader side of single-flight: completes the requests that joined this
+  // one with its reply, or, when it got none, leaves them to run alone.
+  void LandFlight(std::optional<std::string_view> reply);
+  // Follower side, on the leader's thread: the leader's reply, or its
+  // failure, after which this call publishes under its own deadline.
+  void OnShared(std::string_view reply) override;
+  void OnOrphaned() override;
+
+  // Drops this request from its connection's pending bytes and from the
+  // in-flight gauge, and returns any limiter permit unjudged.
+  void Release();
+
+  Gateway &gateway_;
+  flowpipe::rpc::v1::RPCResponse *response_;
+  Gateway::Connection *conn_{nullptr};
+  // The payload Start was given, and where and until when it goes.
+  std::string_view payload_;
+  const std::string *subject_{nullptr};
+  ReplyMux::Clock::time_point deadline_;
+  bool hedgeable_{false};
+  // Request payload to cache the reply under; set only when caching.
+  std::string cache_payload_;
+  bool cache_store_{false};
+  // Set while this request leads a single-flight group.
+  std::shared_ptr<SingleFlight::Flight> flight_;
+  int64_t pending_bytes_{0};
+  bool in_flight_{false};
+  bool binary_{false};
+  flowpipe::rpc::v1::RPCRequest::Priority priority_{
+      flowpipe::rpc::v1::RPCRequest::PRIORITY_UNSPECIFIED};
+  // Holds a ConcurrencyLimiter permit.
+  bool limited_{false};
+  size_t request_bytes_{0};
+  // Set only for hedgeable requests; dropped once the hedge is sent.
+  std::unique_ptr<Hedge> hedge_;
+  // The compressed payload, when the request went out compressed.
+  std::string encoded_;
+  // Set for a chunked request until its last chunk is out.
+  std::optional<chunking::ChunkSender> chunks_;
+  ReplyMux::Clock::time_point published_at_;
+  ReplyMux::Ticket ticket_;
+  // Null when the request was never going to be sampled.
+  opentelemetry::nostd::shared_ptr<opentelemetry::trace::Span> span_;
+  bool sampled_{false};
+  // What an unsampled request publishes as its traceparent.
+  std::string traceparent_;
+  // A reply, or the chunks of one, waiting for a reply worker to join and
+  // decode it.
+  std::vector<natscpp::message> offloaded_;
+};
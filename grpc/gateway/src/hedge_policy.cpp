@@ -0,0 +1,96 @@
+#include "hedge_policy.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+
+HedgePolicy::HedgePolicy(const Options &options)
+    : options_(options),
+      deposit_(std::max<int64_t>(
+          1, std::llround(options.budget_ratio * static_cast<double>(kTokenScale)))) {}
+
+std::optional<HedgePolicy::Clock::duration> HedgePolicy::Delay() const {
+  if (options_.fixed_delay.count() > 0) {
+    return options_.fixed_delay;
+  }
+  if (!known_.load(std::memory_order_acquire)) {
+    return std::nullopt;
+  }
+  return std::max(Clock::duration(delay_.load(std::memory_order_relaxed)),
+                  options_.min_delay);
+}
+
+size_t HedgePolicy::Bucket(Clock::duration latency) {
+  const uint64_t us = static_cast<uint64_t>(std::max<int64_t>(
+      1, std::chrono::duration_cast<std::chrono::microseconds>(latency).count()));
+  const int msb = std::bit_width(us) - 1;
+  // The two bits below the leading one pick the quarter within the doubling.
+  const size_t quarter = msb >= 2 ? (us >> (msb - 2)) & 3 : 0;
+  return std::min<size_t>(static_cast<size_t>(msb) * 4 + quarter, kBuckets - 1);
+}
+
+HedgePolicy::Clock::duration HedgePolicy::BucketLimit(size_t index) {
+  const uint64_t msb = index / 4;
+  const uint64_t quarter = index % 4;
+  return std::chrono::microseconds(std::max<uint64_t>(1, ((5 + quarter) << msb) / 4));
+}
+
+void HedgePolicy::Observe(Clock::duration latency) {
+  counts_[Bucket(latency)].fetch_add(1, std::memory_order_relaxed);
+  observed_.fetch_add(1, std::memory_order_relaxed);
+  if (since_recompute_.fetch_add(1, std::memory_order_relaxed) + 1 >= kRecomputeEvery) {
+    Recompute();
+  }
+}
+
+void HedgePolicy::Recompute() {
+  // One thread recomputes; replies arriving meanwhile just count.
+  std::unique_lock<std::mutex> lock(recompute_mu_, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    return;
+  }
+  since_recompute_.store(0, std::memory_order_relaxed);
+  uint64_t total = 0;
+  std::array<uint32_t, kBuckets> counts;
+  for (size_t i = 0; i < kBuckets; ++i) {
+    counts[i] = counts_[i].load(std::memory_order_relaxed);
+    total += counts[i];
+  }
+  if (total == 0) {
+    return;
+  }
+  const auto target = static_cast<uint64_t>(
+      std::ceil(options_.percentile * static_cast<double>(total)));
+  uint64_t seen = 0;
+  size_t index = 0;
+  for (; index < kBuckets - 1; ++index) {
+    seen += counts[index];
+    if (seen >= target) {
+      break;
+    }
+  }
+  delay_.store(BucketLimit(index).count(), std::memory_order_relaxed);
+  if (observed_.load(std::memory_order_relaxed) >= kMinSamples) {
+    known_.store(true, std::memory_order_release);
+  }
+  // Decay: older replies weigh half as much after every recompute.
+  for (size_t i = 0; i < kBuckets; ++i) {
+    counts_[i].fetch_sub(counts[i] / 2, std::memory_order_relaxed);
+  }
+}
+
+void HedgePolicy::Deposit() {
+  if (tokens_.load(std::memory_order_relaxed) < kMaxTokens) {
+    tokens_.fetch_add(deposit_, std::memory_order_relaxed);
+  }
+}
+
+bool HedgePolicy::TrySpend() {
+  if (tokens_.fetch_sub(kTokenScale, std::memory_order_relaxed) < kTokenScale) {
+    tokens_.fetch_add(kTokenScale, std::memory_order_relaxed);
+    denied_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  hedged_.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
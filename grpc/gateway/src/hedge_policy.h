@@ -0,0 +1,82 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+
+// When to hedge a request: publish a duplicate once it has waited longer
+// than a percentile of recent reply latencies (or a fixed delay), so one
+// stalled worker does not hold the call until its deadline. Duplicates are
+// paid for from a token budget that every hedgeable request tops up by
+// budget_ratio, which caps hedges at that fraction of traffic however slow
+// the pipeline gets.
+//
+// Latencies go into log-scaled buckets (four per doubling). The threshold is
+// recomputed every kRecomputeEvery replies, after which the counts are
+// halved, so it follows the pipeline rather than its whole history.
+class HedgePolicy {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Options {
+    // Quantile of reply latency to hedge after, in (0, 1).
+    double percentile;
+    // Hedge after exactly this long instead; zero to use the percentile.
+    Clock::duration fixed_delay;
+    // Lower bound on the percentile-derived delay.
+    Clock::duration min_delay;
+    // Hedges allowed per hedgeable request.
+    double budget_ratio;
+  };
+
+  explicit HedgePolicy(const Options &options);
+
+  HedgePolicy(const HedgePolicy &) = delete;
+  HedgePolicy &operator=(const HedgePolicy &) = delete;
+
+  // How long after publish to hedge, or nullopt until enough replies have
+  // been seen to know the percentile.
+  std::optional<Clock::duration> Delay() const;
+
+  // Records a reply latency.
+  void Observe(Clock::duration latency);
+
+  // Credits the budget for one hedgeable request.
+  void Deposit();
+  // Takes a token for one duplicate; false when the budget is spent.
+  bool TrySpend();
+
+  uint64_t hedged() const { return hedged_.load(std::memory_order_relaxed); }
+  uint64_t denied() const { return denied_.load(std::memory_order_relaxed); }
+
+private:
+  static constexpr size_t kBuckets = 128;
+  static constexpr uint32_t kRecomputeEvery = 256;
+  static constexpr uint64_t kMinSamples = 100;
+  // Budget in thousandths of a hedge; at most this many hedges can be
+  // banked, so a quiet spell does not license a burst of duplicates.
+  static constexpr int64_t kTokenScale = 1000;
+  static constexpr int64_t kMaxTokens = 100 * kTokenScale;
+
+  static size_t Bucket(Clock::duration latency);
+  // Upper edge of bucket index.
+  static Clock::duration BucketLimit(size_t index);
+  void Recompute();
+
+  Options options_;
+  int64_t deposit_;
+
+  std::array<std::atomic<uint32_t>, kBuckets> counts_{};
+  std::atomic<uint32_t> since_recompute_{0};
+  std::atomic<uint64_t> observed_{0};
+  std::atomic<Clock::rep> delay_{0};
+  std::atomic<bool> known_{false};
+  std::mutex recompute_mu_;
+
+  std::atomic<int64_t> tokens_{0};
+  std::atomic<uint64_t> hedged_{0};
+  std::atomic<uint64_t> denied_{0};
+};
@@ -1,198 +1,350 @@
+#include "gateway.h"
 #include "otel.h"
+#include "streams.h"
 
 #include "service.grpc.pb.h"
 
+#include <google/protobuf/arena.h>
 #include <grpcpp/grpcpp.h>
-#include <natscpp/connection.hpp>
-#include <natscpp/error.hpp>
-#include <opentelemetry/context/propagation/global_propagator.h>
-#include <opentelemetry/trace/context.h>
-#include <opentelemetry/trace/provider.h>
+#include <grpcpp/support/message_allocator.h>
 
-#include <chrono>
 #include <cstdlib>
 #include <iostream>
 #include <memory>
+#include <optional>
+#include <semaphore>
 #include <string>
+#include <thread>
 
+using flowpipe::rpc::v1::RPCBatchRequest;
 using flowpipe::rpc::v1::RPCService;
 using flowpipe::rpc::v1::RPCRequest;
 using flowpipe::rpc::v1::RPCResponse;
 
-class GatewayService final : public RPCService::Service {
+namespace {
+// Parks the calling gRPC thread until the reply (or timeout) arrives.
+class BlockingRun final : public PendingRun {
+public:
+  using PendingRun::PendingRun;
+
+  grpc::Status Wait() {
+    done_.acquire();
+    return status_;
+  }
+
+protected:
+  void Finish(grpc::Status status) override {
+    status_ = std::move(status);
+    done_.release();
+  }
+
+private:
+  std::binary_semaphore done_{0};
+  grpc::Status status_;
+};
+
+// Completes the gRPC call straight from the NATS reply handler, so no
+// thread is held while the request is in the pipeline.
+class ReactorRun final : public PendingRun, public grpc::ServerUnaryReactor {
 public:
-  GatewayService() {
-    const char *url = std::getenv("NATS_URL");
-    try {
-      natscpp::connection_options opts;
-      opts.url = url != nullptr ? url : "nats://nats:4222";
-      nc_ = std::make_unique<natscpp::connection>(opts);
-    } catch (const natscpp::nats_error &e) {
-      std::cerr << "GatewayService: connect failed: " << e.what() << "\n";
+  using PendingRun::PendingRun;
+
+  void OnCancel() override {
+    Abandon(grpc::Status(grpc::StatusCode::CANCELLED, "call cancelled"));
+  }
+  void OnDone() override { delete this; }
+
+protected:
+  void Finish(grpc::Status status) override {
+    grpc::ServerUnaryReactor::Finish(std::move(status));
+  }
+};
+
+// Allocates each callback Run's request and response on one protobuf arena,
+// released in a single free when the call completes.
+class ArenaRunAllocator final
+    : public grpc::MessageAllocator<RPCRequest, RPCResponse> {
+public:
+  grpc::MessageHolder<RPCRequest, RPCResponse> *AllocateMessages() override {
+    return new Holder();
+  }
+
+private:
+  class Holder final : public grpc::MessageHolder<RPCRequest, RPCResponse> {
+  public:
+    Holder() {
+      set_request(google::protobuf::Arena::CreateMessage<RPCRequest>(&arena_));
+      set_response(google::protobuf::Arena::CreateMessage<RPCResponse>(&arena_));
     }
+    void Release() override { delete this; }
+
+  private:
+    google::protobuf::Arena arena_;
+  };
+};
+
+// Appends the tag and length of a length-delimited protobuf field.
+void AppendFieldHeader(std::string &out, uint32_t field, size_t size) {
+  out.push_back(static_cast<char>((field << 3) | 2));
+  while (size >= 0x80) {
+    out.push_back(static_cast<char>((size & 0x7f) | 0x80));
+    size >>= 7;
   }
+  out.push_back(static_cast<char>(size));
+}
 
-  grpc::Status Run(grpc::ServerContext *context, const RPCRequest *request,
-                   RPCResponse *response) override {
-    if (!nc_) {
-      return grpc::Status(grpc::StatusCode::UNAVAILABLE,
-                          "NATS connection not initialized");
+// A successful RPCResponse serialized around the reply body. The body slice
+// points into the NATS message (or the decoded body), which is freed with
+// the slice, so the bytes are copied once, onto the wire, instead of into a
+// std::string and again by the serializer.
+grpc::ByteBuffer ReplyBuffer(ReplyBody reply, bool binary) {
+  const std::string_view data = reply.data();
+  std::string head;
+  AppendFieldHeader(head, binary ? RPCResponse::kPayloadBytesFieldNumber
+                                 : RPCResponse::kPayloadFieldNumber,
+                    data.size());
+  std::string tail;
+  constexpr std::string_view kStatus = "OK";
+  constexpr std::string_view kProcessedBy = "transform_stage";
+  AppendFieldHeader(tail, RPCResponse::kStatusFieldNumber, kStatus.size());
+  tail.append(kStatus);
+  AppendFieldHeader(tail, RPCResponse::kProcessedByFieldNumber, kProcessedBy.size());
+  tail.append(kProcessedBy);
+
+  if (data.empty()) {
+    grpc::Slice slices[] = {grpc::Slice(head), grpc::Slice(tail)};
+    return grpc::ByteBuffer(slices, 2);
+  }
+  auto *owner = new ReplyBody(std::move(reply));
+  const std::string_view owned = owner->data();
+  grpc::Slice slices[] = {
+      grpc::Slice(head),
+      grpc::Slice(const_cast<char *>(owned.data()), owned.size(),
+                  [](void *body) { delete static_cast<ReplyBody *>(body); },
+                  owner),
+      grpc::Slice(tail)};
+  return grpc::ByteBuffer(slices, 3);
+}
+
+// Owns the raw Run's arena; a base so it is built before PendingRun is
+// handed the response living on it.
+struct CallArena {
+  google::protobuf::Arena arena;
+  RPCResponse *response = google::protobuf::Arena::CreateMessage<RPCResponse>(&arena);
+};
+
+// Run over the raw ByteBuffer API. The request is parsed onto a per-call
+// arena and a pipeline reply is written to the wire straight from its NATS
+// buffer. Other outcomes (cache hits, coalesced replies) go through the
+// arena response and the regular serializer.
+class RawRun final : private CallArena,
+                     public PendingRun,
+                     public grpc::ServerUnaryReactor {
+public:
+  RawRun(Gateway &gateway, grpc::ByteBuffer *response)
+      : PendingRun(gateway, CallArena::response), response_buffer_(response) {}
+
+  void Begin(const grpc::CallbackServerContext &ctx,
+             const grpc::ByteBuffer &request) {
+    grpc::ByteBuffer buffer(request);
+    auto *parsed = google::protobuf::Arena::CreateMessage<RPCRequest>(&arena);
+    if (!grpc::SerializationTraits<RPCRequest>::Deserialize(&buffer, parsed).ok()) {
+      grpc::ServerUnaryReactor::Finish(
+          grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "malformed RPCRequest"));
+      return;
     }
+    Start(ctx, *parsed);
+  }
 
-    auto tracer = otel::GetTracer();
-    auto propagator =
-        opentelemetry::context::propagation::GlobalTextMapPropagator::
-            GetGlobalPropagator();
-
-    // Extract incoming trace context from gRPC client metadata so the
-    // gateway span is a child of the client span.
-    class GrpcServerCarrier : public opentelemetry::context::propagation::TextMapCarrier {
-    public:
-      explicit GrpcServerCarrier(grpc::ServerContext *ctx) : ctx_(ctx) {}
-      opentelemetry::nostd::string_view Get(
-          opentelemetry::nostd::string_view key) const noexcept override {
-        auto it = ctx_->client_metadata().find(
-            grpc::string_ref(key.data(), key.size()));
-        if (it != ctx_->client_metadata().end())
-          return {it->second.data(), it->second.size()};
-        return "";
+  void OnCancel() override {
+    Abandon(grpc::Status(grpc::StatusCode::CANCELLED, "call cancelled"));
+  }
+  void OnDone() override { delete this; }
+
+protected:
+  void AdoptReply(ReplyBody reply) override {
+    reply_.emplace(std::move(reply));
+  }
+
+  void Finish(grpc::Status status) override {
+    if (status.ok()) {
+      if (reply_) {
+        *response_buffer_ = ReplyBuffer(std::move(*reply_), binary_reply());
+      } else {
+        bool own_buffer = false;
+        status = grpc::SerializationTraits<RPCResponse>::Serialize(
+            *CallArena::response, response_buffer_, &own_buffer);
       }
-      void Set(opentelemetry::nostd::string_view,
-               opentelemetry::nostd::string_view) noexcept override {}
-    private:
-      grpc::ServerContext *ctx_;
-    } server_carrier(context);
-    auto current_ctx = opentelemetry::context::RuntimeContext::GetCurrent();
-    auto parent_ctx = propagator->Extract(server_carrier, current_ctx);
-    opentelemetry::trace::StartSpanOptions span_opts;
-    span_opts.parent = parent_ctx;
-    auto span = tracer->StartSpan("grpc.gateway.Run", span_opts);
-    auto scope = tracer->WithActiveSpan(span);
-
-    // Generate a unique per-request reply inbox so concurrent requests
-    // don't receive each other's replies.
-    std::string inbox;
-    try {
-      inbox = nc_->new_inbox();
-    } catch (const natscpp::nats_error &e) {
-      span->SetStatus(opentelemetry::trace::StatusCode::kError,
-                      "inbox create failed");
-      span->End();
-      return grpc::Status(grpc::StatusCode::INTERNAL, "inbox create failed");
     }
+    grpc::ServerUnaryReactor::Finish(std::move(status));
+  }
+
+private:
+  grpc::ByteBuffer *response_buffer_;
+  std::optional<ReplyBody> reply_;
+};
+} // namespace
+
+class GatewayService final : public RPCService::Service {
+public:
+  explicit GatewayService(Gateway &gateway) : gateway_(gateway) {}
+
+  grpc::Status Run(grpc::ServerContext *context, const RPCRequest *request,
+                   RPCResponse *response) override {
+    BlockingRun run(gateway_, response);
+    run.Start(*context, *request);
+    return run.Wait();
+  }
+
+  grpc::Status RunStream(
+      grpc::ServerContext *context,
+      grpc::ServerReaderWriter<RPCResponse, RPCRequest> *stream) override {
+    // Reads and writes proceed on separate threads so responses go out as
+    // replies arrive, while more requests are still being read.
+    BlockingTracker tracker(gateway_);
+    std::thread writer([&] { WriteAll(context, tracker, *stream); });
+    RPCRequest request;
+    size_t index = 0;
+    // No read while the call is at its window; the client is held back by
+    // gRPC flow control instead of the gateway queueing without bound.
+    for (tracker.WaitForRoom(); stream->Read(&request); tracker.WaitForRoom()) {
+      tracker.Submit(*context, std::move(request), index++);
+    }
+    tracker.CloseInputs();
+    writer.join();
+    return context->IsCancelled()
+               ? grpc::Status(grpc::StatusCode::CANCELLED, "call cancelled")
+               : grpc::Status::OK;
+  }
 
-    // Subscribe to the unique inbox BEFORE publishing to avoid a race
-    // condition where the reply arrives before we start listening.
-    natscpp::subscription sub;
-    try {
-      sub = nc_->subscribe_sync(inbox);
-    } catch (const natscpp::nats_error &e) {
-      span->SetStatus(opentelemetry::trace::StatusCode::kError,
-                      "subscribe failed");
-      span->End();
-      return grpc::Status(grpc::StatusCode::INTERNAL, "subscribe failed");
+  grpc::Status RunBatch(grpc::ServerContext *context,
+                        const RPCBatchRequest *batch,
+                        grpc::ServerWriter<RPCResponse> *writer) override {
+    BlockingTracker tracker(gateway_);
+    for (int i = 0; i < batch->requests_size(); ++i) {
+      tracker.Submit(*context, batch->requests(i), static_cast<size_t>(i));
     }
+    tracker.CloseInputs();
+    WriteAll(context, tracker, *writer);
+    return context->IsCancelled()
+               ? grpc::Status(grpc::StatusCode::CANCELLED, "call cancelled")
+               : grpc::Status::OK;
+  }
 
-    auto pub_span = tracer->StartSpan("nats.publish");
-    auto pub_scope = tracer->WithActiveSpan(pub_span);
-
-    // Set the inbox as reply-to so the flow-pipe sink routes the response
-    // back to this specific request's inbox.
-    auto msg = natscpp::message::create(
-        "flow.jobs", inbox,
-        std::string_view{request->payload().data(), request->payload().size()});
-
-    class NatsCarrier : public opentelemetry::context::propagation::TextMapCarrier {
-    public:
-      explicit NatsCarrier(natscpp::message &msg) : msg_(msg) {}
-      opentelemetry::nostd::string_view Get(
-          opentelemetry::nostd::string_view) const noexcept override {
-        return "";
+private:
+  // Drains every response of the call; once the client is gone the
+  // remaining items are cancelled and discarded.
+  template <class Writer>
+  static void WriteAll(grpc::ServerContext *context, BlockingTracker &tracker,
+                       Writer &writer) {
+    bool writable = true;
+    while (auto item = tracker.Next()) {
+      if (writable && !writer.Write(item->response())) {
+        writable = false;
       }
-      void Set(opentelemetry::nostd::string_view key,
-               opentelemetry::nostd::string_view value) noexcept override {
-        try {
-          msg_.set_header(std::string_view{key.data(), key.size()},
-                          std::string_view{value.data(), value.size()});
-        } catch (...) {}
+      if (!writable || context->IsCancelled()) {
+        tracker.CancelAll();
       }
-    private:
-      natscpp::message &msg_;
-    } carrier(msg);
-    propagator->Inject(carrier,
-                       opentelemetry::context::RuntimeContext::GetCurrent());
-
-    try {
-      nc_->publish(std::move(msg));
-    } catch (const natscpp::nats_error &e) {
-      pub_span->End();
-      span->SetStatus(opentelemetry::trace::StatusCode::kError,
-                      "publish failed");
-      span->End();
-      return grpc::Status(grpc::StatusCode::INTERNAL, "publish failed");
-    }
-    pub_span->End();
-
-    natscpp::message reply;
-    try {
-      reply = sub.next_message(std::chrono::milliseconds(10000));
-    } catch (const natscpp::nats_error &e) {
-      span->SetStatus(opentelemetry::trace::StatusCode::kError,
-                      "timeout waiting reply");
-      span->End();
-      return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
-                          "timeout waiting flow-pipe reply");
     }
+  }
 
-    // Link the flow-pipe span propagated back by nats_reply_sink so
-    // backends can correlate the pipeline trace with this gateway span.
-    std::string reply_traceparent = reply.header("traceparent");
-    if (!reply_traceparent.empty()) {
-      class ReplyCarrier : public opentelemetry::context::propagation::TextMapCarrier {
-      public:
-        explicit ReplyCarrier(const std::string &tp) : tp_(tp) {}
-        opentelemetry::nostd::string_view Get(
-            opentelemetry::nostd::string_view key) const noexcept override {
-          if (key == "traceparent") return {tp_.data(), tp_.size()};
-          return "";
-        }
-        void Set(opentelemetry::nostd::string_view,
-                 opentelemetry::nostd::string_view) noexcept override {}
-      private:
-        const std::string &tp_;
-      } reply_carrier(reply_traceparent);
-      opentelemetry::context::Context empty_ctx;
-      auto reply_ctx = propagator->Extract(reply_carrier, empty_ctx);
-      auto reply_span_ctx = opentelemetry::trace::GetSpan(reply_ctx)->GetContext();
-      if (reply_span_ctx.IsValid()) {
-        span->SetAttribute("nats.reply.traceparent", reply_traceparent);
-      }
-    }
+  Gateway &gateway_;
+};
 
-    std::string_view data = reply.data();
-    response->set_payload(std::string(data));
-    response->set_status("OK");
-    response->set_processed_by("transform_stage");
+class CallbackGatewayService final : public RPCService::CallbackService {
+public:
+  explicit CallbackGatewayService(Gateway &gateway) : gateway_(gateway) {
+    SetMessageAllocatorFor_Run(&allocator_);
+  }
+
+  grpc::ServerUnaryReactor *Run(grpc::CallbackServerContext *context,
+                                const RPCRequest *request,
+                                RPCResponse *response) override {
+    auto *run = new ReactorRun(gateway_, response);
+    run->Start(*context, *request);
+    return run;
+  }
+
+  grpc::ServerBidiReactor<RPCRequest, RPCResponse> *
+  RunStream(grpc::CallbackServerContext *context) override {
+    return new StreamReactor(gateway_, context);
+  }
+
+  grpc::ServerWriteReactor<RPCResponse> *
+  RunBatch(grpc::CallbackServerContext *context,
+           const RPCBatchRequest *batch) override {
+    return new BatchReactor(gateway_, context, batch);
+  }
+
+private:
+  Gateway &gateway_;
+  ArenaRunAllocator allocator_;
+};
+
+// Callback service whose Run takes and returns raw ByteBuffers, so replies
+// are not copied out of their NATS buffers (GATEWAY_ZERO_COPY).
+class RawCallbackGatewayService final
+    : public RPCService::WithRawCallbackMethod_Run<RPCService::CallbackService> {
+public:
+  explicit RawCallbackGatewayService(Gateway &gateway) : gateway_(gateway) {}
+
+  grpc::ServerUnaryReactor *Run(grpc::CallbackServerContext *context,
+                                const grpc::ByteBuffer *request,
+                                grpc::ByteBuffer *response) override {
+    auto *run = new RawRun(gateway_, response);
+    run->Begin(*context, *request);
+    return run;
+  }
 
-    span->End();
-    return grpc::Status::OK;
+  grpc::ServerBidiReactor<RPCRequest, RPCResponse> *
+  RunStream(grpc::CallbackServerContext *context) override {
+    return new StreamReactor(gateway_, context);
+  }
+
+  grpc::ServerWriteReactor<RPCResponse> *
+  RunBatch(grpc::CallbackServerContext *context,
+           const RPCBatchRequest *batch) override {
+    return new BatchReactor(gateway_, context, batch);
   }
 
 private:
-  std::unique_ptr<natscpp::connection> nc_;
+  Gateway &gateway_;
 };
 
 int main() {
   otel::InitTracer("grpc-gateway");
+  otel::InitMetrics("grpc-gateway");
+
+  // GATEWAY_MODE selects the server flavour so both can be benchmarked on
+  // the same build: "sync" parks a pool thread per request, "callback"
+  // completes calls from the NATS reply handler.
+  const char *mode_env = std::getenv("GATEWAY_MODE");
+  std::string mode = mode_env != nullptr ? mode_env : "sync";
+
+  Gateway gateway;
+  std::unique_ptr<grpc::Service> service;
+  const char *zero_copy = std::getenv("GATEWAY_ZERO_COPY");
+  if (mode == "callback" && zero_copy != nullptr && std::string(zero_copy) == "1") {
+    service = std::make_unique<RawCallbackGatewayService>(gateway);
+  } else if (mode == "callback") {
+    service = std::make_unique<CallbackGatewayService>(gateway);
+  } else if (mode == "sync") {
+    service = std::make_unique<GatewayService>(gateway);
+  } else {
+    std::cerr << "unknown GATEWAY_MODE '" << mode
+              << "' (expected sync or callback)" << std::endl;
+    return 1;
+  }
 
-  GatewayService service;
   grpc::ServerBuilder builder;
   builder.AddListeningPort("0.0.0.0:50051", grpc::InsecureServerCredentials());
-  builder.RegisterService(&service);
+  builder.RegisterService(service.get());
 
   std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
-  std::cout << "grpc-gateway listening on 0.0.0.0:50051" << std::endl;
+  std::cout << "grpc-gateway (" << mode << ") listening on 0.0.0.0:50051"
+            << std::endl;
   server->Wait();
+  otel::ShutdownMetrics();
   otel::ShutdownTracer();
   return 0;
 }
@@ -0,0 +1,325 @@
+#include "reply_mux.h"
+
+#include "chunking.h"
+#include "compression.h"
+
+#include <natscpp/error.hpp>
+
+#include <bit>
+#include <charconv>
+#include <iostream>
+
+void ReplyHandler::OnChunkedReply(std::vector<natscpp::message> chunks) {
+  size_t size = 0;
+  for (const auto &chunk : chunks) {
+    size += chunk.data().size();
+  }
+  std::string body;
+  body.reserve(size);
+  for (const auto &chunk : chunks) {
+    body.append(chunk.data());
+  }
+  const natscpp::message &first = chunks.front();
+  auto whole = natscpp::message::create(first.subject(), "", body);
+  // The headers OnReply reads travel on chunk 0.
+  for (std::string_view name :
+       {std::string_view("traceparent"), std::string_view("flow-hops"),
+        compression::kEncodingHeader, compression::kLengthHeader}) {
+    std::string value = first.header(name);
+    if (!value.empty()) {
+      whole.set_header(name, value);
+    }
+  }
+  OnReply(std::move(whole));
+}
+
+ReplyMux::ReplyMux(natscpp::connection &nc, size_t capacity,
+                   std::chrono::milliseconds sweep_interval,
+                   ChunkOptions chunks)
+    : nc_(nc), chunks_(chunks), prefix_(nc.new_inbox()),
+      sub_(nc.subscribe_sync(prefix_ + ".*")),
+      sweep_interval_(sweep_interval) {
+  const size_t size = std::bit_ceil(capacity < 2 ? size_t{2} : capacity);
+  slots_ = std::make_unique<Slot[]>(size);
+  mask_ = size - 1;
+  dispatcher_ = std::thread([this] { DispatchLoop(); });
+}
+
+ReplyMux::~ReplyMux() {
+  stop_.store(true, std::memory_order_relaxed);
+  if (dispatcher_.joinable()) {
+    dispatcher_.join();
+  }
+  // Nothing can complete the remaining registrations any more; fail them so
+  // blocked callers are released.
+  Sweep(Clock::time_point::max());
+}
+
+ReplyMux::Ticket ReplyMux::Register(ReplyHandler *handler,
+                                    Clock::time_point deadline) {
+  // An id whose slot is still held by an older request is skipped, so a
+  // full table is reported only after every slot has been tried.
+  for (size_t attempt = 0; attempt <= mask_; ++attempt) {
+    const uint64_t id = next_id_.fetch_add(1, std::memory_order_relaxed);
+    Slot &slot = slots_[id & mask_];
+    uint64_t expected = kFree;
+    if (!slot.id.compare_exchange_strong(expected, kBusy,
+                                         std::memory_order_acquire,
+                                         std::memory_order_relaxed)) {
+      continue;
+    }
+    slot.handler = handler;
+    slot.deadline.store(deadline.time_since_epoch().count(),
+                        std::memory_order_relaxed);
+    slot.hedge_at.store(kNever, std::memory_order_relaxed);
+    in_flight_.fetch_add(1, std::memory_order_relaxed);
+    slot.id.store(id, std::memory_order_release);
+    return Ticket{id, prefix_ + "." + std::to_string(id)};
+  }
+  return Ticket{};
+}
+
+bool ReplyMux::Cancel(const Ticket &ticket) {
+  return ticket && Claim(ticket.id) != nullptr;
+}
+
+void ReplyMux::Arm(const Ticket &ticket, Clock::time_point deadline,
+                   Clock::time_point hedge_at) {
+  if (!ticket) {
+    return;
+  }
+  // A credit being handled for this request holds the slot briefly.
+  if (!Hold(ticket.id)) {
+    return;
+  }
+  slots_[ticket.id & mask_].deadline.store(deadline.time_since_epoch().count(),
+                                           std::memory_order_relaxed);
+  Release(ticket, hedge_at);
+}
+
+bool ReplyMux::Hold(const Ticket &ticket) {
+  return ticket && Hold(ticket.id);
+}
+
+void ReplyMux::Release(const Ticket &ticket, Clock::time_point hedge_at) {
+  Slot &slot = slots_[ticket.id & mask_];
+  slot.hedge_at.store(hedge_at.time_since_epoch().count(),
+                      std::memory_order_relaxed);
+  slot.id.store(ticket.id, std::memory_order_release);
+}
+
+void ReplyMux::Drop(const Ticket &ticket) {
+  Slot &slot = slots_[ticket.id & mask_];
+  slot.handler = nullptr;
+  in_flight_.fetch_sub(1, std::memory_order_relaxed);
+  slot.id.store(kFree, std::memory_order_release);
+}
+
+bool ReplyMux::Hold(uint64_t id) {
+  Slot &slot = slots_[id & mask_];
+  uint64_t expected = id;
+  while (!slot.id.compare_exchange_weak(expected, kHeld,
+                                        std::memory_order_acq_rel,
+                                        std::memory_order_relaxed)) {
+    if (expected != id && expected != kHeld) {
+      return false;
+    }
+    if (expected == kHeld) {
+      std::this_thread::yield();
+    }
+    expected = id;
+  }
+  return true;
+}
+
+ReplyHandler *ReplyMux::Claim(uint64_t id) {
+  Slot &slot = slots_[id & mask_];
+  uint64_t expected = id;
+  while (!slot.id.compare_exchange_weak(expected, kBusy,
+                                        std::memory_order_acq_rel,
+                                        std::memory_order_relaxed)) {
+    // A hedge or credit in progress (this request's or, after reuse,
+    // another's) hands the slot back within microseconds.
+    if (expected != id && expected != kHeld) {
+      return nullptr;
+    }
+    if (expected == kHeld) {
+      std::this_thread::yield();
+    }
+    expected = id;
+  }
+  ReplyHandler *handler = slot.handler;
+  slot.handler = nullptr;
+  in_flight_.fetch_sub(1, std::memory_order_relaxed);
+  slot.id.store(kFree, std::memory_order_release);
+  return handler;
+}
+
+bool ReplyMux::Live(uint64_t id) const {
+  return slots_[id & mask_].id.load(std::memory_order_acquire) == id;
+}
+
+bool ReplyMux::Assemble(uint64_t id, natscpp::message msg, uint32_t index,
+                        uint32_t count, std::vector<natscpp::message> *chunks) {
+  // A request that timed out or was cancelled mid-transfer stops granting;
+  // the sender gives up at its deadline.
+  if (!Live(id)) {
+    partials_.erase(id);
+    return false;
+  }
+  Partial *partial = nullptr;
+  if (index == 0) {
+    // A hedged request can draw a chunked reply from two workers. Only the
+    // first is granted credit; the other stalls and gives up at its deadline.
+    if (partials_.count(id) != 0) {
+      return false;
+    }
+    uint64_t total = 0;
+    if (!chunking::ParseSize(msg.header(chunking::kTotalHeader), &total) ||
+        total > chunks_.max_bytes) {
+      std::cerr << "ReplyMux: dropping chunked reply of "
+                << msg.header(chunking::kTotalHeader) << " bytes\n";
+      partials_.erase(id);
+      return false;
+    }
+    partial = &partials_[id];
+    *partial = Partial{};
+    partial->chunks.reserve(count);
+    partial->total = total;
+    partial->count = count;
+    partial->granted = 1;
+  } else {
+    auto it = partials_.find(id);
+    // Chunks of one reply arrive in order on the one subscription; a gap
+    // means the transfer was abandoned.
+    if (it == partials_.end() || index != it->second.chunks.size() ||
+        count != it->second.count) {
+      partials_.erase(id);
+      return false;
+    }
+    partial = &it->second;
+  }
+  // The announced total is what max_bytes was checked against; a sender
+  // that goes past it is dropped rather than trusted.
+  partial->bytes += msg.data().size();
+  if (partial->bytes > partial->total) {
+    std::cerr << "ReplyMux: dropping chunked reply past its announced "
+              << partial->total << " bytes\n";
+    partials_.erase(id);
+    return false;
+  }
+  partial->chunks.push_back(std::move(msg));
+
+  if (partial->chunks.size() == partial->count) {
+    *chunks = std::move(partial->chunks);
+    partials_.erase(id);
+    return true;
+  }
+  const auto received = static_cast<uint32_t>(partial->chunks.size());
+  const uint32_t grant = chunking::NextGrant(received, partial->granted,
+                                             partial->count, chunks_.window);
+  if (grant != partial->granted) {
+    partial->granted = grant;
+    Grant(std::string(partial->chunks.front().reply_to()), grant);
+  }
+  return false;
+}
+
+void ReplyMux::Grant(const std::string &to, uint32_t granted) {
+  try {
+    chunking::SendCredit(nc_, to, granted);
+  } catch (const natscpp::nats_error &e) {
+    std::cerr << "ReplyMux: credit publish failed: " << e.what() << "\n";
+  }
+}
+
+void ReplyMux::Deliver(natscpp::message msg) {
+  std::string_view subject = msg.subject();
+  if (subject.size() <= prefix_.size() + 1) {
+    return;
+  }
+  std::string_view token = subject.substr(prefix_.size() + 1);
+  uint64_t id = 0;
+  auto [end, ec] = std::from_chars(token.data(), token.data() + token.size(), id);
+  if (ec != std::errc{} || end != token.data() + token.size() || Reserved(id)) {
+    return;
+  }
+  // Credit for a chunked request goes to its sender, which stays
+  // registered until the reply.
+  if (!msg.header(chunking::kCreditHeader).empty()) {
+    if (Hold(id)) {
+      Slot &slot = slots_[id & mask_];
+      slot.handler->OnCredit(msg);
+      slot.id.store(id, std::memory_order_release);
+    }
+    return;
+  }
+  uint32_t index = 0;
+  uint32_t count = 0;
+  if (chunking::ParseChunk(msg.header(chunking::kChunkHeader), &index, &count) &&
+      count > 1) {
+    std::vector<natscpp::message> chunks;
+    if (!Assemble(id, std::move(msg), index, count, &chunks)) {
+      return;
+    }
+    if (ReplyHandler *handler = Claim(id)) {
+      handler->OnChunkedReply(std::move(chunks));
+    }
+    return;
+  }
+  // Late or duplicate replies find the slot released (or reused under a
+  // newer id) and are dropped here.
+  if (ReplyHandler *handler = Claim(id)) {
+    handler->OnReply(std::move(msg));
+  }
+}
+
+void ReplyMux::Sweep(Clock::time_point now) {
+  if (in_flight_.load(std::memory_order_relaxed) == 0) {
+    return;
+  }
+  const Clock::rep now_ticks = now.time_since_epoch().count();
+  for (size_t i = 0; i <= mask_; ++i) {
+    Slot &slot = slots_[i];
+    uint64_t id = slot.id.load(std::memory_order_acquire);
+    if (Reserved(id)) {
+      continue;
+    }
+    if (slot.deadline.load(std::memory_order_relaxed) <= now_ticks) {
+      if (ReplyHandler *handler = Claim(id)) {
+        handler->OnTimeout();
+      }
+      continue;
+    }
+    // Holding the slot keeps Cancel, and so the handler's owner, waiting
+    // until OnHedge returns.
+    if (slot.hedge_at.load(std::memory_order_relaxed) <= now_ticks &&
+        slot.id.compare_exchange_strong(id, kHeld, std::memory_order_acq_rel,
+                                        std::memory_order_relaxed)) {
+      slot.hedge_at.store(kNever, std::memory_order_relaxed);
+      slot.handler->OnHedge();
+      slot.id.store(id, std::memory_order_release);
+    }
+  }
+}
+
+void ReplyMux::DispatchLoop() {
+  auto next_sweep = Clock::now() + sweep_interval_;
+  while (!stop_.load(std::memory_order_relaxed)) {
+    try {
+      Deliver(sub_.next_message(sweep_interval_));
+    } catch (const natscpp::nats_error &e) {
+      if (e.status() != NATS_TIMEOUT) {
+        std::cerr << "ReplyMux: receive failed: " << e.what() << "\n";
+        std::this_thread::sleep_for(sweep_interval_);
+      }
+    }
+    const auto now = Clock::now();
+    if (now >= next_sweep) {
+      Sweep(now);
+      std::erase_if(partials_,
+                    [this](const auto &entry) { return !Live(entry.first); });
+      next_sweep = now + sweep_interval_;
+    }
+  }
+}
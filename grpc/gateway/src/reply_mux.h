@@ -0,0 +1,166 @@
+#pragma once
+
+#include <natscpp/connection.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Receives the outcome of a request registered with ReplyMux. Exactly one of
+// OnReply/OnChunkedReply/OnTimeout is invoked, on the mux dispatcher thread, so
+// implementations must hand the result off without blocking.
+class ReplyHandler {
+public:
+  virtual ~ReplyHandler() = default;
+  virtual void OnReply(natscpp::message reply) = 0;
+  virtual void OnTimeout() = 0;
+  // Invoked at most once, on the dispatcher thread, when a registration
+  // armed with a hedge time (ReplyMux::Arm) is still waiting at its hedge time. The
+  // registration stays in place; the handler must not block.
+  virtual void OnHedge() {}
+  // Invoked on the dispatcher thread for each chunk credit (chunking.h)
+  // sent to the registration's reply subject while it is still waiting.
+  // The handler must not block.
+  virtual void OnCredit(const natscpp::message & /*credit*/) {}
+  // Takes the place of OnReply for a chunked reply (chunking.h): its chunks
+  // in order, with the headers on the first. The default joins them into
+  // one message for OnReply; handlers that can should join them off the
+  // dispatcher thread instead.
+  virtual void OnChunkedReply(std::vector<natscpp::message> chunks);
+};
+
+// Routes replies arriving on one long-lived wildcard subscription
+// (`<inbox prefix>.*`) to the requests waiting on them, so a request costs a
+// slot in a lock-free correlation table instead of a SUB/UNSUB round trip.
+//
+// Each registration gets a monotonically increasing id that is both the last
+// token of its reply subject and, masked, the index of its slot. Ownership of
+// a slot moves through CAS on the slot id (free -> busy -> id -> busy -> free),
+// so delivery, timeout and cancellation race safely and the handler runs once.
+class ReplyMux {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Ticket {
+    uint64_t id{0};
+    std::string reply_subject;
+    explicit operator bool() const { return id != 0; }
+  };
+
+  // Chunked replies (chunking.h) are reassembled before the handler sees
+  // them: credit is granted `window` chunks at a time and bodies announced
+  // above max_bytes are dropped, leaving the request to time out.
+  struct ChunkOptions {
+    uint32_t window{8};
+    size_t max_bytes{64u << 20};
+  };
+
+  // Subscribes to a fresh inbox prefix on nc and starts the dispatcher.
+  // capacity is rounded up to a power of two; timeouts are detected with
+  // sweep_interval granularity. Throws natscpp::nats_error on setup failure.
+  ReplyMux(natscpp::connection &nc, size_t capacity,
+           std::chrono::milliseconds sweep_interval,
+           ChunkOptions chunks);
+  ~ReplyMux();
+
+  ReplyMux(const ReplyMux &) = delete;
+  ReplyMux &operator=(const ReplyMux &) = delete;
+
+  // Registers handler until deadline. Returns an empty ticket when the
+  // correlation table is full. A caller with setup left to do after
+  // registering (and before its request is published) registers without a
+  // deadline and sets it with Arm afterwards, so a sweep cannot time the
+  // registration out and free the handler while it is still being set up.
+  Ticket Register(ReplyHandler *handler,
+                  Clock::time_point deadline = Clock::time_point::max());
+
+  // Detaches a pending registration. Returns false if the handler has
+  // already been (or is being) invoked by the dispatcher.
+  bool Cancel(const Ticket &ticket);
+
+  // Sets the registration's deadline and, unless max(), a hedge time at
+  // which the dispatcher calls OnHedge once (sweep_interval granularity) if
+  // the registration is still waiting. A duplicate request published with
+  // the same reply subject shares the slot, so whichever reply arrives first
+  // is delivered and the others are dropped. No-op if the registration has
+  // already completed.
+  void Arm(const Ticket &ticket, Clock::time_point deadline,
+           Clock::time_point hedge_at = Clock::time_point::max());
+
+  // Lets a thread other than the dispatcher work on a waiting registration's
+  // handler: its reply, timeout, hedge and Cancel wait until the holder
+  // calls Release or Drop. Returns false if the registration has already
+  // completed. The holder must not call Arm or Cancel on it meanwhile.
+  bool Hold(const Ticket &ticket);
+  // Ends a Hold; the registration waits again under its deadline, hedged at
+  // hedge_at unless max().
+  void Release(const Ticket &ticket,
+               Clock::time_point hedge_at = Clock::time_point::max());
+  // Ends a Hold by detaching the registration, as Cancel would have; the
+  // holder finishes the handler itself.
+  void Drop(const Ticket &ticket);
+
+  size_t in_flight() const { return in_flight_.load(std::memory_order_relaxed); }
+
+private:
+  static constexpr uint64_t kFree = 0;
+  static constexpr uint64_t kBusy = ~uint64_t{0};
+  // Held by the dispatcher around OnHedge and OnCredit, and by Arm and Hold;
+  // the slot goes back to its id afterwards, so Claim waits instead of failing.
+  static constexpr uint64_t kHeld = kBusy - 1;
+  static constexpr Clock::rep kNever = Clock::duration::max().count();
+
+  struct Slot {
+    std::atomic<uint64_t> id{kFree};
+    std::atomic<Clock::rep> deadline{0};
+    std::atomic<Clock::rep> hedge_at{kNever};
+    ReplyHandler *handler{nullptr};
+  };
+
+  static bool Reserved(uint64_t id) {
+    return id == kFree || id == kBusy || id == kHeld;
+  }
+
+  // A chunked reply being collected; touched by the dispatcher only. The
+  // chunks are kept as received and joined by the handler.
+  struct Partial {
+    std::vector<natscpp::message> chunks;
+    uint64_t total{0};
+    uint64_t bytes{0};
+    uint32_t count{0};
+    uint32_t granted{0};
+  };
+
+  // Moves slot id to kHeld, waiting out another holder; false once the
+  // registration has completed. The holder stores id back.
+  bool Hold(uint64_t id);
+  ReplyHandler *Claim(uint64_t id);
+  bool Live(uint64_t id) const;
+  // Takes one chunk of reply id; returns true with all the chunks in *chunks
+  // once the last one is in.
+  bool Assemble(uint64_t id, natscpp::message msg, uint32_t index,
+                uint32_t count, std::vector<natscpp::message> *chunks);
+  void Grant(const std::string &to, uint32_t granted);
+  void Deliver(natscpp::message msg);
+  void Sweep(Clock::time_point now);
+  void DispatchLoop();
+
+  natscpp::connection &nc_;
+  ChunkOptions chunks_;
+  std::string prefix_;
+  natscpp::subscription sub_;
+  std::unique_ptr<Slot[]> slots_;
+  size_t mask_{0};
+  std::chrono::milliseconds sweep_interval_;
+  std::atomic<uint64_t> next_id_{1};
+  std::atomic<size_t> in_flight_{0};
+  std::unordered_map<uint64_t, Partial> partials_;
+  std::atomic<bool> stop_{false};
+  std::thread dispatcher_;
+};
@@ -0,0 +1,84 @@
+#include "response_cache.h"
+
+#include <bit>
+#include <functional>
+
+ResponseCache::ResponseCache(size_t capacity_bytes,
+                             std::chrono::milliseconds ttl, size_t shards)
+    : ttl_(ttl) {
+  const size_t count = std::bit_ceil(shards < 1 ? size_t{1} : shards);
+  shards_ = std::make_unique<Shard[]>(count);
+  shard_mask_ = count - 1;
+  shard_capacity_ = capacity_bytes / count;
+}
+
+bool ResponseCache::Lookup(std::string_view payload, std::string *reply) {
+  const uint64_t hash = std::hash<std::string_view>{}(payload);
+  Shard &shard = ShardFor(hash);
+  {
+    std::lock_guard<std::mutex> lock(shard.mu);
+    auto found = shard.index.find(hash);
+    if (found != shard.index.end()) {
+      auto it = found->second;
+      if (it->expires_at <= Clock::now()) {
+        EraseLocked(shard, it);
+      } else if (it->payload == payload) {
+        shard.lru.splice(shard.lru.begin(), shard.lru, it);
+        *reply = it->reply;
+        hits_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+    }
+  }
+  misses_.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+size_t ResponseCache::Insert(std::string_view payload, std::string_view reply) {
+  const uint64_t hash = std::hash<std::string_view>{}(payload);
+  Entry entry{hash, std::string(payload), std::string(reply),
+              Clock::now() + ttl_};
+  const size_t charge = entry.charge();
+  if (charge > shard_capacity_) {
+    return 0;
+  }
+
+  Shard &shard = ShardFor(hash);
+  size_t evicted = 0;
+  {
+    std::lock_guard<std::mutex> lock(shard.mu);
+    auto found = shard.index.find(hash);
+    if (found != shard.index.end()) {
+      EraseLocked(shard, found->second);
+    }
+    while (shard.bytes + charge > shard_capacity_ && !shard.lru.empty()) {
+      EraseLocked(shard, std::prev(shard.lru.end()));
+      ++evicted;
+    }
+    shard.lru.push_front(std::move(entry));
+    shard.index.emplace(hash, shard.lru.begin());
+    shard.bytes += charge;
+  }
+  if (evicted > 0) {
+    evictions_.fetch_add(evicted, std::memory_order_relaxed);
+  }
+  return evicted;
+}
+
+ResponseCache::Stats ResponseCache::stats() const {
+  Stats stats{hits_.load(std::memory_order_relaxed),
+              misses_.load(std::memory_order_relaxed),
+              evictions_.load(std::memory_order_relaxed), 0, 0};
+  for (size_t i = 0; i <= shard_mask_; ++i) {
+    std::lock_guard<std::mutex> lock(shards_[i].mu);
+    stats.entries += shards_[i].index.size();
+    stats.bytes += shards_[i].bytes;
+  }
+  return stats;
+}
+
+void ResponseCache::EraseLocked(Shard &shard, std::list<Entry>::iterator it) {
+  shard.bytes -= it->charge();
+  shard.index.erase(it->hash);
+  shard.lru.erase(it);
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Memory-bounded LRU cache of pipeline replies, keyed by the request payload,
+// for callers whose payloads repeat and whose pipeline output is a pure
+// function of them. Entries expire after a fixed TTL.
+//
+// The key space is split across independently locked shards picked by the
+// payload hash, so concurrent requests rarely contend. Each shard evicts its
+// least recently used entries once it exceeds its share of the byte budget.
+// The full payload is kept alongside the reply, so a hash collision is a miss
+// rather than a wrong answer.
+class ResponseCache {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t entries;
+    size_t bytes;
+  };
+
+  // shards is rounded up to a power of two.
+  ResponseCache(size_t capacity_bytes, std::chrono::milliseconds ttl,
+                size_t shards);
+
+  ResponseCache(const ResponseCache &) = delete;
+  ResponseCache &operator=(const ResponseCache &) = delete;
+
+  // Copies the live reply cached for payload into *reply.
+  bool Lookup(std::string_view payload, std::string *reply);
+
+  // Caches reply for payload, replacing any previous entry. Returns the
+  // number of entries evicted to make room.
+  size_t Insert(std::string_view payload, std::string_view reply);
+
+  Stats stats() const;
+
+private:
+  struct Entry {
+    uint64_t hash;
+    std::string payload;
+    std::string reply;
+    Clock::time_point expires_at;
+
+    // Approximate footprint, counted against the byte budget.
+    size_t charge() const { return sizeof(Entry) + payload.size() + reply.size(); }
+  };
+
+  struct Shard {
+    mutable std::mutex mu;
+    std::list<Entry> lru;  // most recently used first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+    size_t bytes{0};
+  };
+
+  Shard &ShardFor(uint64_t hash) { return shards_[(hash >> 32) & shard_mask_]; }
+  static void EraseLocked(Shard &shard, std::list<Entry>::iterator it);
+
+  std::unique_ptr<Shard[]> shards_;
+  size_t shard_mask_{0};
+  size_t shard_capacity_{0};
+  std::chrono::milliseconds ttl_;
+
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> misses_{0};
+  std::atomic<uint64_t> evictions_{0};
+};
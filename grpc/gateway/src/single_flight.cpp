@@ -0,0 +1,56 @@
+#include "single_flight.h"
+
+#include <bit>
+#include <functional>
+
+SingleFlight::SingleFlight(size_t shards) {
+  const size_t count = std::bit_ceil(shards < 1 ? size_t{1} : shards);
+  shards_ = std::make_unique<Shard[]>(count);
+  shard_mask_ = count - 1;
+}
+
+SingleFlight::Role SingleFlight::Join(std::string_view payload,
+                                      const Waiter &waiter,
+                                      std::shared_ptr<Flight> *flight) {
+  const uint64_t hash = std::hash<std::string_view>{}(payload);
+  Shard &shard = ShardFor(hash);
+  std::lock_guard<std::mutex> lock(shard.mu);
+  auto [it, inserted] = shard.flights.try_emplace(hash);
+  if (inserted) {
+    it->second = std::make_shared<Flight>(Flight{hash, std::string(payload), {}});
+    *flight = it->second;
+    return Role::kLeader;
+  }
+  if (it->second->payload != payload) {
+    return Role::kAlone;
+  }
+  it->second->followers.push_back(waiter);
+  coalesced_.fetch_add(1, std::memory_order_relaxed);
+  return Role::kFollower;
+}
+
+std::vector<SingleFlight::Waiter>
+SingleFlight::Land(const std::shared_ptr<Flight> &flight) {
+  Shard &shard = ShardFor(flight->hash);
+  std::lock_guard<std::mutex> lock(shard.mu);
+  auto it = shard.flights.find(flight->hash);
+  if (it != shard.flights.end() && it->second == flight) {
+    shard.flights.erase(it);
+  }
+  return std::move(flight->followers);
+}
+
+void SingleFlight::Settle(const std::shared_ptr<Flight> &flight,
+                          std::optional<std::string_view> reply) {
+  for (const Waiter &waiter : Land(flight)) {
+    // Followers that timed out or were cancelled meanwhile have finished
+    // through their own slot.
+    if (reply) {
+      if (waiter.mux->Cancel(waiter.ticket)) {
+        waiter.follower->OnShared(*reply);
+      }
+    } else if (waiter.mux->Hold(waiter.ticket)) {
+      waiter.follower->OnOrphaned();
+    }
+  }
+}
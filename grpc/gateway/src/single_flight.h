@@ -0,0 +1,85 @@
+#pragma once
+
+#include "reply_mux.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Coalesces identical requests while one of them is in the pipeline. The
+// first request for a payload leads: it publishes and, once its reply is
+// in, hands it to every follower that joined meanwhile. Each follower keeps
+// its own ReplyMux slot, unpublished, so its deadline and cancellation are
+// handled by the mux as usual and the leader only completes followers
+// whose slot it manages to claim. A leader that gets no reply (its shorter
+// deadline passed, it was cancelled or limited) shares nothing: its
+// followers are orphaned and run on their own slots and deadlines.
+class SingleFlight {
+public:
+  class Follower {
+  public:
+    virtual ~Follower() = default;
+    // The leader's reply; the follower's slot has been claimed for it.
+    virtual void OnShared(std::string_view reply) = 0;
+    // The leader got no reply. The follower's slot is held (ReplyMux::Hold)
+    // under its own deadline; the follower joins or leads a new flight, or
+    // publishes alone, and ends the hold with ReplyMux::Release or Drop.
+    virtual void OnOrphaned() = 0;
+  };
+
+  struct Waiter {
+    Follower *follower;
+    ReplyMux *mux;
+    ReplyMux::Ticket ticket;
+  };
+
+  struct Flight {
+    uint64_t hash;
+    std::string payload;
+    std::vector<Waiter> followers;
+  };
+
+  enum class Role { kLeader, kFollower, kAlone };
+
+  explicit SingleFlight(size_t shards);
+
+  SingleFlight(const SingleFlight &) = delete;
+  SingleFlight &operator=(const SingleFlight &) = delete;
+
+  // Joins the flight in progress for payload as a follower, or starts one
+  // led by the caller and returned in *flight. kAlone means a different
+  // payload with the same hash holds the slot; the caller publishes on its
+  // own.
+  Role Join(std::string_view payload, const Waiter &waiter,
+            std::shared_ptr<Flight> *flight);
+
+  // Ends a flight; later identical requests start a new one. Returns the
+  // followers that joined it.
+  std::vector<Waiter> Land(const std::shared_ptr<Flight> &flight);
+
+  // Lands flight and hands reply to each follower still waiting, or, with
+  // no reply, orphans them.
+  void Settle(const std::shared_ptr<Flight> &flight,
+              std::optional<std::string_view> reply);
+
+  uint64_t coalesced() const { return coalesced_.load(std::memory_order_relaxed); }
+
+private:
+  struct Shard {
+    std::mutex mu;
+    std::unordered_map<uint64_t, std::shared_ptr<Flight>> flights;
+  };
+
+  Shard &ShardFor(uint64_t hash) { return shards_[(hash >> 32) & shard_mask_]; }
+
+  std::unique_ptr<Shard[]> shards_;
+  size_t shard_mask_{0};
+  std::atomic<uint64_t> coalesced_{0};
+};
@@ -0,0 +1,143 @@
+#include "streams.h"
+
+#include <utility>
+#include <vector>
+
+using flowpipe::rpc::v1::RPCBatchRequest;
+using flowpipe::rpc::v1::RPCRequest;
+
+StreamItem::StreamItem(Gateway &gateway, ItemTracker &tracker,
+                       std::string correlation_id)
+    : PendingRun(gateway, &response_), tracker_(tracker) {
+  response_.set_correlation_id(std::move(correlation_id));
+}
+
+void StreamItem::Cancel() {
+  Abandon(grpc::Status(grpc::StatusCode::CANCELLED, "call cancelled"));
+}
+
+void StreamItem::Finish(grpc::Status status) {
+  // Per-item failures are reported in-band so the rest of the stream
+  // keeps flowing.
+  if (!status.ok()) {
+    response_.set_code(static_cast<int32_t>(status.error_code()));
+    response_.set_error(status.error_message());
+  }
+  tracker_.Completed(this);
+}
+
+const RPCRequest &StreamItem::Keep(RPCRequest &&request) {
+  request_ = std::move(request);
+  return request_;
+}
+
+std::shared_ptr<StreamItem> ItemTracker::Track(const RPCRequest &request,
+                                               size_t index) {
+  auto item = std::make_shared<StreamItem>(
+      gateway_, *this,
+      request.correlation_id().empty() ? std::to_string(index)
+                                       : request.correlation_id());
+  std::lock_guard<std::mutex> lock(mu_);
+  pending_.emplace(item.get(), item);
+  return item;
+}
+
+void ItemTracker::Submit(const grpc::ServerContextBase &ctx,
+                         const RPCRequest &request, size_t index) {
+  auto item = Track(request, index);
+  // Start may complete the item synchronously, which takes mu_.
+  item->Start(ctx, request, "grpc.gateway.RunStream.item");
+}
+
+void ItemTracker::Submit(const grpc::ServerContextBase &ctx,
+                         RPCRequest &&request, size_t index) {
+  auto item = Track(request, index);
+  item->Start(ctx, item->Keep(std::move(request)), "grpc.gateway.RunStream.item");
+}
+
+void ItemTracker::CancelAll() {
+  std::vector<std::shared_ptr<StreamItem>> items;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    items.reserve(pending_.size());
+    for (auto &entry : pending_) {
+      items.push_back(entry.second);
+    }
+  }
+  for (auto &item : items) {
+    item->Cancel();
+  }
+}
+
+void ItemTracker::Completed(StreamItem *item) {
+  std::lock_guard<std::mutex> lock(mu_);
+  auto it = pending_.find(item);
+  if (it == pending_.end()) {
+    return;
+  }
+  ready_.push_back(std::move(it->second));
+  pending_.erase(it);
+  OnReadyLocked();
+}
+
+std::shared_ptr<StreamItem> BlockingTracker::Next() {
+  std::unique_lock<std::mutex> lock(mu_);
+  cv_.wait(lock, [this] {
+    return !ready_.empty() || (inputs_closed_ && pending_.empty());
+  });
+  if (ready_.empty()) {
+    return nullptr;
+  }
+  auto item = std::move(ready_.front());
+  ready_.pop_front();
+  room_cv_.notify_one();
+  return item;
+}
+
+void BlockingTracker::WaitForRoom() {
+  std::unique_lock<std::mutex> lock(mu_);
+  room_cv_.wait(lock, [this] { return !FullLocked(); });
+}
+
+void BlockingTracker::CloseInputs() {
+  std::lock_guard<std::mutex> lock(mu_);
+  inputs_closed_ = true;
+  cv_.notify_all();
+}
+
+BatchReactor::BatchReactor(Gateway &gateway, grpc::CallbackServerContext *ctx,
+                           const RPCBatchRequest *batch)
+    : ReactorTracker(gateway) {
+  for (int i = 0; i < batch->requests_size(); ++i) {
+    Submit(*ctx, batch->requests(i), static_cast<size_t>(i));
+  }
+  CloseInputs();
+}
+
+StreamReactor::StreamReactor(Gateway &gateway, grpc::CallbackServerContext *ctx)
+    : ReactorTracker(gateway), ctx_(ctx) {
+  StartRead(&request_);
+}
+
+void StreamReactor::OnReadDone(bool ok) {
+  if (!ok) {
+    CloseInputs();
+    return;
+  }
+  Submit(*ctx_, std::move(request_), next_index_++);
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (FullLocked()) {
+      read_paused_ = true;
+      return;
+    }
+  }
+  StartRead(&request_);
+}
+
+void StreamReactor::OnPumpedLocked() {
+  if (read_paused_ && !FullLocked()) {
+    read_paused_ = false;
+    StartRead(&request_);
+  }
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include "gateway.h"
+
+#include "service.grpc.pb.h"
+
+#include <grpcpp/grpcpp.h>
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+class ItemTracker;
+
+// One request of a RunStream/RunBatch call. Owns its response and reports
+// completion to the call's ItemTracker.
+class StreamItem final : public PendingRun {
+public:
+  StreamItem(Gateway &gateway, ItemTracker &tracker,
+             std::string correlation_id);
+
+  flowpipe::rpc::v1::RPCResponse &response() { return response_; }
+  void Cancel();
+
+  // Keeps request with the item and returns it, for callers that reuse
+  // their read buffer before the item finishes (Start's payload must stay
+  // valid until then).
+  const flowpipe::rpc::v1::RPCRequest &
+  Keep(flowpipe::rpc::v1::RPCRequest &&request);
+
+protected:
+  void Finish(grpc::Status status) override;
+
+private:
+  ItemTracker &tracker_;
+  flowpipe::rpc::v1::RPCRequest request_;
+  flowpipe::rpc::v1::RPCResponse response_;
+};
+
+// Pipelines the requests of one streaming call onto flow.jobs and queues the
+// responses in the order their replies arrive.
+class ItemTracker {
+public:
+  virtual ~ItemTracker() = default;
+
+  // Publishes request without waiting for earlier ones to complete. index
+  // is used as the correlation id when the request carries none.
+  void Submit(const grpc::ServerContextBase &ctx,
+              const flowpipe::rpc::v1::RPCRequest &request, size_t index);
+  // As above, for a request read into a buffer the caller reuses.
+  void Submit(const grpc::ServerContextBase &ctx,
+              flowpipe::rpc::v1::RPCRequest &&request, size_t index);
+
+  // Cancels every item still waiting for its reply; each completes with
+  // CANCELLED.
+  void CancelAll();
+
+protected:
+  friend class StreamItem;
+
+  explicit ItemTracker(Gateway &gateway) : gateway_(gateway) {}
+
+  // Creates and tracks the item for request.
+  std::shared_ptr<StreamItem> Track(const flowpipe::rpc::v1::RPCRequest &request,
+                                    size_t index);
+  void Completed(StreamItem *item);
+  // Called with mu_ held after an item joins ready_.
+  virtual void OnReadyLocked() {}
+  // True while the call holds gateway_.stream_window() items, counting
+  // those waiting to be written; it reads no more requests until one goes.
+  bool FullLocked(size_t writing = 0) const {
+    return pending_.size() + ready_.size() + writing >= gateway_.stream_window();
+  }
+
+  Gateway &gateway_;
+  std::mutex mu_;
+  std::unordered_map<StreamItem *, std::shared_ptr<StreamItem>> pending_;
+  std::deque<std::shared_ptr<StreamItem>> ready_;
+};
+
+// Sync-server helper: the handler thread pulls completed responses.
+class BlockingTracker final : public ItemTracker {
+public:
+  explicit BlockingTracker(Gateway &gateway) : ItemTracker(gateway) {}
+
+  // Blocks until a response is ready. Returns nullptr once inputs are
+  // closed and every item has been handed out.
+  std::shared_ptr<StreamItem> Next();
+  // Blocks while the call is at its window of items (FullLocked).
+  void WaitForRoom();
+  void CloseInputs();
+
+protected:
+  void OnReadyLocked() override { cv_.notify_one(); }
+
+private:
+  std::condition_variable cv_;
+  std::condition_variable room_cv_;
+  bool inputs_closed_{false};
+};
+
+// Callback-server helper shared by the RunBatch write reactor and the
+// RunStream bidi reactor: keeps one write in flight and finishes the call
+// once inputs are closed and every response has been written.
+template <class Reactor>
+class ReactorTracker : public ItemTracker, public Reactor {
+public:
+  explicit ReactorTracker(Gateway &gateway) : ItemTracker(gateway) {}
+
+  void OnWriteDone(bool ok) override {
+    std::lock_guard<std::mutex> lock(mu_);
+    writing_.reset();
+    if (!ok) {
+      // The client is gone; keep draining completions without writing.
+      broken_ = true;
+      ready_.clear();
+    }
+    PumpLocked();
+  }
+  void OnCancel() override { CancelAll(); }
+  void OnDone() override { delete this; }
+
+protected:
+  void OnReadyLocked() override { PumpLocked(); }
+  // Called with mu_ held after PumpLocked, which may have made room.
+  virtual void OnPumpedLocked() {}
+
+  bool FullLocked() const { return ItemTracker::FullLocked(writing_ ? 1 : 0); }
+
+  void CloseInputs() {
+    std::lock_guard<std::mutex> lock(mu_);
+    inputs_closed_ = true;
+    PumpLocked();
+  }
+
+private:
+  void PumpLocked() {
+    if (writing_) {
+      return;
+    }
+    if (broken_) {
+      ready_.clear();
+    }
+    if (!ready_.empty()) {
+      writing_ = std::move(ready_.front());
+      ready_.pop_front();
+      this->StartWrite(&writing_->response());
+    } else if (inputs_closed_ && pending_.empty() && !finished_) {
+      finished_ = true;
+      this->Finish(broken_ ? grpc::Status(grpc::StatusCode::CANCELLED,
+                                          "stream write failed")
+                           : grpc::Status::OK);
+    }
+    OnPumpedLocked();
+  }
+
+  std::shared_ptr<StreamItem> writing_;
+  bool inputs_closed_{false};
+  bool broken_{false};
+  bool finished_{false};
+};
+
+class BatchReactor final
+    : public ReactorTracker<grpc::ServerWriteReactor<flowpipe::rpc::v1::RPCResponse>> {
+public:
+  BatchReactor(Gateway &gateway, grpc::CallbackServerContext *ctx,
+               const flowpipe::rpc::v1::RPCBatchRequest *batch);
+};
+
+class StreamReactor final
+    : public ReactorTracker<grpc::ServerBidiReactor<flowpipe::rpc::v1::RPCRequest,
+                                                    flowpipe::rpc::v1::RPCResponse>> {
+public:
+  StreamReactor(Gateway &gateway, grpc::CallbackServerContext *ctx);
+
+  void OnReadDone(bool ok) override;
+
+protected:
+  // Resumes reading once a paused call has room again.
+  void OnPumpedLocked() override;
+
+private:
+  grpc::CallbackServerContext *ctx_;
+  flowpipe::rpc::v1::RPCRequest request_;
+  size_t next_index_{0};
+  // Set while no read is started because the call is full.
+  bool read_paused_{false};
+};
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Log-linear histogram in the style of HdrHistogram. Values below
+// 2^kSubBucketBits are counted exactly; larger values keep kSubBucketBits
+// significant bits, so any reported percentile is within ~0.1% of the true
+// value. Record() is lock-free and safe from any thread.
+class Histogram {
+public:
+  static constexpr int kSubBucketBits = 11;
+
+  // Values above max_value are counted in the last bucket (max() stays
+  // exact).
+  explicit Histogram(uint64_t max_value)
+      : size_(IndexOf(max_value) + 1),
+        counts_(std::make_unique<std::atomic<uint64_t>[]>(size_)) {}
+
+  void Record(uint64_t value) {
+    const size_t index = std::min(IndexOf(value), size_ - 1);
+    counts_[index].fetch_add(1, std::memory_order_relaxed);
+    total_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+    uint64_t seen = max_.load(std::memory_order_relaxed);
+    while (value > seen &&
+           !max_.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+    }
+  }
+
+  uint64_t count() const { return total_.load(std::memory_order_relaxed); }
+  uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+  double mean() const {
+    const uint64_t n = count();
+    return n == 0 ? 0.0
+                  : static_cast<double>(sum_.load(std::memory_order_relaxed)) /
+                        static_cast<double>(n);
+  }
+
+  // Highest value equivalent to the sample at percentile (0-100].
+  uint64_t ValueAtPercentile(double percentile) const {
+    const uint64_t n = count();
+    if (n == 0) {
+      return 0;
+    }
+    const double clamped = std::clamp(percentile, 0.0, 100.0);
+    const auto rank = std::max<uint64_t>(
+        1, static_cast<uint64_t>(clamped / 100.0 * static_cast<double>(n) + 0.5));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < size_; ++i) {
+      seen += counts_[i].load(std::memory_order_relaxed);
+      if (seen >= rank) {
+        return std::min(LowestOf(i + 1) - 1, max());
+      }
+    }
+    return max();
+  }
+
+private:
+  static constexpr uint64_t kSubBuckets = uint64_t{1} << kSubBucketBits;
+  static constexpr uint64_t kHalf = kSubBuckets / 2;
+
+  static size_t IndexOf(uint64_t value) {
+    if (value < kSubBuckets) {
+      return static_cast<size_t>(value);
+    }
+    const int shift = std::bit_width(value) - kSubBucketBits;
+    return static_cast<size_t>(shift) * kHalf + (value >> shift);
+  }
+
+  static uint64_t LowestOf(size_t index) {
+    if (index < kSubBuckets) {
+      return index;
+    }
+    const uint64_t shift = index / kHalf - 1;
+    return (index - shift * kHalf) << shift;
+  }
+
+  const size_t size_;
+  std::unique_ptr<std::atomic<uint64_t>[]> counts_;
+  std::atomic<uint64_t> total_{0};
+  std::atomic<uint64_t> sum_{0};
+  std::atomic<uint64_t> max_{0};
+};
@@ -0,0 +1,405 @@
+#include "histogram.h"
+
+#include "service.grpc.pb.h"
+
+#include <grpcpp/grpcpp.h>
+
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using flowpipe::rpc::v1::RPCRequest;
+using flowpipe::rpc::v1::RPCResponse;
+using flowpipe::rpc::v1::RPCService;
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+// Latencies are recorded in microseconds; anything beyond an hour is
+// clamped into the top bucket.
+constexpr uint64_t kMaxLatencyUs = 3'600'000'000ULL;
+constexpr int kStatusCodes = 17;
+
+long EnvLong(const char *name, long fallback) {
+  const char *value = std::getenv(name);
+  if (value == nullptr || *value == '\0') {
+    return fallback;
+  }
+  char *end = nullptr;
+  long parsed = std::strtol(value, &end, 10);
+  return (end != nullptr && *end == '\0' && parsed >= 0) ? parsed : fallback;
+}
+
+std::string EnvString(const char *name, const char *fallback) {
+  const char *value = std::getenv(name);
+  return (value != nullptr && *value != '\0') ? value : fallback;
+}
+
+bool ParseSize(std::string_view text, size_t *out) {
+  auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), *out);
+  return ec == std::errc{} && end == text.data() + text.size();
+}
+
+// Payload size distribution: "fixed:N", "uniform:MIN:MAX" or
+// "choice:A,B,C" (each size equally likely).
+class PayloadSizes {
+public:
+  bool Parse(const std::string &spec) {
+    spec_ = spec;
+    const auto colon = spec.find(':');
+    if (colon == std::string::npos) {
+      return false;
+    }
+    const std::string_view kind(spec.data(), colon);
+    const std::string_view args(spec.data() + colon + 1, spec.size() - colon - 1);
+    if (kind == "fixed") {
+      size_t n = 0;
+      if (!ParseSize(args, &n)) {
+        return false;
+      }
+      min_ = max_ = n;
+      return true;
+    }
+    if (kind == "uniform") {
+      const auto sep = args.find(':');
+      return sep != std::string_view::npos && ParseSize(args.substr(0, sep), &min_) &&
+             ParseSize(args.substr(sep + 1), &max_) && min_ <= max_;
+    }
+    if (kind == "choice") {
+      std::string_view rest = args;
+      while (!rest.empty()) {
+        const auto comma = rest.find(',');
+        size_t n = 0;
+        if (!ParseSize(rest.substr(0, comma), &n)) {
+          return false;
+        }
+        choices_.push_back(n);
+        rest = comma == std::string_view::npos ? std::string_view() : rest.substr(comma + 1);
+      }
+      if (choices_.empty()) {
+        return false;
+      }
+      min_ = *std::min_element(choices_.begin(), choices_.end());
+      max_ = *std::max_element(choices_.begin(), choices_.end());
+      return true;
+    }
+    return false;
+  }
+
+  size_t Next(std::mt19937_64 &rng) const {
+    if (!choices_.empty()) {
+      return choices_[std::uniform_int_distribution<size_t>(0, choices_.size() - 1)(rng)];
+    }
+    return min_ == max_ ? min_ : std::uniform_int_distribution<size_t>(min_, max_)(rng);
+  }
+
+  size_t max() const { return max_; }
+  const std::string &spec() const { return spec_; }
+
+private:
+  std::string spec_;
+  size_t min_{0};
+  size_t max_{0};
+  std::vector<size_t> choices_;
+};
+
+struct Options {
+  std::string target;
+  bool open_loop{false};
+  long concurrency{16};
+  long rate{1000};
+  long max_in_flight{10000};
+  long duration_s{30};
+  long warmup_s{5};
+  long channels{1};
+  long timeout_ms{10000};
+  bool json{false};
+  // Send payload_bytes instead of the string payload field.
+  bool binary{false};
+  RPCRequest::Priority priority{RPCRequest::PRIORITY_UNSPECIFIED};
+  // Mark calls `flow-idempotent`, making them eligible for gateway hedging.
+  bool idempotent{false};
+  PayloadSizes payload;
+};
+
+// Drives Run calls through the gRPC callback API, so one process can keep
+// thousands of calls outstanding without a thread per call.
+//
+// Closed loop: `concurrency` calls are kept in flight; each completion
+// issues the next one, and latency is measured from the actual send.
+// Open loop: calls are scheduled at a constant rate regardless of
+// completions, and latency is measured from the scheduled send time so a
+// stalled server shows up as queueing delay instead of a lower send rate
+// (no coordinated omission). Calls whose scheduled time falls in the warmup
+// are sent but not recorded.
+class LoadGenerator {
+public:
+  explicit LoadGenerator(const Options &options)
+      : options_(options), latency_us_(kMaxLatencyUs),
+        body_(std::max<size_t>(options.payload.max(), 1), 'x') {
+    for (size_t i = 0; i < body_.size(); ++i) {
+      body_[i] = static_cast<char>('a' + i % 26);
+    }
+    for (long i = 0; i < std::max<long>(options.channels, 1); ++i) {
+      // Distinct channel args keep gRPC from sharing one subchannel.
+      grpc::ChannelArguments args;
+      args.SetInt("loadgen.channel", static_cast<int>(i));
+      stubs_.push_back(RPCService::NewStub(grpc::CreateCustomChannel(
+          options.target, grpc::InsecureChannelCredentials(), args)));
+    }
+  }
+
+  void Run() {
+    start_ = Clock::now();
+    measure_from_ = start_ + std::chrono::seconds(options_.warmup_s);
+    end_ = measure_from_ + std::chrono::seconds(options_.duration_s);
+    if (options_.open_loop) {
+      RunOpen();
+    } else {
+      for (long i = 0; i < options_.concurrency; ++i) {
+        Issue(Clock::now());
+      }
+    }
+    std::unique_lock<std::mutex> lock(mu_);
+    idle_cv_.wait(lock, [this] {
+      return Clock::now() >= end_ && outstanding_.load() == 0;
+    });
+  }
+
+  void Report(std::ostream &out) const {
+    const double seconds = static_cast<double>(options_.duration_s);
+    const uint64_t ok = ok_.load();
+    const uint64_t errors = errors_.load();
+    const auto ms = [this](double percentile) {
+      return static_cast<double>(latency_us_.ValueAtPercentile(percentile)) / 1000.0;
+    };
+    std::array<std::pair<const char *, double>, 6> latencies = {{
+        {"p50", ms(50.0)},
+        {"p90", ms(90.0)},
+        {"p99", ms(99.0)},
+        {"p99.9", ms(99.9)},
+        {"max", static_cast<double>(latency_us_.max()) / 1000.0},
+        {"mean", latency_us_.mean() / 1000.0},
+    }};
+
+    char buf[64];
+    const auto fmt = [&buf](double value) {
+      std::snprintf(buf, sizeof(buf), "%.3f", value);
+      return std::string(buf);
+    };
+
+    if (options_.json) {
+      out << "{\"mode\":\"" << (options_.open_loop ? "open" : "closed") << "\""
+          << ",\"concurrency\":" << options_.concurrency
+          << ",\"rate\":" << (options_.open_loop ? options_.rate : 0)
+          << ",\"duration_s\":" << options_.duration_s
+          << ",\"warmup_s\":" << options_.warmup_s
+          << ",\"payload\":\"" << options_.payload.spec() << "\""
+          << ",\"requests\":" << ok + errors << ",\"ok\":" << ok
+          << ",\"errors\":" << errors << ",\"skipped\":" << skipped_.load()
+          << ",\"throughput_rps\":" << fmt(static_cast<double>(ok) / seconds)
+          << ",\"latency_ms\":{";
+      for (size_t i = 0; i < latencies.size(); ++i) {
+        out << (i ? "," : "") << "\"" << latencies[i].first
+            << "\":" << fmt(latencies[i].second);
+      }
+      out << "},\"status\":{";
+      bool first = true;
+      for (int code = 0; code < kStatusCodes; ++code) {
+        if (const uint64_t n = status_counts_[code].load()) {
+          out << (first ? "" : ",") << "\"" << code << "\":" << n;
+          first = false;
+        }
+      }
+      out << "}}" << std::endl;
+      return;
+    }
+
+    out << "mode=" << (options_.open_loop ? "open" : "closed");
+    if (options_.open_loop) {
+      out << " rate=" << options_.rate << "/s";
+    } else {
+      out << " concurrency=" << options_.concurrency;
+    }
+    out << " duration=" << options_.duration_s << "s warmup=" << options_.warmup_s
+        << "s payload=" << options_.payload.spec() << "\n"
+        << "requests=" << ok + errors << " ok=" << ok << " errors=" << errors
+        << " skipped=" << skipped_.load()
+        << " throughput=" << fmt(static_cast<double>(ok) / seconds) << " req/s\n"
+        << "latency_ms";
+    for (const auto &[name, value] : latencies) {
+      out << " " << name << "=" << fmt(value);
+    }
+    out << "\n";
+    for (int code = 1; code < kStatusCodes; ++code) {
+      if (const uint64_t n = status_counts_[code].load()) {
+        out << "status " << code << ": " << n << "\n";
+      }
+    }
+    out.flush();
+  }
+
+private:
+  struct Call {
+    grpc::ClientContext context;
+    RPCRequest request;
+    RPCResponse response;
+    Clock::time_point intended;
+  };
+
+  void RunOpen() {
+    const auto period = std::chrono::nanoseconds(1'000'000'000 / std::max<long>(options_.rate, 1));
+    auto next = start_;
+    while (next < end_) {
+      std::this_thread::sleep_until(next);
+      if (outstanding_.load(std::memory_order_relaxed) >= options_.max_in_flight) {
+        // The client itself is saturated; report it rather than silently
+        // sending fewer requests.
+        if (next >= measure_from_) {
+          skipped_.fetch_add(1, std::memory_order_relaxed);
+        }
+      } else {
+        Issue(next);
+      }
+      next += period;
+    }
+    // The loop stops up to a period before end_. Calls that all complete
+    // before end_ notify a Run() wait that cannot be satisfied yet, so
+    // return only once end_ has passed.
+    std::this_thread::sleep_until(end_);
+  }
+
+  void Issue(Clock::time_point intended) {
+    thread_local std::mt19937_64 rng{std::random_device{}()};
+    auto *call = new Call;
+    call->intended = intended;
+    if (options_.binary) {
+      call->request.set_payload_bytes(body_.data(), options_.payload.Next(rng));
+    } else {
+      call->request.set_payload(body_.data(), options_.payload.Next(rng));
+    }
+    call->request.set_priority(options_.priority);
+    if (options_.idempotent) {
+      call->context.AddMetadata("flow-idempotent", "true");
+    }
+    call->context.set_deadline(std::chrono::system_clock::now() +
+                               std::chrono::milliseconds(options_.timeout_ms));
+    auto &stub = stubs_[next_stub_.fetch_add(1, std::memory_order_relaxed) % stubs_.size()];
+    outstanding_.fetch_add(1, std::memory_order_relaxed);
+    stub->async()->Run(&call->context, &call->request, &call->response,
+                       [this, call](grpc::Status status) {
+                         Complete(call, status);
+                       });
+  }
+
+  void Complete(Call *call, const grpc::Status &status) {
+    const auto now = Clock::now();
+    if (call->intended >= measure_from_ && call->intended < end_) {
+      status_counts_[static_cast<int>(status.error_code()) % kStatusCodes].fetch_add(1);
+      if (status.ok()) {
+        ok_.fetch_add(1, std::memory_order_relaxed);
+        latency_us_.Record(static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(now - call->intended)
+                .count()));
+      } else {
+        errors_.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+    delete call;
+
+    if (!options_.open_loop && now < end_) {
+      Issue(now);
+    }
+    if (outstanding_.fetch_sub(1) == 1) {
+      std::lock_guard<std::mutex> lock(mu_);
+      idle_cv_.notify_all();
+    }
+  }
+
+  const Options &options_;
+  std::vector<std::unique_ptr<RPCService::Stub>> stubs_;
+  std::atomic<size_t> next_stub_{0};
+  Histogram latency_us_;
+  std::string body_;
+
+  Clock::time_point start_;
+  Clock::time_point measure_from_;
+  Clock::time_point end_;
+
+  std::atomic<long> outstanding_{0};
+  std::atomic<uint64_t> ok_{0};
+  std::atomic<uint64_t> errors_{0};
+  std::atomic<uint64_t> skipped_{0};
+  std::array<std::atomic<uint64_t>, kStatusCodes> status_counts_{};
+
+  std::mutex mu_;
+  std::condition_variable idle_cv_;
+};
+} // namespace
+
+int main() {
+  Options options;
+  options.target = EnvString("GRPC_SERVER", "localhost:50051");
+  const std::string mode = EnvString("LOADGEN_MODE", "closed");
+  if (mode != "closed" && mode != "open") {
+    std::cerr << "unknown LOADGEN_MODE '" << mode << "' (expected closed or open)"
+              << std::endl;
+    return 1;
+  }
+  options.open_loop = mode == "open";
+  options.concurrency = std::max<long>(EnvLong("LOADGEN_CONCURRENCY", 16), 1);
+  options.rate = std::max<long>(EnvLong("LOADGEN_RATE", 1000), 1);
+  options.max_in_flight = std::max<long>(EnvLong("LOADGEN_MAX_IN_FLIGHT", 10000), 1);
+  options.duration_s = std::max<long>(EnvLong("LOADGEN_DURATION_S", 30), 1);
+  options.warmup_s = EnvLong("LOADGEN_WARMUP_S", 5);
+  options.channels = std::max<long>(EnvLong("LOADGEN_CHANNELS", 1), 1);
+  options.timeout_ms = std::max<long>(EnvLong("LOADGEN_TIMEOUT_MS", 10000), 1);
+  const std::string output = EnvString("LOADGEN_OUTPUT", "text");
+  if (output != "text" && output != "json") {
+    std::cerr << "unknown LOADGEN_OUTPUT '" << output << "' (expected text or json)"
+              << std::endl;
+    return 1;
+  }
+  options.json = output == "json";
+  options.binary = EnvLong("LOADGEN_BINARY", 0) > 0;
+  options.idempotent = EnvLong("LOADGEN_IDEMPOTENT", 0) > 0;
+  const std::string priority = EnvString("LOADGEN_PRIORITY", "");
+  if (priority == "interactive") {
+    options.priority = RPCRequest::PRIORITY_INTERACTIVE;
+  } else if (priority == "bulk") {
+    options.priority = RPCRequest::PRIORITY_BULK;
+  } else if (!priority.empty()) {
+    std::cerr << "unknown LOADGEN_PRIORITY '" << priority << "' (expected interactive or bulk)"
+              << std::endl;
+    return 1;
+  }
+  const std::string payload = EnvString("LOADGEN_PAYLOAD", "fixed:64");
+  if (!options.payload.Parse(payload)) {
+    std::cerr << "invalid LOADGEN_PAYLOAD '" << payload
+              << "' (expected fixed:N, uniform:MIN:MAX or choice:A,B,...)" << std::endl;
+    return 1;
+  }
+
+  if (!options.json) {
+    std::cerr << "grpc-loadgen: " << mode << " loop against " << options.target
+              << " for " << options.warmup_s << "s warmup + " << options.duration_s
+              << "s" << std::endl;
+  }
+  LoadGenerator generator(options);
+  generator.Run();
+  generator.Report(std::cout);
+  return 0;
+}
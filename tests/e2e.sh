@@ -24,4 +24,9 @@ if [[ "$client_output" != *"processed_by=transform_stage"* ]]; then
   exit 1
 fi
 
+if [[ "$client_output" != *"stream_ok=3/3"* ]]; then
+  echo "E2E assertion failed: grpc-client RunStream did not get 3 OK responses" >&2
+  exit 1
+fi
+
 echo "E2E smoke test passed"
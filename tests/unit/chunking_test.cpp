@@ -0,0 +1,152 @@
+#include "chunking.h"
+#include "reply_mux.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+namespace {
+
+std::string Body(size_t size) {
+  std::string body(size, '\0');
+  for (size_t i = 0; i < size; ++i) {
+    body[i] = static_cast<char>('a' + i % 26);
+  }
+  return body;
+}
+
+TEST(ChunkingTest, ParsesChunkHeader) {
+  uint32_t index = 0;
+  uint32_t count = 0;
+  ASSERT_TRUE(chunking::ParseChunk("2/5", &index, &count));
+  EXPECT_EQ(index, 2u);
+  EXPECT_EQ(count, 5u);
+  EXPECT_FALSE(chunking::ParseChunk("", &index, &count));
+  EXPECT_FALSE(chunking::ParseChunk("5/5", &index, &count));
+  EXPECT_FALSE(chunking::ParseChunk("1/x", &index, &count));
+  EXPECT_FALSE(chunking::ParseChunk("1/2/3", &index, &count));
+}
+
+TEST(ChunkingTest, GrantsAnotherWindowAtHalf) {
+  // Window 4 granted up to 5: nothing new until at most two are pending.
+  EXPECT_EQ(chunking::NextGrant(2, 5, 20, 4), 5u);
+  EXPECT_EQ(chunking::NextGrant(3, 5, 20, 4), 7u);
+  EXPECT_EQ(chunking::NextGrant(18, 20, 20, 4), 20u);
+  EXPECT_EQ(chunking::NextGrant(17, 19, 20, 4), 20u);
+}
+
+TEST(ChunkingTest, SenderSplitsEvenlyAndWaitsForCredit) {
+  natscpp::connection nc{natscpp::connection_options{}};
+  auto sink = nc.subscribe_sync("chunks.even");
+  const std::string body = Body(2500);
+  chunking::ChunkSender sender(body, 1000, "chunks.even");
+  EXPECT_EQ(sender.count(), 3u);
+  EXPECT_EQ(sender.first(), body.substr(0, 1000));
+
+  auto credit = natscpp::message::create("unused", "", "");
+  credit.set_header(chunking::kCreditHeader, "2");
+  EXPECT_FALSE(sender.OnCredit(nc, credit));
+  auto chunk = sink.next_message(1s);
+  EXPECT_EQ(chunk.header(chunking::kChunkHeader), "1/3");
+  EXPECT_EQ(chunk.data(), body.substr(1000, 1000));
+  EXPECT_THROW(sink.next_message(10ms), natscpp::nats_error);
+
+  credit.set_header(chunking::kCreditHeader, "3");
+  EXPECT_TRUE(sender.OnCredit(nc, credit));
+  EXPECT_EQ(sink.next_message(1s).data(), body.substr(2000));
+}
+
+class BodyHandler : public ReplyHandler {
+public:
+  void OnReply(natscpp::message reply) override {
+    std::lock_guard<std::mutex> lock(mu_);
+    body_ = std::string(reply.data());
+    done_ = true;
+    cv_.notify_all();
+  }
+  void OnTimeout() override {
+    std::lock_guard<std::mutex> lock(mu_);
+    done_ = true;
+    cv_.notify_all();
+  }
+  std::string Wait() {
+    std::unique_lock<std::mutex> lock(mu_);
+    cv_.wait_for(lock, 2s, [this] { return done_; });
+    return body_;
+  }
+
+private:
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::string body_;
+  bool done_{false};
+};
+
+// A body sent by a blocking sender (the sink's side) is reassembled by the
+// gateway's ReplyMux under its flow control.
+TEST(ChunkingTest, RoundTripsThroughReplyMux) {
+  natscpp::connection nc{natscpp::connection_options{}};
+  BodyHandler handler;
+  ReplyMux mux(nc, 8, 5ms, ReplyMux::ChunkOptions{3, 1 << 20});
+  auto ticket = mux.Register(&handler, ReplyMux::Clock::now() + 2s);
+
+  const std::string body = Body(100000);
+  chunking::ChunkSender sender(body, 4096, ticket.reply_subject);
+  const std::string inbox = nc.new_inbox();
+  auto credits = nc.subscribe_sync(inbox);
+  auto first = natscpp::message::create(ticket.reply_subject, inbox, sender.first());
+  sender.Label(first);
+  nc.publish(std::move(first));
+  EXPECT_TRUE(chunking::SendRest(nc, credits, sender, chunking::Clock::now() + 2s));
+  EXPECT_EQ(handler.Wait(), body);
+}
+
+// The receiver's first credit redirects the rest of the chunks to its own
+// subject, as a queue-group worker does.
+TEST(ChunkingTest, CreditRedirectsRemainingChunks) {
+  natscpp::connection nc{natscpp::connection_options{}};
+  auto work = nc.queue_subscribe_sync("work", "workers");
+  auto mine = nc.subscribe_sync("worker.1");
+  const std::string body = Body(10000);
+  const std::string inbox = nc.new_inbox();
+  auto credits = nc.subscribe_sync(inbox);
+
+  std::string received;
+  std::thread receiver([&] {
+    auto first = work.next_message(1s);
+    uint64_t total = 0;
+    uint32_t index = 0;
+    uint32_t count = 0;
+    ASSERT_TRUE(chunking::ParseSize(first.header(chunking::kTotalHeader), &total));
+    ASSERT_TRUE(chunking::ParseChunk(first.header(chunking::kChunkHeader), &index, &count));
+    received.append(first.data());
+    chunking::SendCredit(nc, first.reply_to(), count, "worker.1");
+    while (received.size() < total) {
+      received.append(mine.next_message(1s).data());
+    }
+  });
+
+  chunking::ChunkSender sender(body, 3000, "work");
+  auto first = natscpp::message::create("work", inbox, sender.first());
+  sender.Label(first);
+  nc.publish(std::move(first));
+  EXPECT_TRUE(chunking::SendRest(nc, credits, sender, chunking::Clock::now() + 2s));
+  receiver.join();
+  EXPECT_EQ(received, body);
+}
+
+TEST(ChunkingTest, SendRestGivesUpWithoutCredit) {
+  natscpp::connection nc{natscpp::connection_options{}};
+  const std::string body = Body(3000);
+  chunking::ChunkSender sender(body, 1000, "nobody");
+  auto credits = nc.subscribe_sync(nc.new_inbox());
+  EXPECT_FALSE(chunking::SendRest(nc, credits, sender, chunking::Clock::now() + 20ms));
+}
+
+} // namespace
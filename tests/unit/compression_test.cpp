@@ -0,0 +1,98 @@
+#include "compression.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+namespace {
+
+constexpr size_t kLimit = size_t{1} << 20;
+
+std::string Text() {
+  std::string text;
+  for (int i = 0; i < 200; ++i) {
+    text += "the quick brown fox jumps over the lazy dog ";
+  }
+  return text;
+}
+
+class CompressionTest : public ::testing::TestWithParam<std::string_view> {
+protected:
+  void SetUp() override {
+    codec_ = compression::ParseCodec(GetParam());
+    if (codec_ == compression::Codec::kNone) {
+      GTEST_SKIP() << GetParam() << " is not built in";
+    }
+  }
+  compression::Codec codec_{compression::Codec::kNone};
+};
+
+TEST_P(CompressionTest, RoundTrips) {
+  const std::string text = Text();
+  std::string encoded;
+  ASSERT_TRUE(compression::Compress(codec_, text, &encoded));
+  EXPECT_LT(encoded.size(), text.size());
+  std::string decoded;
+  ASSERT_TRUE(compression::Decompress(GetParam(), std::to_string(text.size()),
+                                      encoded, kLimit, &decoded));
+  EXPECT_EQ(decoded, text);
+}
+
+TEST_P(CompressionTest, DecodesIntoCallerBuffer) {
+  const std::string text = Text();
+  std::string encoded;
+  ASSERT_TRUE(compression::Compress(codec_, text, &encoded));
+  std::string buffer(text.size(), '\0');
+  ASSERT_TRUE(compression::Decompress(codec_, encoded, buffer.data(), buffer.size()));
+  EXPECT_EQ(buffer, text);
+}
+
+TEST_P(CompressionTest, RefusesBodiesAboveLimit) {
+  const std::string text = Text();
+  std::string encoded;
+  ASSERT_TRUE(compression::Compress(codec_, text, &encoded));
+  std::string decoded;
+  EXPECT_FALSE(compression::Decompress(GetParam(), std::to_string(text.size()), encoded,
+                                       text.size() - 1, &decoded));
+  EXPECT_TRUE(compression::Decompress(GetParam(), std::to_string(text.size()), encoded,
+                                      text.size(), &decoded));
+}
+
+TEST_P(CompressionTest, RefusesWrongLength) {
+  const std::string text = Text();
+  std::string encoded;
+  ASSERT_TRUE(compression::Compress(codec_, text, &encoded));
+  std::string decoded;
+  EXPECT_FALSE(compression::Decompress(GetParam(), std::to_string(text.size() - 1),
+                                       encoded, kLimit, &decoded));
+  EXPECT_FALSE(compression::Decompress(GetParam(), "", encoded, kLimit, &decoded));
+}
+
+TEST_P(CompressionTest, RefusesCorruptBody) {
+  std::string decoded;
+  EXPECT_FALSE(compression::Decompress(GetParam(), "100", "not compressed", kLimit, &decoded));
+}
+
+TEST_P(CompressionTest, SkipsIncompressibleData) {
+  std::string encoded;
+  EXPECT_FALSE(compression::Compress(codec_, "abc", &encoded));
+}
+
+INSTANTIATE_TEST_SUITE_P(Codecs, CompressionTest,
+                         ::testing::Values("lz4", "zstd"));
+
+TEST(CompressionNamesTest, UnknownCodecIsNone) {
+  EXPECT_EQ(compression::ParseCodec("gzip"), compression::Codec::kNone);
+  std::string decoded;
+  EXPECT_FALSE(compression::Decompress("gzip", "1", "x", kLimit, &decoded));
+}
+
+TEST(CompressionNamesTest, AcceptsListedCodecsOnly) {
+  EXPECT_TRUE(compression::Accepts("zstd, lz4", compression::Codec::kLz4));
+  EXPECT_TRUE(compression::Accepts(" zstd ,lz4", compression::Codec::kZstd));
+  EXPECT_FALSE(compression::Accepts("zstd", compression::Codec::kLz4));
+  EXPECT_FALSE(compression::Accepts("lz4", compression::Codec::kNone));
+  EXPECT_FALSE(compression::Accepts("", compression::Codec::kLz4));
+}
+
+} // namespace
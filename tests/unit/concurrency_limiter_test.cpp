@@ -0,0 +1,85 @@
+#include "concurrency_limiter.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+
+using namespace std::chrono_literals;
+
+namespace {
+
+ConcurrencyLimiter::Options Options(size_t initial) {
+  return ConcurrencyLimiter::Options{initial, 1, 1000, 2.0, 0.5, 1024};
+}
+
+TEST(ConcurrencyLimiterTest, RejectsOverLimit) {
+  ConcurrencyLimiter limiter(Options(2));
+  EXPECT_TRUE(limiter.TryAcquire());
+  EXPECT_TRUE(limiter.TryAcquire());
+  EXPECT_FALSE(limiter.TryAcquire());
+  EXPECT_EQ(limiter.rejected(), 1u);
+  limiter.OnIgnore();
+  EXPECT_TRUE(limiter.TryAcquire());
+}
+
+TEST(ConcurrencyLimiterTest, DropBacksOff) {
+  ConcurrencyLimiter limiter(Options(10));
+  EXPECT_EQ(limiter.limit(), 10u);
+  ASSERT_TRUE(limiter.TryAcquire());
+  limiter.OnDrop();
+  EXPECT_EQ(limiter.limit(), 5u);
+}
+
+TEST(ConcurrencyLimiterTest, SlowReplyBacksOff) {
+  ConcurrencyLimiter limiter(Options(10));
+  ASSERT_TRUE(limiter.TryAcquire());
+  limiter.OnReply(1ms, 0);
+  ASSERT_TRUE(limiter.TryAcquire());
+  limiter.OnReply(50ms, 0);
+  EXPECT_EQ(limiter.limit(), 5u);
+}
+
+TEST(ConcurrencyLimiterTest, GrowsOnlyWhileSaturated) {
+  ConcurrencyLimiter limiter(Options(10));
+  for (int i = 0; i < 20; ++i) {
+    ASSERT_TRUE(limiter.TryAcquire());
+    limiter.OnReply(1ms, 0);
+  }
+  EXPECT_EQ(limiter.limit(), 10u);
+
+  for (int i = 0; i < 10; ++i) {
+    ASSERT_TRUE(limiter.TryAcquire());
+  }
+  limiter.OnReply(1ms, 0);
+  EXPECT_EQ(limiter.limit(), 10u);
+}
+
+TEST(ConcurrencyLimiterTest, GrowsByOnePerLimitOfReplies) {
+  ConcurrencyLimiter limiter(Options(10));
+  for (int i = 0; i < 10; ++i) {
+    ASSERT_TRUE(limiter.TryAcquire());
+  }
+  // Each reply adds 1/limit: about a limit's worth of saturated replies
+  // grows it by one.
+  int replies = 0;
+  while (limiter.limit() == 10u && replies < 100) {
+    limiter.OnReply(1ms, 0);
+    ASSERT_TRUE(limiter.TryAcquire());
+    ++replies;
+  }
+  EXPECT_EQ(limiter.limit(), 11u);
+  EXPECT_GE(replies, 10);
+  EXPECT_LE(replies, 11);
+}
+
+TEST(ConcurrencyLimiterTest, LargePayloadsAreNotJudged) {
+  ConcurrencyLimiter limiter(Options(10));
+  ASSERT_TRUE(limiter.TryAcquire());
+  limiter.OnReply(1ms, 0);
+  ASSERT_TRUE(limiter.TryAcquire());
+  limiter.OnReply(50ms, 4096);
+  EXPECT_EQ(limiter.limit(), 10u);
+  EXPECT_EQ(limiter.in_flight(), 0u);
+}
+
+} // namespace
@@ -0,0 +1,203 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "natscpp/error.hpp"
+
+// In-process stand-in for natscpp, so the gateway's NATS plumbing can be
+// unit-tested without a server. Every connection shares one bus; publish
+// delivers a copy of the message to each matching subscription (one member
+// per queue group), with NATS subject wildcards.
+namespace natscpp {
+
+class message {
+ public:
+  message() = default;
+  message(message&&) noexcept = default;
+  message& operator=(message&&) noexcept = default;
+  message(const message&) = delete;
+  message& operator=(const message&) = delete;
+
+  static message create(std::string_view subject, std::string_view reply, std::string_view data) {
+    message msg;
+    msg.body_ = std::make_unique<Body>();
+    msg.body_->subject = subject;
+    msg.body_->reply = reply;
+    msg.body_->data = data;
+    return msg;
+  }
+
+  std::string_view data() const { return body_ ? std::string_view(body_->data) : std::string_view(); }
+  size_t size() const { return data().size(); }
+  std::string_view subject() const { return body_ ? std::string_view(body_->subject) : std::string_view(); }
+  std::string_view reply_to() const { return body_ ? std::string_view(body_->reply) : std::string_view(); }
+
+  std::string header(std::string_view key) const {
+    if (!body_) {
+      return {};
+    }
+    auto it = body_->headers.find(std::string(key));
+    return it == body_->headers.end() ? std::string() : it->second;
+  }
+  void set_header(std::string_view key, std::string_view value) {
+    body_->headers[std::string(key)] = std::string(value);
+  }
+
+  message clone() const {
+    message copy = create(subject(), reply_to(), data());
+    copy.body_->headers = body_->headers;
+    return copy;
+  }
+
+ private:
+  struct Body {
+    std::string subject;
+    std::string reply;
+    std::string data;
+    std::map<std::string, std::string> headers;
+  };
+  std::unique_ptr<Body> body_;
+};
+
+namespace fake {
+
+inline bool subject_matches(std::string_view pattern, std::string_view subject) {
+  while (true) {
+    const size_t pdot = pattern.find('.');
+    const size_t sdot = subject.find('.');
+    const std::string_view ptok = pattern.substr(0, pdot);
+    const std::string_view stok = subject.substr(0, sdot);
+    if (ptok == ">") {
+      return !subject.empty();
+    }
+    if (ptok != "*" && ptok != stok) {
+      return false;
+    }
+    if (pdot == std::string_view::npos || sdot == std::string_view::npos) {
+      return pdot == sdot;
+    }
+    pattern.remove_prefix(pdot + 1);
+    subject.remove_prefix(sdot + 1);
+  }
+}
+
+struct queue {
+  std::string pattern;
+  std::string group;
+  std::mutex mu;
+  std::condition_variable cv;
+  std::deque<message> messages;
+};
+
+struct bus {
+  std::mutex mu;
+  std::vector<std::weak_ptr<queue>> queues;
+  std::map<std::string, size_t> group_turns;
+  uint64_t next_inbox{0};
+
+  static bus& instance() {
+    static bus b;
+    return b;
+  }
+
+  void deliver(const message& msg) {
+    std::vector<std::shared_ptr<queue>> targets;
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      std::map<std::string, std::vector<std::shared_ptr<queue>>> groups;
+      for (auto it = queues.begin(); it != queues.end();) {
+        auto q = it->lock();
+        if (!q) {
+          it = queues.erase(it);
+          continue;
+        }
+        ++it;
+        if (!subject_matches(q->pattern, msg.subject())) {
+          continue;
+        }
+        if (q->group.empty()) {
+          targets.push_back(std::move(q));
+        } else {
+          groups[q->pattern + " " + q->group].push_back(std::move(q));
+        }
+      }
+      for (auto& [key, members] : groups) {
+        targets.push_back(members[group_turns[key]++ % members.size()]);
+      }
+    }
+    for (auto& q : targets) {
+      {
+        std::lock_guard<std::mutex> lock(q->mu);
+        q->messages.push_back(msg.clone());
+      }
+      q->cv.notify_one();
+    }
+  }
+};
+
+}  // namespace fake
+
+class subscription {
+ public:
+  subscription() = default;
+  explicit subscription(std::shared_ptr<fake::queue> queue) : queue_(std::move(queue)) {}
+  subscription(subscription&&) noexcept = default;
+  subscription& operator=(subscription&&) noexcept = default;
+
+  message next_message(std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(queue_->mu);
+    if (!queue_->cv.wait_for(lock, timeout, [this] { return !queue_->messages.empty(); })) {
+      throw nats_error(NATS_TIMEOUT, "timeout");
+    }
+    message msg = std::move(queue_->messages.front());
+    queue_->messages.pop_front();
+    return msg;
+  }
+
+ private:
+  std::shared_ptr<fake::queue> queue_;
+};
+
+struct connection_options {
+  std::string url;
+};
+
+class connection {
+ public:
+  explicit connection(const connection_options&) {}
+
+  std::string new_inbox() {
+    auto& b = fake::bus::instance();
+    std::lock_guard<std::mutex> lock(b.mu);
+    return "_INBOX." + std::to_string(++b.next_inbox);
+  }
+
+  subscription subscribe_sync(std::string_view subject) { return queue_subscribe_sync(subject, ""); }
+
+  subscription queue_subscribe_sync(std::string_view subject, std::string_view group) {
+    auto q = std::make_shared<fake::queue>();
+    q->pattern = subject;
+    q->group = group;
+    auto& b = fake::bus::instance();
+    std::lock_guard<std::mutex> lock(b.mu);
+    b.queues.push_back(q);
+    return subscription(std::move(q));
+  }
+
+  void publish(message msg) { fake::bus::instance().deliver(msg); }
+  void publish(std::string_view subject, std::string_view data) {
+    publish(message::create(subject, "", data));
+  }
+};
+
+}  // namespace natscpp
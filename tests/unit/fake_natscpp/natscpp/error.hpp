@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdexcept>
+
+// Test double for natscpp's error type; only the statuses the code under
+// test checks for.
+typedef enum { NATS_OK = 0, NATS_ERR = 1, NATS_TIMEOUT = 26 } natsStatus;
+
+namespace natscpp {
+
+class nats_error : public std::runtime_error {
+ public:
+  nats_error(natsStatus status, const char* message) : std::runtime_error(message), status_(status) {}
+  natsStatus status() const noexcept { return status_; }
+
+ private:
+  natsStatus status_;
+};
+
+}  // namespace natscpp
@@ -0,0 +1,71 @@
+#include "hedge_policy.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+
+using namespace std::chrono_literals;
+
+namespace {
+
+HedgePolicy::Options Options() {
+  return HedgePolicy::Options{0.9, HedgePolicy::Clock::duration::zero(), 1ms, 0.1};
+}
+
+TEST(HedgePolicyTest, UnknownUntilEnoughReplies) {
+  HedgePolicy policy(Options());
+  EXPECT_FALSE(policy.Delay());
+  for (int i = 0; i < 255; ++i) {
+    policy.Observe(5ms);
+  }
+  EXPECT_FALSE(policy.Delay());
+  policy.Observe(5ms);
+  EXPECT_TRUE(policy.Delay());
+}
+
+TEST(HedgePolicyTest, DelayTracksPercentile) {
+  HedgePolicy policy(Options());
+  // 95% of replies take 2ms, the tail 100ms: the p90 bucket edge sits just
+  // above 2ms, well short of the tail.
+  for (int i = 0; i < 256; ++i) {
+    policy.Observe(i % 20 == 0 ? 100ms : 2ms);
+  }
+  auto delay = policy.Delay();
+  ASSERT_TRUE(delay);
+  EXPECT_GE(*delay, 2ms);
+  EXPECT_LT(*delay, 3ms);
+}
+
+TEST(HedgePolicyTest, MinDelayBoundsPercentile) {
+  auto options = Options();
+  options.min_delay = 10ms;
+  HedgePolicy policy(options);
+  for (int i = 0; i < 256; ++i) {
+    policy.Observe(1ms);
+  }
+  EXPECT_EQ(policy.Delay(), HedgePolicy::Clock::duration(10ms));
+}
+
+TEST(HedgePolicyTest, FixedDelayWins) {
+  auto options = Options();
+  options.fixed_delay = 7ms;
+  HedgePolicy policy(options);
+  EXPECT_EQ(policy.Delay(), HedgePolicy::Clock::duration(7ms));
+}
+
+TEST(HedgePolicyTest, BudgetCapsHedges) {
+  HedgePolicy policy(Options());
+  EXPECT_FALSE(policy.TrySpend());
+  // 10% budget: ten hedgeable requests pay for one duplicate.
+  for (int i = 0; i < 9; ++i) {
+    policy.Deposit();
+  }
+  EXPECT_FALSE(policy.TrySpend());
+  policy.Deposit();
+  EXPECT_TRUE(policy.TrySpend());
+  EXPECT_FALSE(policy.TrySpend());
+  EXPECT_EQ(policy.hedged(), 1u);
+  EXPECT_EQ(policy.denied(), 3u);
+}
+
+} // namespace
@@ -0,0 +1,64 @@
+#include "kernels.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace {
+
+// Runs kernel name over input; nullopt when it rejects the input.
+std::optional<std::string> run(std::string_view name, std::string_view input) {
+  const kernels::Entry* entry = kernels::find(name);
+  EXPECT_NE(entry, nullptr) << name;
+  if (entry == nullptr) {
+    return std::nullopt;
+  }
+  std::string out(entry->max_output(input.size()), '\0');
+  size_t size = 0;
+  if (!entry->run(reinterpret_cast<const uint8_t*>(input.data()), input.size(),
+                  reinterpret_cast<uint8_t*>(out.data()), &size)) {
+    return std::nullopt;
+  }
+  out.resize(size);
+  return out;
+}
+
+TEST(KernelsTest, UnknownKernelIsNotFound) { EXPECT_EQ(kernels::find("rot13"), nullptr); }
+
+TEST(KernelsTest, AsciiCase) {
+  // Long enough to cover the vector loop and the scalar tail.
+  const std::string mixed = "Hello, World! 0123456789 abcdefghijklmnopqrstuvwxyz ÄÖ";
+  EXPECT_EQ(run("upper", mixed), "HELLO, WORLD! 0123456789 ABCDEFGHIJKLMNOPQRSTUVWXYZ ÄÖ");
+  EXPECT_EQ(run("lower", "MiXeD"), "mixed");
+  EXPECT_TRUE(kernels::find("upper")->same_size);
+}
+
+TEST(KernelsTest, Crc32cKnownAnswer) {
+  EXPECT_EQ(run("crc32c", "123456789"), "e3069283");
+  EXPECT_EQ(run("crc32c", ""), "00000000");
+  // RFC 3720 vectors, long enough for the 8-byte hardware loop.
+  EXPECT_EQ(run("crc32c", std::string(32, '\0')), "8a9136aa");
+  EXPECT_EQ(run("crc32c", std::string(32, '\xff')), "62a8ab43");
+}
+
+TEST(KernelsTest, XxHash64KnownAnswer) {
+  EXPECT_EQ(run("xxhash64", ""), "ef46db3751d8e999");
+  EXPECT_EQ(run("xxhash64", "abc"), "44bc2cf5ad770999");
+}
+
+TEST(KernelsTest, Base64RoundTrip) {
+  EXPECT_EQ(run("base64_encode", "foobar"), "Zm9vYmFy");
+  EXPECT_EQ(run("base64_encode", "fo"), "Zm8=");
+  EXPECT_EQ(run("base64_decode", "Zm9vYg=="), "foob");
+  EXPECT_EQ(run("base64_decode", "Zm9v!mFy"), std::nullopt);
+}
+
+TEST(KernelsTest, JsonMinifyKeepsStrings) {
+  EXPECT_EQ(run("json_minify", "{ \"a b\" : [ 1, 2 ],\n \"c\": \"x\\\" y\" }"),
+            "{\"a b\":[1,2],\"c\":\"x\\\" y\"}");
+}
+
+}  // namespace
@@ -0,0 +1,80 @@
+#include "mpmc_ring.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace {
+
+TEST(MpmcRingTest, RoundsCapacityUpToPowerOfTwo) {
+  EXPECT_EQ(MpmcRing<int>(5).capacity(), 8u);
+  EXPECT_EQ(MpmcRing<int>(0).capacity(), 2u);
+}
+
+TEST(MpmcRingTest, FifoUntilFullThenEmpty) {
+  MpmcRing<int> ring(4);
+  for (int i = 0; i < 4; ++i) {
+    ASSERT_TRUE(ring.try_push(int{i}));
+  }
+  EXPECT_FALSE(ring.try_push(4));
+  EXPECT_EQ(ring.size(), 4u);
+  int value = -1;
+  for (int i = 0; i < 4; ++i) {
+    ASSERT_TRUE(ring.try_pop(value));
+    EXPECT_EQ(value, i);
+  }
+  EXPECT_FALSE(ring.try_pop(value));
+  EXPECT_EQ(ring.size(), 0u);
+}
+
+TEST(MpmcRingTest, MovesOnlyTypes) {
+  MpmcRing<std::unique_ptr<int>> ring(2);
+  ASSERT_TRUE(ring.try_push(std::make_unique<int>(42)));
+  std::unique_ptr<int> out;
+  ASSERT_TRUE(ring.try_pop(out));
+  ASSERT_TRUE(out);
+  EXPECT_EQ(*out, 42);
+}
+
+TEST(MpmcRingTest, ConcurrentProducersAndConsumersSeeEveryItemOnce) {
+  constexpr int kThreads = 4;
+  constexpr uint64_t kPerProducer = 50000;
+  MpmcRing<uint64_t> ring(64);
+  std::atomic<uint64_t> sum{0};
+  std::atomic<uint64_t> popped{0};
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&, t] {
+      for (uint64_t i = 1; i <= kPerProducer; ++i) {
+        uint64_t value = i + t * kPerProducer;
+        while (!ring.try_push(std::move(value))) {
+          std::this_thread::yield();
+        }
+      }
+    });
+    threads.emplace_back([&] {
+      uint64_t value = 0;
+      while (popped.load() < kThreads * kPerProducer) {
+        if (ring.try_pop(value)) {
+          sum.fetch_add(value);
+          popped.fetch_add(1);
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  const uint64_t n = kThreads * kPerProducer;
+  EXPECT_EQ(popped.load(), n);
+  EXPECT_EQ(sum.load(), n * (n + 1) / 2);
+}
+
+}  // namespace
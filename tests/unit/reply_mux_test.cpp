@@ -0,0 +1,293 @@
+#include "chunking.h"
+#include "reply_mux.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+namespace {
+
+// Records what the mux delivered; waits with a generous bound so slow CI
+// machines do not flake.
+class RecordingHandler : public ReplyHandler {
+public:
+  void OnReply(natscpp::message reply) override {
+    std::lock_guard<std::mutex> lock(mu_);
+    ++replies_;
+    body_ = std::string(reply.data());
+    cv_.notify_all();
+  }
+  void OnTimeout() override {
+    std::lock_guard<std::mutex> lock(mu_);
+    ++timeouts_;
+    cv_.notify_all();
+  }
+  void OnHedge() override {
+    std::this_thread::sleep_for(hedge_sleep_);
+    std::lock_guard<std::mutex> lock(mu_);
+    ++hedges_;
+    cv_.notify_all();
+  }
+
+  void OnCredit(const natscpp::message &credit) override {
+    std::lock_guard<std::mutex> lock(mu_);
+    ++credits_;
+    credit_ = credit.header(chunking::kCreditHeader);
+    cv_.notify_all();
+  }
+
+  bool WaitFor(const int RecordingHandler::*counter, int n = 1) {
+    std::unique_lock<std::mutex> lock(mu_);
+    return cv_.wait_for(lock, 2s, [&] { return this->*counter >= n; });
+  }
+  int replies() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return replies_;
+  }
+  int timeouts() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return timeouts_;
+  }
+  int hedges() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return hedges_;
+  }
+  std::string body() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return body_;
+  }
+  std::string credit() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return credit_;
+  }
+
+  std::chrono::milliseconds hedge_sleep_{0};
+  int replies_{0};
+  int timeouts_{0};
+  int hedges_{0};
+  int credits_{0};
+
+private:
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::string body_;
+  std::string credit_;
+};
+
+class ReplyMuxTest : public ::testing::Test {
+protected:
+  ReplyMux::Clock::time_point In(std::chrono::milliseconds d) {
+    return ReplyMux::Clock::now() + d;
+  }
+  void Reply(const ReplyMux::Ticket &ticket, std::string_view body) {
+    nc_.publish(natscpp::message::create(ticket.reply_subject, "", body));
+  }
+
+  // Declared before the mux, whose destructor times out what is left.
+  RecordingHandler handler_;
+  RecordingHandler other_;
+  natscpp::connection nc_{natscpp::connection_options{}};
+  ReplyMux mux_{nc_, 4, 5ms, ReplyMux::ChunkOptions{2, 1 << 20}};
+};
+
+TEST_F(ReplyMuxTest, DeliversFirstReplyOnly) {
+  auto ticket = mux_.Register(&handler_, In(2s));
+  ASSERT_TRUE(ticket);
+  EXPECT_EQ(mux_.in_flight(), 1u);
+  Reply(ticket, "first");
+  Reply(ticket, "second");
+  ASSERT_TRUE(handler_.WaitFor(&RecordingHandler::replies_));
+  std::this_thread::sleep_for(30ms);
+  EXPECT_EQ(handler_.replies(), 1);
+  EXPECT_EQ(handler_.body(), "first");
+  EXPECT_EQ(mux_.in_flight(), 0u);
+  EXPECT_FALSE(mux_.Cancel(ticket));
+}
+
+TEST_F(ReplyMuxTest, TimesOutAndDropsLateReply) {
+  auto ticket = mux_.Register(&handler_, In(20ms));
+  ASSERT_TRUE(handler_.WaitFor(&RecordingHandler::timeouts_));
+  Reply(ticket, "late");
+  std::this_thread::sleep_for(30ms);
+  EXPECT_EQ(handler_.replies(), 0);
+  EXPECT_EQ(handler_.timeouts(), 1);
+}
+
+TEST_F(ReplyMuxTest, NoTimeoutUntilArmed) {
+  auto ticket = mux_.Register(&handler_);
+  std::this_thread::sleep_for(30ms);
+  EXPECT_EQ(handler_.timeouts(), 0);
+  mux_.Arm(ticket, In(0ms));
+  ASSERT_TRUE(handler_.WaitFor(&RecordingHandler::timeouts_));
+}
+
+TEST_F(ReplyMuxTest, ArmAfterCompletionIsNoop) {
+  auto ticket = mux_.Register(&handler_);
+  ASSERT_TRUE(mux_.Cancel(ticket));
+  // The slot's next registration must keep its own deadline.
+  auto next = mux_.Register(&other_, In(2s));
+  mux_.Arm(ticket, In(0ms));
+  std::this_thread::sleep_for(30ms);
+  EXPECT_EQ(other_.timeouts(), 0);
+  EXPECT_TRUE(mux_.Cancel(next));
+}
+
+TEST_F(ReplyMuxTest, CancelWinsOnce) {
+  auto ticket = mux_.Register(&handler_, In(2s));
+  EXPECT_TRUE(mux_.Cancel(ticket));
+  EXPECT_FALSE(mux_.Cancel(ticket));
+  Reply(ticket, "after cancel");
+  std::this_thread::sleep_for(30ms);
+  EXPECT_EQ(handler_.replies(), 0);
+  EXPECT_EQ(mux_.in_flight(), 0u);
+}
+
+TEST_F(ReplyMuxTest, ReportsFullTable) {
+  ReplyMux::Ticket tickets[4];
+  for (auto &ticket : tickets) {
+    ticket = mux_.Register(&handler_, In(2s));
+    ASSERT_TRUE(ticket);
+  }
+  EXPECT_FALSE(mux_.Register(&handler_, In(2s)));
+  EXPECT_TRUE(mux_.Cancel(tickets[0]));
+  EXPECT_TRUE(mux_.Register(&handler_, In(2s)));
+}
+
+TEST_F(ReplyMuxTest, StaleReplyDoesNotReachSlotReuser) {
+  auto old_ticket = mux_.Register(&handler_, In(2s));
+  ASSERT_TRUE(mux_.Cancel(old_ticket));
+  // Cycle through the table until the old slot holds a newer id.
+  ReplyMux::Ticket reused;
+  for (int i = 0; i < 4; ++i) {
+    auto ticket = mux_.Register(&other_, In(2s));
+    if ((ticket.id & 3) == (old_ticket.id & 3)) {
+      reused = ticket;
+      break;
+    }
+    mux_.Cancel(ticket);
+  }
+  ASSERT_TRUE(reused);
+  Reply(old_ticket, "stale");
+  std::this_thread::sleep_for(30ms);
+  EXPECT_EQ(other_.replies(), 0);
+  Reply(reused, "fresh");
+  ASSERT_TRUE(other_.WaitFor(&RecordingHandler::replies_));
+  EXPECT_EQ(other_.body(), "fresh");
+}
+
+TEST_F(ReplyMuxTest, HedgeFiresOnceAndKeepsRegistration) {
+  auto ticket = mux_.Register(&handler_, In(2s));
+  mux_.Arm(ticket, In(2s), In(10ms));
+  ASSERT_TRUE(handler_.WaitFor(&RecordingHandler::hedges_));
+  std::this_thread::sleep_for(30ms);
+  EXPECT_EQ(handler_.hedges(), 1);
+  EXPECT_EQ(mux_.in_flight(), 1u);
+  Reply(ticket, "after hedge");
+  ASSERT_TRUE(handler_.WaitFor(&RecordingHandler::replies_));
+}
+
+TEST_F(ReplyMuxTest, HedgeAfterCompletionIsNoop) {
+  auto ticket = mux_.Register(&handler_, In(2s));
+  ASSERT_TRUE(mux_.Cancel(ticket));
+  mux_.Arm(ticket, In(2s), In(0ms));
+  std::this_thread::sleep_for(30ms);
+  EXPECT_EQ(handler_.hedges(), 0);
+}
+
+TEST_F(ReplyMuxTest, CancelWaitsForHedgeInProgress) {
+  handler_.hedge_sleep_ = 50ms;
+  auto ticket = mux_.Register(&handler_, In(2s));
+  mux_.Arm(ticket, In(2s), In(0ms));
+  // Wait until the dispatcher is inside OnHedge, then cancel: Cancel must
+  // not return (and let the owner free the handler) before OnHedge does.
+  std::this_thread::sleep_for(20ms);
+  EXPECT_TRUE(mux_.Cancel(ticket));
+  EXPECT_EQ(handler_.hedges(), 1);
+}
+
+TEST_F(ReplyMuxTest, CreditReachesWaitingRequest) {
+  auto ticket = mux_.Register(&handler_, In(2s));
+  auto credit = natscpp::message::create(ticket.reply_subject, "", "");
+  credit.set_header(chunking::kCreditHeader, "4");
+  nc_.publish(std::move(credit));
+  ASSERT_TRUE(handler_.WaitFor(&RecordingHandler::credits_));
+  EXPECT_EQ(handler_.credit(), "4");
+  // A credit is not the reply.
+  EXPECT_EQ(handler_.replies(), 0);
+  EXPECT_EQ(mux_.in_flight(), 1u);
+}
+
+// Chunk i of count, as a sender would publish it.
+natscpp::message Chunk(const ReplyMux::Ticket &ticket, const std::string &credit_inbox,
+                       uint32_t index, uint32_t count, std::string_view data,
+                       size_t total) {
+  auto msg = natscpp::message::create(ticket.reply_subject,
+                                      index == 0 ? credit_inbox : "", data);
+  msg.set_header(chunking::kChunkHeader,
+                 std::to_string(index) + "/" + std::to_string(count));
+  if (index == 0) {
+    msg.set_header(chunking::kTotalHeader, std::to_string(total));
+  }
+  return msg;
+}
+
+TEST_F(ReplyMuxTest, ReassemblesChunkedReplyAndGrantsCredit) {
+  auto ticket = mux_.Register(&handler_, In(2s));
+  const std::string inbox = nc_.new_inbox();
+  auto credits = nc_.subscribe_sync(inbox);
+  nc_.publish(Chunk(ticket, inbox, 0, 3, "aa", 6));
+  // Window 2: with chunk 0 in, the receiver credits chunks [0, 1 + 2).
+  auto credit = credits.next_message(1s);
+  EXPECT_EQ(credit.header(chunking::kCreditHeader), "3");
+  nc_.publish(Chunk(ticket, inbox, 1, 3, "bb", 6));
+  nc_.publish(Chunk(ticket, inbox, 2, 3, "cc", 6));
+  ASSERT_TRUE(handler_.WaitFor(&RecordingHandler::replies_));
+  EXPECT_EQ(handler_.body(), "aabbcc");
+}
+
+TEST_F(ReplyMuxTest, ChunkGapAbandonsReply) {
+  auto ticket = mux_.Register(&handler_, In(100ms));
+  const std::string inbox = nc_.new_inbox();
+  nc_.publish(Chunk(ticket, inbox, 0, 3, "aa", 6));
+  nc_.publish(Chunk(ticket, inbox, 2, 3, "cc", 6));
+  nc_.publish(Chunk(ticket, inbox, 1, 3, "bb", 6));
+  ASSERT_TRUE(handler_.WaitFor(&RecordingHandler::timeouts_));
+  EXPECT_EQ(handler_.replies(), 0);
+}
+
+TEST_F(ReplyMuxTest, OversizedChunkedReplyIsDropped) {
+  auto ticket = mux_.Register(&handler_, In(100ms));
+  nc_.publish(Chunk(ticket, nc_.new_inbox(), 0, 2, "aa", size_t{2} << 20));
+  ASSERT_TRUE(handler_.WaitFor(&RecordingHandler::timeouts_));
+  EXPECT_EQ(handler_.replies(), 0);
+}
+
+TEST_F(ReplyMuxTest, ChunksPastAnnouncedTotalAreDropped) {
+  auto ticket = mux_.Register(&handler_, In(100ms));
+  const std::string inbox = nc_.new_inbox();
+  nc_.publish(Chunk(ticket, inbox, 0, 3, "aa", 4));
+  nc_.publish(Chunk(ticket, inbox, 1, 3, "bb", 4));
+  nc_.publish(Chunk(ticket, inbox, 2, 3, "cc", 4));
+  ASSERT_TRUE(handler_.WaitFor(&RecordingHandler::timeouts_));
+  EXPECT_EQ(handler_.replies(), 0);
+}
+
+TEST_F(ReplyMuxTest, SecondChunkedSenderIsIgnored) {
+  auto ticket = mux_.Register(&handler_, In(2s));
+  const std::string first = nc_.new_inbox();
+  const std::string second = nc_.new_inbox();
+  nc_.publish(Chunk(ticket, first, 0, 2, "aa", 4));
+  nc_.publish(Chunk(ticket, second, 0, 2, "xx", 4));
+  nc_.publish(Chunk(ticket, first, 1, 2, "bb", 4));
+  ASSERT_TRUE(handler_.WaitFor(&RecordingHandler::replies_));
+  EXPECT_EQ(handler_.body(), "aabb");
+}
+
+} // namespace
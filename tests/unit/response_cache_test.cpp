@@ -0,0 +1,68 @@
+#include "response_cache.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+namespace {
+
+TEST(ResponseCacheTest, HitsAfterInsert) {
+  ResponseCache cache(1 << 20, 10s, 4);
+  std::string reply;
+  EXPECT_FALSE(cache.Lookup("payload", &reply));
+  cache.Insert("payload", "reply");
+  ASSERT_TRUE(cache.Lookup("payload", &reply));
+  EXPECT_EQ(reply, "reply");
+
+  auto stats = cache.stats();
+  EXPECT_EQ(stats.hits, 1u);
+  EXPECT_EQ(stats.misses, 1u);
+  EXPECT_EQ(stats.entries, 1u);
+}
+
+TEST(ResponseCacheTest, InsertReplacesEntry) {
+  ResponseCache cache(1 << 20, 10s, 1);
+  cache.Insert("payload", "old");
+  cache.Insert("payload", "new");
+  std::string reply;
+  ASSERT_TRUE(cache.Lookup("payload", &reply));
+  EXPECT_EQ(reply, "new");
+  EXPECT_EQ(cache.stats().entries, 1u);
+}
+
+TEST(ResponseCacheTest, EntriesExpire) {
+  ResponseCache cache(1 << 20, 20ms, 1);
+  cache.Insert("payload", "reply");
+  std::this_thread::sleep_for(40ms);
+  std::string reply;
+  EXPECT_FALSE(cache.Lookup("payload", &reply));
+  EXPECT_EQ(cache.stats().entries, 0u);
+}
+
+TEST(ResponseCacheTest, EvictsLeastRecentlyUsed) {
+  // One shard with room for two entries of this size, not three.
+  const std::string big(1000, 'x');
+  ResponseCache cache(2 * (big.size() + 200) + 2 * sizeof(void *) * 16, 10s, 1);
+  cache.Insert("a", big);
+  cache.Insert("b", big);
+  std::string reply;
+  ASSERT_TRUE(cache.Lookup("a", &reply));  // b is now least recently used
+  EXPECT_EQ(cache.Insert("c", big), 1u);
+  EXPECT_TRUE(cache.Lookup("a", &reply));
+  EXPECT_FALSE(cache.Lookup("b", &reply));
+  EXPECT_TRUE(cache.Lookup("c", &reply));
+  EXPECT_EQ(cache.stats().evictions, 1u);
+}
+
+TEST(ResponseCacheTest, SkipsEntriesLargerThanAShard) {
+  ResponseCache cache(1000, 10s, 1);
+  EXPECT_EQ(cache.Insert("payload", std::string(2000, 'x')), 0u);
+  std::string reply;
+  EXPECT_FALSE(cache.Lookup("payload", &reply));
+}
+
+} // namespace
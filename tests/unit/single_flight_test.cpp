@@ -0,0 +1,189 @@
+#include "reply_mux.h"
+#include "single_flight.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+
+using namespace std::chrono_literals;
+
+namespace {
+
+class NullHandler : public ReplyHandler {
+public:
+  void OnReply(natscpp::message) override {}
+  void OnTimeout() override {}
+};
+
+// A request in a flight, as PendingRun is: its own mux slot, and the
+// leader's outcome as a follower. An orphan starts a new flight for the
+// same payload, leading it if it is the first.
+class Request : public ReplyHandler, public SingleFlight::Follower {
+public:
+  Request(SingleFlight &flights, ReplyMux &mux) : flights_(flights), mux_(mux) {}
+
+  // Leads or follows; the slot stays unpublished either way.
+  SingleFlight::Role Join(ReplyMux::Clock::time_point deadline) {
+    ticket_ = mux_.Register(this, deadline);
+    return flights_.Join("payload", {this, &mux_, ticket_}, &flight_);
+  }
+
+  void OnReply(natscpp::message) override {}
+  void OnTimeout() override {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      ++timeouts_;
+    }
+    // A leader with no reply settles its flight empty-handed.
+    if (flight_) {
+      flights_.Settle(std::move(flight_), std::nullopt);
+    }
+    cv_.notify_all();
+  }
+  void OnShared(std::string_view reply) override {
+    std::lock_guard<std::mutex> lock(mu_);
+    shared_ = std::string(reply);
+    cv_.notify_all();
+  }
+  void OnOrphaned() override {
+    const SingleFlight::Role role =
+        flights_.Join("payload", {this, &mux_, ticket_}, &flight_);
+    mux_.Release(ticket_);
+    std::lock_guard<std::mutex> lock(mu_);
+    orphaned_role_ = role;
+    cv_.notify_all();
+  }
+
+  template <class Pred> bool WaitUntil(Pred pred) {
+    std::unique_lock<std::mutex> lock(mu_);
+    return cv_.wait_for(lock, 2s, [&] { return pred(*this); });
+  }
+
+  // A leader with a reply shares it.
+  void Reply(std::string_view reply) { flights_.Settle(std::move(flight_), reply); }
+
+  const ReplyMux::Ticket &ticket() const { return ticket_; }
+
+  int timeouts_{0};
+  std::string shared_;
+  std::optional<SingleFlight::Role> orphaned_role_;
+
+private:
+  SingleFlight &flights_;
+  ReplyMux &mux_;
+  ReplyMux::Ticket ticket_;
+  std::shared_ptr<SingleFlight::Flight> flight_;
+  std::mutex mu_;
+  std::condition_variable cv_;
+};
+
+TEST(SingleFlightTest, FirstRequestLeadsAndFollowersJoin) {
+  SingleFlight flights(4);
+  std::shared_ptr<SingleFlight::Flight> flight;
+  EXPECT_EQ(flights.Join("payload", {}, &flight), SingleFlight::Role::kLeader);
+  ASSERT_TRUE(flight);
+
+  std::shared_ptr<SingleFlight::Flight> unused;
+  SingleFlight::Waiter waiter{nullptr, nullptr, {7, "reply.7"}};
+  EXPECT_EQ(flights.Join("payload", waiter, &unused), SingleFlight::Role::kFollower);
+  EXPECT_EQ(flights.Join("payload", waiter, &unused), SingleFlight::Role::kFollower);
+  EXPECT_EQ(flights.coalesced(), 2u);
+
+  auto followers = flights.Land(flight);
+  ASSERT_EQ(followers.size(), 2u);
+  EXPECT_EQ(followers[0].ticket.id, 7u);
+}
+
+TEST(SingleFlightTest, LandingEndsTheFlight) {
+  SingleFlight flights(1);
+  std::shared_ptr<SingleFlight::Flight> first;
+  ASSERT_EQ(flights.Join("payload", {}, &first), SingleFlight::Role::kLeader);
+  EXPECT_TRUE(flights.Land(first).empty());
+
+  std::shared_ptr<SingleFlight::Flight> second;
+  EXPECT_EQ(flights.Join("payload", {}, &second), SingleFlight::Role::kLeader);
+  // Landing a flight that was already replaced leaves the new one alone.
+  flights.Land(first);
+  std::shared_ptr<SingleFlight::Flight> unused;
+  EXPECT_EQ(flights.Join("payload", {}, &unused), SingleFlight::Role::kFollower);
+}
+
+TEST(SingleFlightTest, DifferentPayloadsFlyAlone) {
+  SingleFlight flights(1);
+  std::shared_ptr<SingleFlight::Flight> a;
+  std::shared_ptr<SingleFlight::Flight> b;
+  EXPECT_EQ(flights.Join("a", {}, &a), SingleFlight::Role::kLeader);
+  EXPECT_EQ(flights.Join("b", {}, &b), SingleFlight::Role::kLeader);
+  EXPECT_NE(a, b);
+}
+
+// A follower whose call is cancelled (or times out) releases its own mux
+// slot; the leader then fails to claim it and must skip it.
+TEST(SingleFlightTest, CancelledFollowerIsNotCompleted) {
+  natscpp::connection nc{natscpp::connection_options{}};
+  NullHandler leader_handler;
+  NullHandler follower_handler;
+  ReplyMux mux(nc, 8, 5ms, ReplyMux::ChunkOptions{});
+  SingleFlight flights(1);
+
+  auto deadline = ReplyMux::Clock::now() + 2s;
+  std::shared_ptr<SingleFlight::Flight> flight;
+  ASSERT_EQ(flights.Join("payload", {nullptr, &mux, mux.Register(&leader_handler, deadline)},
+                         &flight),
+            SingleFlight::Role::kLeader);
+  SingleFlight::Waiter follower{nullptr, &mux, mux.Register(&follower_handler, deadline)};
+  std::shared_ptr<SingleFlight::Flight> unused;
+  ASSERT_EQ(flights.Join("payload", follower, &unused), SingleFlight::Role::kFollower);
+
+  EXPECT_TRUE(mux.Cancel(follower.ticket));
+  auto followers = flights.Land(flight);
+  ASSERT_EQ(followers.size(), 1u);
+  EXPECT_FALSE(followers[0].mux->Cancel(followers[0].ticket));
+}
+
+TEST(SingleFlightTest, LeaderReplyIsSharedWithFollowers) {
+  natscpp::connection nc{natscpp::connection_options{}};
+  ReplyMux mux(nc, 8, 5ms, ReplyMux::ChunkOptions{});
+  SingleFlight flights(1);
+  Request leader(flights, mux);
+  Request follower(flights, mux);
+
+  const auto deadline = ReplyMux::Clock::now() + 2s;
+  ASSERT_EQ(leader.Join(deadline), SingleFlight::Role::kLeader);
+  ASSERT_EQ(follower.Join(deadline), SingleFlight::Role::kFollower);
+
+  leader.Reply("reply");
+  EXPECT_EQ(follower.shared_, "reply");
+  EXPECT_FALSE(follower.orphaned_role_.has_value());
+  // The follower's slot was claimed for the shared reply.
+  EXPECT_FALSE(mux.Cancel(follower.ticket()));
+  EXPECT_TRUE(mux.Cancel(leader.ticket()));
+}
+
+// The leader's deadline passes first. Its failure is not the follower's:
+// the follower keeps waiting on its own slot and starts a flight of its own.
+TEST(SingleFlightTest, LeaderWithShorterDeadlineOrphansFollower) {
+  natscpp::connection nc{natscpp::connection_options{}};
+  ReplyMux mux(nc, 8, 5ms, ReplyMux::ChunkOptions{});
+  SingleFlight flights(1);
+  Request leader(flights, mux);
+  Request follower(flights, mux);
+
+  ASSERT_EQ(leader.Join(ReplyMux::Clock::now() + 20ms), SingleFlight::Role::kLeader);
+  ASSERT_EQ(follower.Join(ReplyMux::Clock::now() + 2s), SingleFlight::Role::kFollower);
+
+  ASSERT_TRUE(follower.WaitUntil([](const Request &r) { return r.orphaned_role_.has_value(); }));
+  EXPECT_EQ(*follower.orphaned_role_, SingleFlight::Role::kLeader);
+  EXPECT_EQ(leader.timeouts_, 1);
+  EXPECT_EQ(follower.timeouts_, 0);
+  EXPECT_TRUE(follower.shared_.empty());
+  // Still waiting under its own deadline.
+  EXPECT_TRUE(mux.Cancel(follower.ticket()));
+}
+
+} // namespace